@@ -59,6 +59,9 @@ class SimEngineUnicorn(SuccessorsMixin):
         if unicorn.countdown_nonunicorn_blocks > 0:
             l.info("not enough runs since last unicorn (%d)", unicorn.countdown_nonunicorn_blocks)
             return False
+        if o.UNICORN_SKIP_SHORT_ENTRIES in state.options and unicorn.skip_entry(state.addr):
+            l.info("unicorn keeps stopping right away at %#x", state.addr)
+            return False
         if unicorn.countdown_stop_point > 0:
             l.info("not enough blocks since stop point (%d more)", unicorn.countdown_stop_point)
         elif o.UNICORN_SYM_REGS_SUPPORT not in state.options and not unicorn._check_registers():
@@ -390,7 +390,7 @@ class Tracer(ExplorationTechnique):
                 raise Exception("TODO")
 
             for addr in state.history.recent_bbl_addrs:
-                if addr == state.unicorn.transmit_addr:
+                if addr == state.unicorn.transmit_addr or addr in state.unicorn.syscall_addrs.values():
                     continue
 
 
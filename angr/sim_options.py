@@ -160,6 +160,25 @@ UNICORN_SYM_REGS_SUPPORT = "UNICORN_SYM_REGS_SUPPORT"
 UNICORN_TRACK_BBL_ADDRS = "UNICORN_TRACK_BBL_ADDRS"
 UNICORN_TRACK_STACK_POINTERS = "UNICORN_TRACK_STACK_POINTERS"
 
+# roll back memory in unicorn from whole saved cache lines rather than per-write records
+UNICORN_UNDO_LOG = "UNICORN_UNDO_LOG"
+
+# only hook unicorn memory reads and writes around pages that track taint, so concrete memory runs unhooked
+UNICORN_SCOPED_MEM_HOOKS = "UNICORN_SCOPED_MEM_HOOKS"
+
+# with UNICORN_SCOPED_MEM_HOOKS, catch writes to concrete pages mapped straight from the state's memory by write-protecting
+# them instead of hooking every store
+UNICORN_GUARD_CONCRETE_PAGES = "UNICORN_GUARD_CONCRETE_PAGES"
+
+# collect a block histogram, stop reasons and native hook times from unicorn, see Unicorn.profile()
+UNICORN_PROFILE = "UNICORN_PROFILE"
+
+# while no taint is live in unicorn, only checkpoint every few blocks and replay from the last checkpoint on rollback
+UNICORN_CONCRETE_CHECKPOINTS = "UNICORN_CONCRETE_CHECKPOINTS"
+
+# step blocks without unicorn at addresses where runs of it keep stopping right away, see Unicorn.skip_entry()
+UNICORN_SKIP_SHORT_ENTRIES = "UNICORN_SKIP_SHORT_ENTRIES"
+
 # concretize symbolic data when we see it "too often"
 UNICORN_THRESHOLD_CONCRETIZATION = "UNICORN_THRESHOLD_CONCRETIZATION"
 
@@ -168,6 +187,9 @@ UNICORN_AGGRESSIVE_CONCRETIZATION = "UNICORN_AGGRESSIVE_CONCRETIZATION"
 
 UNICORN_HANDLE_TRANSMIT_SYSCALL = "UNICORN_HANDLE_TRANSMIT_SYSCALL"
 
+# also emulate cgc receive, fdwait, allocate, deallocate and random in unicorn when it is safe to, see Unicorn.receive_data
+UNICORN_HANDLE_CGC_SYSCALLS = "UNICORN_HANDLE_CGC_SYSCALLS"
+
 # floating point support
 SUPPORT_FLOATING_POINT = "SUPPORT_FLOATING_POINT"
 
@@ -59,6 +59,7 @@ class SimCGC(SimUserland):
 
         # set up the address for concrete transmits
         s.unicorn.transmit_addr = self.syscall_from_number(2).addr
+        s.unicorn.syscall_addrs = {n: self.syscall_from_number(n).addr for n in range(2, 8)}
 
         s.libc.max_str_len = 1000000
         s.libc.max_strtol_len = 10
@@ -4,6 +4,7 @@ import copy
 import ctypes
 import cffi # lmao
 import threading
+import atexit
 import itertools
 import pkg_resources
 import logging
@@ -11,6 +12,7 @@ import pyvex
 import claripy
 import time
 import binascii
+import collections
 
 from ..sim_options import UNICORN_HANDLE_TRANSMIT_SYSCALL
 from ..errors import SimValueError, SimUnicornUnsupport, SimSegfaultError, SimMemoryError, SimMemoryMissingError, SimUnicornError
@@ -32,17 +34,100 @@ class MEM_PATCH(ctypes.Structure): # mem_update_t
 MEM_PATCH._fields_ = [
         ('address', ctypes.c_uint64),
         ('length', ctypes.c_uint64),
-        ('next', ctypes.POINTER(MEM_PATCH))
+        ('offset', ctypes.c_uint64)
     ]
 
 class TRANSMIT_RECORD(ctypes.Structure): # transmit_record_t
     pass
 
 TRANSMIT_RECORD._fields_ = [
-        ('data', ctypes.c_void_p),
+        ('offset', ctypes.c_uint64),
         ('count', ctypes.c_uint32)
     ]
 
+class RECEIVE_RECORD(ctypes.Structure): # receive_record_t
+    _fields_ = [
+        ('fd', ctypes.c_uint32),
+        ('count', ctypes.c_uint32),
+    ]
+
+class MAP_CHANGE(ctypes.Structure): # map_change_t
+    _fields_ = [
+        ('address', ctypes.c_uint64),
+        ('length', ctypes.c_uint64),
+        ('perms', ctypes.c_uint32),
+    ]
+
+class SYSCALL_RESULTS(ctypes.Structure): # syscall_results_t
+    _fields_ = [
+        ('allocation_base', ctypes.c_uint64),
+        ('random_state', ctypes.c_uint64),
+        ('fdwait_time', ctypes.c_uint64),
+        ('receives', ctypes.c_uint64),
+        ('map_changes', ctypes.c_uint64),
+    ]
+
+class REGISTER_RANGE(ctypes.Structure): # register_range_t
+    _fields_ = [
+        ('offset', ctypes.c_uint16),
+        ('length', ctypes.c_uint16),
+    ]
+
+class REGISTER_CHANGE(ctypes.Structure): # register_change_t
+    _fields_ = [
+        ('offset', ctypes.c_uint16),
+        ('length', ctypes.c_uint16),
+        ('symbolic', ctypes.c_uint8),
+    ]
+
+class CACHE_STATS(ctypes.Structure): # cache_stats_t
+    _fields_ = [
+        ('page_hits', ctypes.c_uint64),
+        ('page_misses', ctypes.c_uint64),
+        ('block_hits', ctypes.c_uint64),
+        ('block_misses', ctypes.c_uint64),
+        ('evictions', ctypes.c_uint64),
+        ('bytes_resident', ctypes.c_uint64),
+        ('keys_resident', ctypes.c_uint64),
+        ('bytes_budget', ctypes.c_uint64),
+        ('block_full_lifts', ctypes.c_uint64),
+        ('blocks_prelifted', ctypes.c_uint64),
+    ]
+
+class PRELIFT_BLOCK(ctypes.Structure): # prelift_block_t
+    _fields_ = [
+        ('address', ctypes.c_uint64),
+        ('size', ctypes.c_uint64),
+    ]
+
+ENTRY_RECENT_RUNS = 8
+
+class ENTRY_STATS(ctypes.Structure): # entry_stats_t
+    _fields_ = [
+        ('address', ctypes.c_uint64),
+        ('runs', ctypes.c_uint64),
+        ('steps', ctypes.c_uint64),
+        ('skips', ctypes.c_uint64),
+        ('recent_steps', ctypes.c_uint32 * ENTRY_RECENT_RUNS),
+        ('recent_stops', ctypes.c_uint8 * ENTRY_RECENT_RUNS),
+    ]
+
+class BATCH_RESULT(ctypes.Structure): # batch_result_t
+    _fields_ = [
+        ('errors', ctypes.POINTER(ctypes.c_int)),
+        ('stop_reasons', ctypes.POINTER(ctypes.c_int)),
+        ('steps', ctypes.POINTER(ctypes.c_uint64)),
+        ('stopping_registers', ctypes.POINTER(ctypes.c_uint64)),
+        ('stopping_memory', ctypes.POINTER(ctypes.c_uint64)),
+        ('update_first', ctypes.POINTER(ctypes.c_uint64)),
+        ('update_count', ctypes.POINTER(ctypes.c_uint64)),
+        ('update_truncated', ctypes.POINTER(ctypes.c_uint8)),
+        ('updates', ctypes.POINTER(MEM_PATCH)),
+        ('max_updates', ctypes.c_uint64),
+        ('data', ctypes.c_void_p),
+        ('data_size', ctypes.c_uint64),
+    ]
+
 class STOP:  # stop_t
     STOP_NORMAL         = 0
     STOP_STOPPOINT      = 1
@@ -65,6 +150,40 @@ class STOP:  # stop_t
                 return item
         raise ValueError(num)
 
+class TRACE:  # trace_kind_t
+    TRACE_BBL_ADDRS         = 0
+    TRACE_STACK_POINTERS    = 1
+
+COVERAGE_MAP_SIZE = 1 << 16
+
+class SYSCALL_HANDLER:  # syscall_handler_t
+    SYSCALL_HANDLER_NONE        = 0
+    SYSCALL_HANDLER_TRANSMIT    = 1
+    SYSCALL_HANDLER_RECEIVE     = 2
+    SYSCALL_HANDLER_FDWAIT      = 3
+    SYSCALL_HANDLER_ALLOCATE    = 4
+    SYSCALL_HANDLER_DEALLOCATE  = 5
+    SYSCALL_HANDLER_RANDOM      = 6
+
+PROFILE_HOOKS = ('mem_read', 'mem_write', 'mem_unmapped', 'mem_prot', 'block', 'intr') # profile_hook_t
+
+class PROFILE_STATS(ctypes.Structure): # profile_stats_t
+    _fields_ = [
+        ('blocks', ctypes.c_uint64),
+        ('rejected_blocks', ctypes.c_uint64),
+        ('histogram_dropped', ctypes.c_uint64),
+        ('stop_reasons', ctypes.c_uint64 * (STOP.STOP_HLT + 1)),
+        ('hook_calls', ctypes.c_uint64 * len(PROFILE_HOOKS)),
+        ('hook_nanoseconds', ctypes.c_uint64 * len(PROFILE_HOOKS)),
+    ]
+
+class PROFILE_BLOCK(ctypes.Structure): # profile_block_t
+    _fields_ = [
+        ('address', ctypes.c_uint64),
+        ('executions', ctypes.c_uint64),
+        ('rejections', ctypes.c_uint64),
+    ]
+
 #
 # Memory mapping errors - only used internally
 #
@@ -112,6 +231,7 @@ class Uniwrapper(unicorn.Uc if unicorn is not None else object):
             uc_mode = arch.uc_mode_thumb
         else:
             uc_mode = arch.uc_mode
+        self.uc_mode = uc_mode
         unicorn.Uc.__init__(self, arch.uc_arch, uc_mode)
 
     def hook_add(self, htype, callback, user_data=None, begin=1, end=0, arg1=0):
@@ -165,6 +285,67 @@ class Uniwrapper(unicorn.Uc if unicorn is not None else object):
 _unicorn_tls = threading.local()
 _unicorn_tls.uc = None
 
+class _UnicornProfile(object):
+    """
+    Execution profile accumulated over every unicorn run made with the UNICORN_PROFILE option.
+    """
+
+    # the number of hottest blocks to collect from each run
+    HOT_BLOCKS = 256
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.reset()
+
+    def reset(self):
+        self.runs = 0
+        self.blocks = 0
+        self.rejected_blocks = 0
+        self.histogram_dropped = 0
+        self.stop_reasons = collections.Counter()
+        self.hook_calls = collections.Counter()
+        self.hook_time = collections.Counter()
+        self.block_executions = collections.Counter()
+        self.block_rejections = collections.Counter()
+
+    def collect(self, uc_state):
+        stats = PROFILE_STATS()
+        _UC_NATIVE.profile_stats(uc_state, ctypes.byref(stats))
+        hot = (PROFILE_BLOCK * self.HOT_BLOCKS)()
+        n = _UC_NATIVE.profile_histogram(uc_state, hot, self.HOT_BLOCKS)
+
+        with self.lock:
+            self.runs += 1
+            self.blocks += stats.blocks
+            self.rejected_blocks += stats.rejected_blocks
+            self.histogram_dropped += stats.histogram_dropped
+            for reason, count in enumerate(stats.stop_reasons):
+                if count:
+                    self.stop_reasons[STOP.name_stop(reason)] += count
+            for i, hook in enumerate(PROFILE_HOOKS):
+                self.hook_calls[hook] += stats.hook_calls[i]
+                self.hook_time[hook] += stats.hook_nanoseconds[i] / 1e9
+            for block in hot[:n]:
+                self.block_executions[block.address] += block.executions
+                if block.rejections:
+                    self.block_rejections[block.address] += block.rejections
+
+    def as_dict(self, top=20):
+        with self.lock:
+            return {
+                'runs': self.runs,
+                'blocks': self.blocks,
+                'rejected_blocks': self.rejected_blocks,
+                'histogram_dropped': self.histogram_dropped,
+                'stop_reasons': dict(self.stop_reasons),
+                'hook_calls': dict(self.hook_calls),
+                'hook_time': dict(self.hook_time),
+                'hot_blocks': self.block_executions.most_common(top),
+                'rejecting_blocks': self.block_rejections.most_common(top),
+            }
+
+_unicorn_profile = _UnicornProfile()
+
 class _VexCacheInfo(ctypes.Structure):
     _fields_ = [
         ("num_levels", ctypes.c_uint),
@@ -214,22 +395,64 @@ def _load_native():
             getattr(handle, func).argtypes = argtypes
 
         #_setup_prototype_explicit(h, 'logSetLogLevel', None, ctypes.c_uint64)
-        _setup_prototype(h, 'alloc', state_t, uc_engine_t, ctypes.c_uint64)
+        _setup_prototype(h, 'alloc', state_t, uc_engine_t, ctypes.c_uint64, ctypes.c_int, ctypes.c_int)
         _setup_prototype(h, 'dealloc', None, state_t)
+        _setup_prototype(h, 'fork', state_t, state_t, uc_engine_t)
+        _setup_prototype(h, 'load_block_cache', ctypes.c_int64, ctypes.c_uint64, ctypes.c_char_p, ctypes.c_uint64)
+        _setup_prototype(h, 'save_block_cache', ctypes.c_int64, ctypes.c_uint64, ctypes.c_char_p, ctypes.c_uint64)
+        _setup_prototype(h, 'prelift', ctypes.c_uint64, ctypes.c_uint64, VexArch, _VexArchInfo, ctypes.c_uint64,
+                         ctypes.POINTER(PRELIFT_BLOCK), ctypes.c_char_p)
+        _setup_prototype(h, 'prelift_pending', ctypes.c_uint64)
+        _setup_prototype(h, 'prelift_shutdown', None)
+        _setup_prototype(h, 'vex_lock', None)
+        _setup_prototype(h, 'vex_unlock', None)
+        _setup_prototype(h, 'entry_stats', ctypes.c_uint64, ctypes.c_uint64, ctypes.POINTER(ENTRY_STATS), ctypes.c_uint64)
+        _setup_prototype(h, 'skip_entry', ctypes.c_bool, ctypes.c_uint64, ctypes.c_uint64, ctypes.c_uint64,
+                         ctypes.c_uint64, ctypes.c_uint64)
+        _setup_prototype(h, 'cache_set_budget', None, ctypes.c_uint64)
+        _setup_prototype(h, 'cache_stats', None, ctypes.POINTER(CACHE_STATS))
+        # cache contexts of their own, and the exports on their cache keys
+        context_t = ctypes.c_void_p
+        _setup_prototype(h, 'context_alloc', context_t)
+        _setup_prototype(h, 'context_free', None, context_t)
+        _setup_prototype(h, 'context_alloc_state', state_t, context_t, uc_engine_t, ctypes.c_uint64, ctypes.c_int,
+                         ctypes.c_int)
+        _setup_prototype(h, 'context_set_budget', None, context_t, ctypes.c_uint64)
+        _setup_prototype(h, 'context_stats', None, context_t, ctypes.POINTER(CACHE_STATS))
+        _setup_prototype(h, 'context_load_block_cache', ctypes.c_int64, context_t, ctypes.c_uint64, ctypes.c_char_p,
+                         ctypes.c_uint64)
+        _setup_prototype(h, 'context_save_block_cache', ctypes.c_int64, context_t, ctypes.c_uint64, ctypes.c_char_p,
+                         ctypes.c_uint64)
+        _setup_prototype(h, 'context_prelift', ctypes.c_uint64, context_t, ctypes.c_uint64, VexArch, _VexArchInfo,
+                         ctypes.c_uint64, ctypes.POINTER(PRELIFT_BLOCK), ctypes.c_char_p)
+        _setup_prototype(h, 'context_entry_stats', ctypes.c_uint64, context_t, ctypes.c_uint64,
+                         ctypes.POINTER(ENTRY_STATS), ctypes.c_uint64)
+        _setup_prototype(h, 'context_skip_entry', ctypes.c_bool, context_t, ctypes.c_uint64, ctypes.c_uint64,
+                         ctypes.c_uint64, ctypes.c_uint64, ctypes.c_uint64)
+        _setup_prototype(h, 'context_share_page_cache', ctypes.c_int64, context_t, ctypes.c_uint64, ctypes.c_char_p,
+                         ctypes.c_uint64, ctypes.c_uint64)
+        _setup_prototype(h, 'set_log', None, ctypes.c_int, ctypes.c_uint64)
+        _setup_prototype(h, 'flush_log', ctypes.c_uint64)
         _setup_prototype(h, 'hook', None, state_t)
         _setup_prototype(h, 'unhook', None, state_t)
         _setup_prototype(h, 'start', uc_err, state_t, ctypes.c_uint64, ctypes.c_uint64)
+        _setup_prototype(h, 'start_batch', None, ctypes.c_uint64, ctypes.POINTER(state_t), ctypes.POINTER(ctypes.c_uint64), ctypes.POINTER(ctypes.c_uint64), ctypes.POINTER(BATCH_RESULT))
         _setup_prototype(h, 'stop', None, state_t, stop_t)
-        _setup_prototype(h, 'sync', ctypes.POINTER(MEM_PATCH), state_t)
+        _setup_prototype(h, 'sync_size', None, state_t, ctypes.POINTER(ctypes.c_uint64), ctypes.POINTER(ctypes.c_uint64))
+        _setup_prototype(h, 'sync', ctypes.c_uint64, state_t, ctypes.POINTER(MEM_PATCH), ctypes.c_uint64, ctypes.c_void_p, ctypes.c_uint64)
         _setup_prototype(h, 'bbl_addrs', ctypes.POINTER(ctypes.c_uint64), state_t)
         _setup_prototype(h, 'stack_pointers', ctypes.POINTER(ctypes.c_uint64), state_t)
         _setup_prototype(h, 'bbl_addr_count', ctypes.c_uint64, state_t)
         _setup_prototype(h, 'syscall_count', ctypes.c_uint64, state_t)
-        _setup_prototype(h, 'destroy', None, ctypes.POINTER(MEM_PATCH))
         _setup_prototype(h, 'step', ctypes.c_uint64, state_t)
         _setup_prototype(h, 'stop_reason', stop_t, state_t)
         _setup_prototype(h, 'activate_page', None, state_t, ctypes.c_uint64, ctypes.c_void_p, ctypes.c_void_p)
+        _setup_prototype(h, 'activate_pages', None, state_t, ctypes.c_uint64, ctypes.c_uint64, ctypes.POINTER(ctypes.c_void_p), ctypes.POINTER(ctypes.c_void_p))
         _setup_prototype(h, 'set_stops', None, state_t, ctypes.c_uint64, ctypes.POINTER(ctypes.c_uint64))
+        _setup_prototype(h, 'add_stops', None, state_t, ctypes.c_uint64, ctypes.POINTER(ctypes.c_uint64))
+        _setup_prototype(h, 'remove_stops', None, state_t, ctypes.c_uint64, ctypes.POINTER(ctypes.c_uint64))
+        _setup_prototype(h, 'share_page_cache', ctypes.c_int64, ctypes.c_uint64, ctypes.c_char_p, ctypes.c_uint64, ctypes.c_uint64)
+        _setup_prototype(h, 'unlink_shared_page_cache', ctypes.c_bool, ctypes.c_char_p)
         _setup_prototype(h, 'cache_page', ctypes.c_bool, state_t, ctypes.c_uint64, ctypes.c_uint64, ctypes.c_char_p, ctypes.c_uint64)
         _setup_prototype(h, 'uncache_pages_touching_region', None, state_t, ctypes.c_uint64, ctypes.c_uint64)
         _setup_prototype(h, 'clear_page_cache', None, state_t)
@@ -237,13 +460,33 @@ def _load_native():
         _setup_prototype(h, 'disable_symbolic_reg_tracking', None, state_t)
         _setup_prototype(h, 'symbolic_register_data', None, state_t, ctypes.c_uint64, ctypes.POINTER(ctypes.c_uint64))
         _setup_prototype(h, 'get_symbolic_registers', ctypes.c_uint64, state_t, ctypes.POINTER(ctypes.c_uint64))
+        _setup_prototype(h, 'symbolic_register_ranges', None, state_t, ctypes.c_uint64, ctypes.POINTER(REGISTER_RANGE))
+        _setup_prototype(h, 'symbolic_register_changes', ctypes.c_uint64, state_t, ctypes.POINTER(REGISTER_CHANGE), ctypes.c_uint64)
         _setup_prototype(h, 'stopping_register', ctypes.c_uint64, state_t)
         _setup_prototype(h, 'stopping_memory', ctypes.c_uint64, state_t)
         _setup_prototype(h, 'is_interrupt_handled', ctypes.c_bool, state_t)
         _setup_prototype(h, 'set_transmit_sysno', None, state_t, ctypes.c_uint32, ctypes.c_uint64)
-        _setup_prototype(h, 'process_transmit', ctypes.POINTER(TRANSMIT_RECORD), state_t, ctypes.c_uint32)
+        _setup_prototype(h, 'transmits', ctypes.c_void_p, state_t, ctypes.POINTER(ctypes.POINTER(TRANSMIT_RECORD)), ctypes.POINTER(ctypes.c_uint64), ctypes.POINTER(ctypes.c_uint64))
+        _setup_prototype(h, 'set_syscall', None, state_t, ctypes.c_uint32, ctypes.c_uint32, ctypes.c_uint64)
+        _setup_prototype(h, 'set_receive_data', None, state_t, ctypes.c_uint32, ctypes.c_char_p, ctypes.c_uint64)
+        _setup_prototype(h, 'set_allocation', None, state_t, ctypes.c_uint64, ctypes.c_uint64, ctypes.c_bool)
+        _setup_prototype(h, 'set_random_seed', None, state_t, ctypes.c_uint64)
+        _setup_prototype(h, 'syscall_results', None, state_t, ctypes.POINTER(SYSCALL_RESULTS))
+        _setup_prototype(h, 'map_changes', ctypes.c_uint64, state_t, ctypes.POINTER(MAP_CHANGE), ctypes.c_uint64)
+        _setup_prototype(h, 'process_receive', ctypes.POINTER(RECEIVE_RECORD), state_t, ctypes.c_uint32)
         _setup_prototype(h, 'set_tracking', None, state_t, ctypes.c_bool, ctypes.c_bool)
-        _setup_prototype(h, 'executed_pages', ctypes.c_uint64, state_t)
+        _setup_prototype(h, 'set_coverage', None, state_t, ctypes.c_void_p, ctypes.c_bool)
+        _setup_prototype(h, 'set_undo_log', None, state_t, ctypes.c_bool)
+        _setup_prototype(h, 'set_scoped_hooks', None, state_t, ctypes.c_bool)
+        _setup_prototype(h, 'set_guard_pages', None, state_t, ctypes.c_bool)
+        _setup_prototype(h, 'set_checkpoint_interval', None, state_t, ctypes.c_uint64)
+        _setup_prototype(h, 'profile_enable', None, state_t, ctypes.c_bool)
+        _setup_prototype(h, 'profile_stats', None, state_t, ctypes.POINTER(PROFILE_STATS))
+        _setup_prototype(h, 'profile_histogram', ctypes.c_uint64, state_t, ctypes.POINTER(PROFILE_BLOCK), ctypes.c_uint64)
+        _setup_prototype(h, 'executed_pages', ctypes.c_uint64, state_t, ctypes.POINTER(ctypes.c_uint64), ctypes.c_uint64)
+        _setup_prototype(h, 'set_trace', None, state_t, ctypes.c_uint64, ctypes.c_bool)
+        _setup_prototype(h, 'trace_stats', None, state_t, ctypes.c_int, ctypes.POINTER(ctypes.c_uint64), ctypes.POINTER(ctypes.c_uint64), ctypes.POINTER(ctypes.c_uint64))
+        _setup_prototype(h, 'trace_drain', ctypes.c_uint64, state_t, ctypes.c_int, ctypes.c_void_p, ctypes.c_uint64, ctypes.POINTER(ctypes.c_uint64))
         _setup_prototype(h, 'in_cache', ctypes.c_bool, state_t, ctypes.c_uint64)
         _setup_prototype(h, 'set_map_callback', None, state_t, unicorn.unicorn.UC_HOOK_MEM_INVALID_CB)
 
@@ -254,11 +497,56 @@ def _load_native():
         l.warning('failed loading "%s", unicorn support disabled (%s)', libfile, e)
         raise ImportError("Unable to import native SimUnicorn support") from e
 
+class _SharedVexLock:
+    """
+    Stands in for pyvex's lifting lock, and holds the native one along with it, so that the lifts pyvex makes never run
+    in libvex at the same time as those of the native prelift worker.
+    """
+    def __init__(self, lock, native):
+        self._lock = lock
+        self._native = native
+
+    def acquire(self, *args, **kwargs):
+        if not self._lock.acquire(*args, **kwargs):
+            return False
+        self._native.vex_lock()
+        return True
+
+    def release(self):
+        self._native.vex_unlock()
+        self._lock.release()
+
+    def __enter__(self):
+        return self.acquire()
+
+    def __exit__(self, *args):
+        self.release()
+
+def _share_vex_lock(native):
+    """
+    Make pyvex lift under the native lock, see _SharedVexLock.
+
+    :return: Whether pyvex's lock could be found. Without it, prelifting is not safe.
+    """
+    try:
+        from pyvex.lifting import libvex as pyvex_libvex # pylint: disable=import-outside-toplevel
+        lock = pyvex_libvex._libvex_lock
+    except (ImportError, AttributeError):
+        l.warning("pyvex's lifting lock not found, prelifting disabled")
+        return False
+    if not isinstance(lock, _SharedVexLock):
+        pyvex_libvex._libvex_lock = _SharedVexLock(lock, native)
+    return True
+
 try:
     _UC_NATIVE = _load_native()
     #_UC_NATIVE.logSetLogLevel(2)
+    _PRELIFT_SAFE = _share_vex_lock(_UC_NATIVE)
+    # join the prelift worker before the interpreter goes away
+    atexit.register(_UC_NATIVE.prelift_shutdown)
 except ImportError:
     _UC_NATIVE = None
+    _PRELIFT_SAFE = False
 
 
 class Unicorn(SimStatePlugin):
@@ -267,6 +555,7 @@ class Unicorn(SimStatePlugin):
     '''
 
     UC_CONFIG = {} # config cache for each arch
+    _PRELIFT_BYTES = 800 # MAX_BB_SIZE in sim_unicorn.cpp: no block unicorn runs is longer
 
     def __init__(
         self,
@@ -324,6 +613,7 @@ class Unicorn(SimStatePlugin):
         self._mapped = 0
         self._uncache_regions = []
         self._symbolic_offsets = None
+        self._entry_symbolic_offsets = frozenset()
         self.gdt = None
 
         # following variables are used in python level hook
@@ -332,6 +622,10 @@ class Unicorn(SimStatePlugin):
 
         # native state in libsimunicorn
         self._uc_state = None
+        # the engine of a native state cloned by fork(), instead of the thread-local one
+        self._uc = None
+        # the pages of this state's memory when fork() cloned the native state, until setup() checks they are unchanged
+        self._fork_pages = None
         self.stop_reason = None
 
         # this is the counter for the unicorn count
@@ -365,11 +659,43 @@ class Unicorn(SimStatePlugin):
         # the address to use for concrete transmits
         self.transmit_addr = None
 
+        # with UNICORN_HANDLE_CGC_SYSCALLS, the addresses of the syscalls to handle natively by number, the input that
+        # receive may consume natively by fd, and the seed of the stream that random is emulated with, if any
+        self.syscall_addrs = { }
+        self.receive_data = { }
+        self.random_seed = None
+
+        # if set, the bytes of native memory to keep the most recent block and stack pointer traces in, instead of
+        # growing them without bound. trace_delta stores them as compressed deltas.
+        self.trace_capacity = None
+        self.trace_delta = False
+
+        # if set, a writable buffer of COVERAGE_MAP_SIZE bytes that unicorn counts the edges between blocks in, the way
+        # afl does. it may be shared by several states. coverage_block_hook_only leaves out every native hook but the
+        # block one, so memory is neither tracked nor synced back: it is for concrete runs whose end state is dropped.
+        self.coverage_map = None
+        self.coverage_block_hook_only = False
+
+        # the number of blocks between checkpoints with UNICORN_CONCRETE_CHECKPOINTS
+        self.checkpoint_interval = 64
+
+        # the number of pages to map when unicorn faults on a page, starting with the faulting one
+        self.read_ahead = 10
+
+        # with UNICORN_SKIP_SHORT_ENTRIES, addresses where each of the last entry_min_runs runs of unicorn stopped
+        # within entry_short_run blocks are stepped without it. every entry_retry_interval times, it gets a new try.
+        self.entry_short_run = 4
+        self.entry_min_runs = 4
+        self.entry_retry_interval = 16
+
         self.time = None
 
         self._bullshit_cb = ctypes.cast(unicorn.unicorn.UC_HOOK_MEM_INVALID_CB(self._hook_mem_unmapped), unicorn.unicorn.UC_HOOK_MEM_INVALID_CB)
         self._skip_next_callback = False
 
+        # results of the last start_batch() for this plugin, consumed by finish()
+        self._batch_result = None
+
     @SimStatePlugin.memo
     def copy(self, _memo):
         u = Unicorn(
@@ -395,6 +721,18 @@ class Unicorn(SimStatePlugin):
         u.countdown_symbolic_memory = self.countdown_symbolic_memory
         u.countdown_stop_point = self.countdown_stop_point
         u.transmit_addr = self.transmit_addr
+        u.syscall_addrs = dict(self.syscall_addrs)
+        u.receive_data = dict(self.receive_data)
+        u.random_seed = self.random_seed
+        u.trace_capacity = self.trace_capacity
+        u.trace_delta = self.trace_delta
+        u.coverage_map = self.coverage_map
+        u.coverage_block_hook_only = self.coverage_block_hook_only
+        u.checkpoint_interval = self.checkpoint_interval
+        u.read_ahead = self.read_ahead
+        u.entry_short_run = self.entry_short_run
+        u.entry_min_runs = self.entry_min_runs
+        u.entry_retry_interval = self.entry_retry_interval
         u._uncache_regions = list(self._uncache_regions)
         u.gdt = self.gdt
         return u
@@ -466,6 +804,8 @@ class Unicorn(SimStatePlugin):
         d = dict(self.__dict__)
         del d['_bullshit_cb']
         del d['_uc_state']
+        del d['_uc']
+        del d['_fork_pages']
         del d['cache_key']
         del d['_unicount']
         return d
@@ -475,6 +815,8 @@ class Unicorn(SimStatePlugin):
         self._bullshit_cb = ctypes.cast(unicorn.unicorn.UC_HOOK_MEM_INVALID_CB(self._hook_mem_unmapped), unicorn.unicorn.UC_HOOK_MEM_INVALID_CB)
         self._unicount = next(_unicounter)
         self._uc_state = None
+        self._uc = None
+        self._fork_pages = None
         self.cache_key = hash(self)
         _unicorn_tls.uc = None
 
@@ -489,6 +831,9 @@ class Unicorn(SimStatePlugin):
 
     @property
     def uc(self):
+        if self._uc is not None:
+            return self._uc
+
         new_id = next(_unicounter)
         is_thumb = self.state.arch.qemu_name == 'arm' and self.state.arch.is_thumb(self.state.addr)
         if (
@@ -516,6 +861,206 @@ class Unicorn(SimStatePlugin):
     def delete_uc():
         _unicorn_tls.uc = None
 
+    def load_block_cache(self, path, binary_hash):
+        """
+        Warm up the native block feasibility cache of this state's cache key from a file written by
+        save_block_cache(), so that blocks do not have to be lifted again.
+
+        Under a cache budget (see set_cache_budget), the loaded blocks are not evicted before a state of this key first
+        goes into unicorn, even if they are over the budget on their own. From then on, the key is evicted like any
+        other once it is idle.
+
+        :param path:        The cache file.
+        :param binary_hash: A 64-bit hash identifying the binary (and architecture) the file was written for. Files
+                            written with a different hash are rejected.
+        :return:            The number of blocks loaded, or -1 if the file is missing or does not match.
+        """
+        return _UC_NATIVE.load_block_cache(self.cache_key, path.encode(), binary_hash & (2**64 - 1))
+
+    def save_block_cache(self, path, binary_hash):
+        """
+        Write the native block feasibility cache of this state's cache key to a file.
+
+        :param path:        The cache file. It is replaced atomically.
+        :param binary_hash: A 64-bit hash identifying the binary (and architecture) the cache is for.
+        :return:            The number of blocks written, or -1 on error.
+        """
+        return _UC_NATIVE.save_block_cache(self.cache_key, path.encode(), binary_hash & (2**64 - 1))
+
+    def prelift(self, blocks):
+        """
+        Lift blocks on a native worker thread for the block feasibility cache of this state's cache key, so that
+        unicorn finds them already checked when it gets there instead of waiting for VEX. This returns right away.
+
+        :param blocks:  An iterable of block addresses, e.g. the addresses of the nodes of a CFG. Each is lifted from
+                        the binary's memory the way unicorn would run it, whatever the CFG thinks its size is.
+        :return:        The number of blocks waiting to be lifted, these included.
+        """
+        if self.state.project is None or not _PRELIFT_SAFE:
+            return 0
+        memory = self.state.project.loader.memory
+
+        records = [ ]
+        code = [ ]
+        for addr in sorted(set(blocks)):
+            try:
+                data = memory.load(addr, self._PRELIFT_BYTES)
+            except KeyError:
+                continue
+            if data:
+                records.append(PRELIFT_BLOCK(addr, len(data)))
+                code.append(data)
+        if not records:
+            return _UC_NATIVE.prelift_pending()
+
+        return _UC_NATIVE.prelift(
+            self.cache_key,
+            getattr(pyvex.pvc, self.state.arch.vex_arch),
+            self._vex_archinfo(),
+            len(records),
+            (PRELIFT_BLOCK * len(records))(*records),
+            b''.join(code),
+        )
+
+    def prelift_cfg(self, cfg):
+        """
+        Prelift the blocks of a CFG, see prelift().
+
+        :param cfg: A CFG analysis, or its CFGModel.
+        :return:    The number of blocks waiting to be lifted.
+        """
+        model = getattr(cfg, 'model', cfg)
+        return self.prelift(node.addr for node in model.nodes()
+                            if not node.is_simprocedure and not node.is_syscall and not node.thumb and node.size)
+
+    @staticmethod
+    def prelift_pending():
+        """
+        :return: The number of blocks still waiting to be lifted by prelift().
+        """
+        return _UC_NATIVE.prelift_pending()
+
+    @staticmethod
+    def prelift_shutdown():
+        """
+        Stop the prelift worker thread and join it, dropping the blocks it has not lifted yet. The next prelift() starts
+        it again. This is done at exit anyway.
+        """
+        _UC_NATIVE.prelift_shutdown()
+
+    def skip_entry(self, addr):
+        """
+        Whether unicorn keeps stopping right away when started at addr, so it is cheaper to step the block without
+        it, going by the native stats of this state's cache key. Each answer of True counts towards a retry.
+
+        :param addr:    The address unicorn would start at.
+        """
+        return _UC_NATIVE.skip_entry(self.cache_key, addr, self.entry_short_run, self.entry_min_runs,
+                                     self.entry_retry_interval)
+
+    def entry_stats(self):
+        """
+        :return: A dict from each address that unicorn was started at for this state's cache key to a dict of the
+                 number of runs, the steps of all of them, the skips since the last run, and the steps and stop
+                 reasons of the last runs, newest first.
+        """
+        count = _UC_NATIVE.entry_stats(self.cache_key, None, 0)
+        while True:
+            records = (ENTRY_STATS * count)()
+            total = _UC_NATIVE.entry_stats(self.cache_key, records, count)
+            if total <= count:
+                break
+            count = total
+
+        stats = { }
+        for record in records[:total]:
+            recent = min(record.runs, ENTRY_RECENT_RUNS)
+            stats[record.address] = {
+                'runs': record.runs,
+                'steps': record.steps,
+                'skips': record.skips,
+                'recent_steps': list(record.recent_steps[:recent]),
+                'recent_stops': [STOP.name_stop(s) for s in record.recent_stops[:recent]],
+            }
+        return stats
+
+    def share_page_cache(self, name, binary_hash, max_pages=0x4000):
+        """
+        Keep the non-writable pages that unicorn caches for this state's cache key in a named shared memory object,
+        so that all the processes working on one binary hold a single copy of them, and pages any one of them cached
+        are mapped by the others without going through Python. The key keeps using the object for as long as the
+        process lives, even if its caches are evicted under the cache budget in the meantime. Not available on Windows.
+
+        :param name:        The name of the shared memory object, such as "/angr-<hash>".
+        :param binary_hash: A 64-bit hash identifying the binary (and architecture). Objects created for a different
+                            hash are rejected.
+        :param max_pages:   The number of pages to make room for, if the object is created by this call.
+        :return:            The number of pages already in the object, or -1 if it could not be used.
+        """
+        return _UC_NATIVE.share_page_cache(self.cache_key, name.encode(), binary_hash & (2**64 - 1), max_pages)
+
+    @staticmethod
+    def unlink_shared_page_cache(name):
+        """
+        Remove a shared memory object made by share_page_cache(). Processes using it keep their pages.
+
+        :return:    Whether it existed and was removed.
+        """
+        return _UC_NATIVE.unlink_shared_page_cache(name.encode())
+
+    @staticmethod
+    def set_cache_budget(nbytes):
+        """
+        Limit the memory used by the native page and block caches of all cache keys. Caches of keys that no state is
+        using are evicted, least recently used first, once the limit is exceeded.
+
+        :param nbytes:  The budget in bytes, or None for no limit.
+        """
+        _UC_NATIVE.cache_set_budget(2**64 - 1 if nbytes is None else nbytes)
+
+    @staticmethod
+    def cache_stats():
+        """
+        :return: A dict of the native cache counters (hits, misses, evictions and resident bytes).
+        """
+        stats = CACHE_STATS()
+        _UC_NATIVE.cache_stats(ctypes.byref(stats))
+        return {name: getattr(stats, name) for name, _ in CACHE_STATS._fields_}
+
+    _NATIVE_LOG_LEVELS = {'FATAL': 0, 'ERROR': 1, 'WARNING': 2, 'INFO': 3, 'DEBUG': 4}
+
+    @staticmethod
+    def set_native_log(level='WARNING', writer_interval_ms=100):
+        """
+        Set what the native plugin logs to stderr. Below ERROR, records are queued per thread and written by a
+        background thread, or by flush_native_log() if writer_interval_ms is 0. Release builds leave out DEBUG, and
+        Windows builds all of it.
+
+        :param level:   One of FATAL, ERROR, WARNING, INFO (e.g. the reason unicorn stopped) or DEBUG.
+        """
+        _UC_NATIVE.set_log(Unicorn._NATIVE_LOG_LEVELS[level], writer_interval_ms)
+
+    @staticmethod
+    def flush_native_log():
+        """
+        :return: The number of queued native log records that were written.
+        """
+        return _UC_NATIVE.flush_log()
+
+    @staticmethod
+    def profile(top=20):
+        """
+        The execution profile of all the unicorn runs made with the UNICORN_PROFILE option so far.
+
+        :param top: The number of hottest blocks, and of blocks most often rejected by check_block, to return.
+        :return:    A dict of block, stop reason and hook counters, and of the seconds spent in each native hook.
+        """
+        return _unicorn_profile.as_dict(top)
+
+    @staticmethod
+    def reset_profile():
+        _unicorn_profile.reset()
+
     @property
     def _uc_regs(self):
         return self.state.arch.uc_regs
@@ -538,9 +1083,58 @@ class Unicorn(SimStatePlugin):
             (ctypes.c_uint64 * len(stop_points))(*map(ctypes.c_uint64, stop_points))
         )
 
+    def add_stops(self, stop_points):
+        _UC_NATIVE.add_stops(self._uc_state,
+            ctypes.c_uint64(len(stop_points)),
+            (ctypes.c_uint64 * len(stop_points))(*map(ctypes.c_uint64, stop_points))
+        )
+
+    def remove_stops(self, stop_points):
+        _UC_NATIVE.remove_stops(self._uc_state,
+            ctypes.c_uint64(len(stop_points)),
+            (ctypes.c_uint64 * len(stop_points))(*map(ctypes.c_uint64, stop_points))
+        )
+
     def set_tracking(self, track_bbls, track_stack):
         _UC_NATIVE.set_tracking(self._uc_state, track_bbls, track_stack)
 
+    def drain_trace(self, kind=TRACE.TRACE_BBL_ADDRS, chunk_size=0x10000):
+        """
+        Take the entries recorded so far out of a native trace ring. This can also be called from hooks during a run.
+
+        :param kind:        TRACE.TRACE_BBL_ADDRS or TRACE.TRACE_STACK_POINTERS.
+        :param chunk_size:  The number of bytes to copy out of native memory at a time.
+        :return:            The list of values, oldest first.
+        """
+        entries = ctypes.c_uint64()
+        size = ctypes.c_uint64()
+        dropped = ctypes.c_uint64()
+        _UC_NATIVE.trace_stats(self._uc_state, kind, ctypes.byref(entries), ctypes.byref(size), ctypes.byref(dropped))
+        if dropped.value:
+            l.debug("trace %d dropped its %d oldest entries", kind, dropped.value)
+
+        values = [ ]
+        buf = bytearray(chunk_size)
+        start = ctypes.c_uint64()
+        while True:
+            n = _UC_NATIVE.trace_drain(self._uc_state, kind, int(ffi.cast('uint64_t', ffi.from_buffer(buf))), len(buf), ctypes.byref(start))
+            if n == 0:
+                break
+            if not self.trace_delta:
+                values.extend(memoryview(buf)[:n].cast('Q'))
+                continue
+
+            # zigzag varint deltas from start
+            value, acc, shift = start.value, 0, 0
+            for b in buf[:n]:
+                acc |= (b & 0x7f) << shift
+                shift += 7
+                if not b & 0x80:
+                    value = (value + ((acc >> 1) ^ -(acc & 1))) & 0xffffffffffffffff
+                    values.append(value)
+                    acc, shift = 0, 0
+        return values
+
     def hook(self):
         #l.debug('adding native hooks')
         _UC_NATIVE.hook(self._uc_state) # prefer to use native hooks
@@ -718,48 +1312,64 @@ class Unicorn(SimStatePlugin):
         start = address & ~0xfff
         needed_pages = 2 if address - start + size > 0x1000 else 1
 
-        attempt_pages = 10
-        for pageno in range(attempt_pages):
-            page_addr = (start + pageno * 0x1000) & ((1 << self.state.arch.bits) - 1)
-            if page_addr == 0:
-                if pageno >= needed_pages:
-                    break
-                if options.UNICORN_ZEROPAGE_GUARD in self.state.options:
-                    self.error = 'accessing zero page (%#x)' % access
-                    l.warning(self.error)
-
-                    _UC_NATIVE.stop(self._uc_state, STOP.STOP_ZEROPAGE)
+        # the pages are activated in the native state in one go, once they have all been mapped
+        pages = [ ]
+        run_start = start
+        try:
+            for pageno in range(max(self.read_ahead, needed_pages)):
+                page_addr = (start + pageno * 0x1000) & ((1 << self.state.arch.bits) - 1)
+                if page_addr == 0:
+                    if pageno >= needed_pages:
+                        break
+                    if options.UNICORN_ZEROPAGE_GUARD in self.state.options:
+                        self.error = 'accessing zero page (%#x)' % access
+                        l.warning(self.error)
+
+                        _UC_NATIVE.stop(self._uc_state, STOP.STOP_ZEROPAGE)
+                        return False
+
+                if page_addr != run_start + len(pages) * 0x1000:
+                    # wrapped around the address space
+                    self._activate_pages(run_start, pages)
+                    pages, run_start = [ ], page_addr
+
+                l.info('mmap [%#x, %#x] because %d', page_addr, page_addr + 0xfff, access)
+                try:
+                    pages.append(self._map_one_page(uc, page_addr))
+                except SegfaultError:
+                    # this is the unicorn segfault error. idk why this would show up
+                    _UC_NATIVE.stop(self._uc_state, STOP.STOP_SEGFAULT)
                     return False
-
-            l.info('mmap [%#x, %#x] because %d', page_addr, page_addr + 0xfff, access)
-            try:
-                self._map_one_page(uc, page_addr)
-            except SegfaultError:
-                # this is the unicorn segfault error. idk why this would show up
-                _UC_NATIVE.stop(self._uc_state, STOP.STOP_SEGFAULT)
-                return False
-            except SimSegfaultError:
-                _UC_NATIVE.stop(self._uc_state, STOP.STOP_SEGFAULT)
-                return False
-            except unicorn.UcError as e:
-                if e.errno != 11:
-                    self.error = str(e)
-                    _UC_NATIVE.stop(self._uc_state, STOP.STOP_ERROR)
+                except SimSegfaultError:
+                    _UC_NATIVE.stop(self._uc_state, STOP.STOP_SEGFAULT)
                     return False
-                l.info("...already mapped :)")
-                break
-            except SimMemoryError as e:
-                if pageno >= needed_pages:
-                    l.info("...never mind")
+                except unicorn.UcError as e:
+                    if e.errno != 11:
+                        self.error = str(e)
+                        _UC_NATIVE.stop(self._uc_state, STOP.STOP_ERROR)
+                        return False
+                    l.info("...already mapped :)")
                     break
-                else:
-                    self.error = str(e)
-                    _UC_NATIVE.stop(self._uc_state, STOP.STOP_ERROR)
-                    return False
+                except SimMemoryError as e:
+                    if pageno >= needed_pages:
+                        l.info("...never mind")
+                        break
+                    else:
+                        self.error = str(e)
+                        _UC_NATIVE.stop(self._uc_state, STOP.STOP_ERROR)
+                        return False
+        finally:
+            self._activate_pages(run_start, pages)
 
         return True
 
     def _map_one_page(self, _uc, addr):
+        """
+        Map a page of memory into unicorn. It still has to be activated in the native state with _activate_pages().
+
+        :return: A tuple of the page's taint bitmap, and its data if it is mapped directly from the state's memory or
+                 None if it was copied.
+        """
         # allow any SimMemory errors to propagate upward. they will be caught immediately above
         perm = self.state.memory.permissions(addr)
 
@@ -784,14 +1394,12 @@ class Unicorn(SimStatePlugin):
             unicorn.unicorn._uc.uc_mem_write(self.uc._uch, addr, ctypes.cast(int(ffi.cast('uint64_t', ffi.from_buffer(data))), ctypes.c_void_p), len(data))
             #self.uc.mem_write(addr, data)
             self._mapped += 1
-            _UC_NATIVE.activate_page(self._uc_state, addr, int(ffi.cast('uint64_t', ffi.from_buffer(bitmap))), None)
+            return bitmap, None
         else:
             # new-style mapping, do it directly
             self.uc.mem_map_ptr(addr, 0x1000, perm, int(ffi.cast('uint64_t', ffi.from_buffer(data))))
             self._mapped += 1
-            _UC_NATIVE.activate_page(self._uc_state, addr, int(ffi.cast('uint64_t', ffi.from_buffer(bitmap))), int(ffi.cast('unsigned long', ffi.from_buffer(data))))
-
-        return
+            return bitmap, data
 
 
         # do the mapping
@@ -809,6 +1417,26 @@ class Unicorn(SimStatePlugin):
             _UC_NATIVE.activate(self._uc_state, start, length, taint[0] if taint else None)
             return True
 
+    def _activate_pages(self, start, pages):
+        """
+        Activate a run of consecutive pages mapped by _map_one_page() in the native state, with a single call.
+
+        :param start:   The address of the first page.
+        :param pages:   The (bitmap, data) tuples returned by _map_one_page() for each page.
+        """
+        count = len(pages)
+        if count == 0:
+            return
+
+        taint = (ctypes.c_void_p * count)(*(int(ffi.cast('uint64_t', ffi.from_buffer(bitmap))) for bitmap, _ in pages))
+        if all(data is None for _, data in pages):
+            data = None
+        else:
+            data = (ctypes.c_void_p * count)(*(
+                None if d is None else int(ffi.cast('uint64_t', ffi.from_buffer(d))) for _, d in pages
+            ))
+        _UC_NATIVE.activate_pages(self._uc_state, start, count, taint, data)
+
     def uncache_region(self, addr, length):
         self._uncache_regions.append((addr, length))
 
@@ -829,38 +1457,52 @@ class Unicorn(SimStatePlugin):
         return self.state.arch.name == "MIPS32"
 
     def setup(self):
+        if self.coverage_map is not None and len(self.coverage_map) < COVERAGE_MAP_SIZE:
+            raise SimValueError("The coverage map must hold %d bytes" % COVERAGE_MAP_SIZE)
+
         if self._is_mips32 and options.COPY_STATES not in self.state.options:
             # we always re-create the thread-local UC object for MIPS32 even if COPY_STATES is disabled in state
             # options. this is to avoid some weird bugs in unicorn (e.g., it reports stepping 1 step while in reality it
             # did not step at all).
             self.delete_uc()
         self._setup_unicorn()
+        if self._fork_pages is not None and not self._fork_unchanged():
+            l.debug("memory changed since the native state was forked, starting from an empty one")
+            self._drop_fork()
+        self._release_fork_pages()
         try:
             self.set_regs()
         except SimValueError:
             # reset the state and re-raise
             self.uc.reset()
+            if self._uc_state is not None:
+                _UC_NATIVE.dealloc(self._uc_state)
+                self._uc_state = None
+                self._uc = None
             raise
         # tricky: using unicorn handle from unicorn.Uc object
-        self._uc_state = _UC_NATIVE.alloc(self.uc._uch, self.cache_key)
+        forked = self._uc_state is not None
+        if not forked:
+            self._uc_state = _UC_NATIVE.alloc(self.uc._uch, self.cache_key, self.state.arch.uc_arch, self.uc.uc_mode)
 
         if options.UNICORN_SYM_REGS_SUPPORT in self.state.options and \
                 options.UNICORN_AGGRESSIVE_CONCRETIZATION not in self.state.options:
-            archinfo = copy.deepcopy(self.state.arch.vex_archinfo)
-            archinfo['hwcache_info']['caches'] = 0
-            archinfo['hwcache_info'] = _VexCacheInfo(**archinfo['hwcache_info'])
             _UC_NATIVE.enable_symbolic_reg_tracking(
                 self._uc_state,
                 getattr(pyvex.pvc, self.state.arch.vex_arch),
-                _VexArchInfo(**archinfo),
+                self._vex_archinfo(),
             )
 
             if self._symbolic_offsets:
                 l.debug("Sybmolic offsets: %s", self._symbolic_offsets)
-                sym_regs_array = (ctypes.c_uint64 * len(self._symbolic_offsets))(*map(ctypes.c_uint64, self._symbolic_offsets))
-                _UC_NATIVE.symbolic_register_data(self._uc_state, len(self._symbolic_offsets), sym_regs_array)
+                ranges = self._offset_ranges(self._symbolic_offsets)
+                sym_regs_array = (REGISTER_RANGE * len(ranges))(*ranges)
+                _UC_NATIVE.symbolic_register_ranges(self._uc_state, len(ranges), sym_regs_array)
             else:
-                _UC_NATIVE.symbolic_register_data(self._uc_state, 0, None)
+                _UC_NATIVE.symbolic_register_ranges(self._uc_state, 0, None)
+            self._entry_symbolic_offsets = frozenset(self._symbolic_offsets)
+        else:
+            self._entry_symbolic_offsets = frozenset()
 
         # set (cgc, for now) transmit syscall handler
         if UNICORN_HANDLE_TRANSMIT_SYSCALL in self.state.options and self.state.has_plugin('cgc'):
@@ -868,15 +1510,207 @@ class Unicorn(SimStatePlugin):
                 l.error("You haven't set the address for concrete transmits!!!!!!!!!!!")
                 self.transmit_addr = 0
             _UC_NATIVE.set_transmit_sysno(self._uc_state, 2, self.transmit_addr)
+        if options.UNICORN_HANDLE_CGC_SYSCALLS in self.state.options and self.state.has_plugin('cgc'):
+            self._setup_cgc_syscalls()
+
+        if options.UNICORN_UNDO_LOG in self.state.options:
+            _UC_NATIVE.set_undo_log(self._uc_state, True)
+        if options.UNICORN_SCOPED_MEM_HOOKS in self.state.options:
+            _UC_NATIVE.set_scoped_hooks(self._uc_state, True)
+            if options.UNICORN_GUARD_CONCRETE_PAGES in self.state.options:
+                _UC_NATIVE.set_guard_pages(self._uc_state, True)
+        if options.UNICORN_PROFILE in self.state.options:
+            _UC_NATIVE.profile_enable(self._uc_state, True)
+        if self.trace_capacity:
+            _UC_NATIVE.set_trace(self._uc_state, self.trace_capacity, self.trace_delta)
+        if self.coverage_map is not None:
+            _UC_NATIVE.set_coverage(self._uc_state, int(ffi.cast('uint64_t', ffi.from_buffer(self.coverage_map))),
+                                    self.coverage_block_hook_only)
+        if options.UNICORN_CONCRETE_CHECKPOINTS in self.state.options:
+            _UC_NATIVE.set_checkpoint_interval(self._uc_state, self.checkpoint_interval)
 
         # set memory map callback so we can call it explicitly
         _UC_NATIVE.set_map_callback(self._uc_state, self._bullshit_cb)
 
         # activate gdt page, which was written/mapped during set_regs
-        if self.gdt is not None:
+        if self.gdt is not None and not forked:
             _UC_NATIVE.activate_page(self._uc_state, self.gdt.addr, bytes(0x1000), None)
 
-    def start(self, step=None):
+    def _vex_archinfo(self):
+        archinfo = copy.deepcopy(self.state.arch.vex_archinfo)
+        archinfo['hwcache_info']['caches'] = 0
+        archinfo['hwcache_info'] = _VexCacheInfo(**archinfo['hwcache_info'])
+        return _VexArchInfo(**archinfo)
+
+    @staticmethod
+    def _offset_ranges(offsets):
+        """
+        Group a set of register offsets into sorted runs, as (offset, length) pairs.
+        """
+        ranges = [ ]
+        for offset in sorted(offsets):
+            if ranges and ranges[-1][0] + ranges[-1][1] == offset:
+                ranges[-1] = (ranges[-1][0], ranges[-1][1] + 1)
+            else:
+                ranges.append((offset, 1))
+        return ranges
+
+    def _symbolic_registers(self):
+        """
+        The register offsets that are symbolic after a run: the ones set up as symbolic before it, with the few runs
+        of offsets that the native state reports as changed since.
+        """
+        changes = (REGISTER_CHANGE * 16)()
+        count = _UC_NATIVE.symbolic_register_changes(self._uc_state, changes, len(changes))
+        if count == 0:
+            return self._entry_symbolic_offsets
+        if count > len(changes):
+            changes = (REGISTER_CHANGE * count)()
+            _UC_NATIVE.symbolic_register_changes(self._uc_state, changes, count)
+
+        offsets = set(self._entry_symbolic_offsets)
+        for change in changes[:count]:
+            run = range(change.offset, change.offset + change.length)
+            if change.symbolic:
+                offsets.update(run)
+            else:
+                offsets.difference_update(run)
+        return offsets
+
+    def _setup_cgc_syscalls(self):
+        """
+        Put the cgc syscalls that can be emulated natively in this state in the native syscall table. Each of them still
+        goes to its simprocedure whenever anything it reads is symbolic, and in the cases listed here.
+        """
+        cgc = self.state.cgc
+        handlers = { }
+
+        # receive only consumes preloaded input, and stops on the rest
+        if options.CGC_ENFORCE_FD not in self.state.options:
+            for fd, data in self.receive_data.items():
+                if data:
+                    _UC_NATIVE.set_receive_data(self._uc_state, fd, data, len(data))
+                    handlers[3] = SYSCALL_HANDLER.SYSCALL_HANDLER_RECEIVE
+
+        # blocking fds are symbolic
+        if options.CGC_NON_BLOCKING_FDS in self.state.options:
+            handlers[4] = SYSCALL_HANDLER.SYSCALL_HANDLER_FDWAIT
+
+        # allocate takes its address from sinkholes first, which are left to the simprocedure
+        if not cgc.sinkholes and not self.state.solver.symbolic(cgc.allocation_base):
+            _UC_NATIVE.set_allocation(
+                self._uc_state,
+                self.state.solver.eval(cgc.allocation_base),
+                cgc.max_allocation,
+                options.ENABLE_NX in self.state.options,
+            )
+            handlers[5] = SYSCALL_HANDLER.SYSCALL_HANDLER_ALLOCATE
+        handlers[6] = SYSCALL_HANDLER.SYSCALL_HANDLER_DEALLOCATE
+
+        if self.random_seed is not None:
+            _UC_NATIVE.set_random_seed(self._uc_state, self.random_seed)
+            handlers[7] = SYSCALL_HANDLER.SYSCALL_HANDLER_RANDOM
+
+        for sysno, handler in handlers.items():
+            if sysno in self.syscall_addrs:
+                _UC_NATIVE.set_syscall(self._uc_state, sysno, handler, self.syscall_addrs[sysno])
+
+    def _finish_cgc_syscalls(self):
+        """
+        Apply what the native cgc syscalls did to the state, besides the memory and register writes. The memory map
+        changes come first, since the memory updates may be to allocated pages.
+        """
+        results = SYSCALL_RESULTS()
+        _UC_NATIVE.syscall_results(self._uc_state, ctypes.byref(results))
+
+        changes = (MAP_CHANGE * results.map_changes)()
+        _UC_NATIVE.map_changes(self._uc_state, changes, results.map_changes)
+        for change in changes:
+            if change.perms:
+                self.state.memory.map_region(change.address, change.length, change.perms)
+            else:
+                self.state.cgc.add_sinkhole(change.address, change.length)
+                self.state.memory.unmap_region(change.address, change.length)
+        if results.map_changes:
+            self.state.cgc.allocation_base = results.allocation_base
+
+        # the input was concrete all along: constrain the file to it
+        for i in range(results.receives):
+            record = _UC_NATIVE.process_receive(self._uc_state, i)
+            fd, count = record.contents.fd, record.contents.count
+            data, _ = self.state.posix.get_fd(fd).read_data(count, short_reads=False)
+            self.state.add_constraints(data == claripy.BVV(self.receive_data[fd][:count]))
+            self.receive_data[fd] = self.receive_data[fd][count:]
+
+        if results.fdwait_time:
+            self.state.cgc.time += results.fdwait_time
+        if self.random_seed is not None:
+            self.random_seed = results.random_state
+
+    def fork(self, other):
+        """
+        Give the unicorn plugin of a copy of this state a clone of this plugin's native state, running on an engine of
+        its own. When the copy goes into unicorn, its setup() then starts from every page and all the taint this state
+        has mapped so far, instead of mapping them again one fault at a time.
+
+        The clone takes memory as it is in the native state right now, so this must be called after this plugin has
+        been set up and before destroy(), at a point where native memory has been synced back, such as after finish().
+        If the copy's memory is changed before it runs, its setup() throws the clone away and starts from an empty
+        native state, as if it had not been forked.
+
+        :param other:   The Unicorn plugin of the copy.
+        """
+        pages = getattr(other.state.memory, '_pages', None)
+        if pages is None:
+            raise SimUnicornError("can only fork onto a state with paged memory")
+        if other._uc_state is not None:
+            raise SimUnicornError("the copy already has a native state")
+
+        is_thumb = self.state.arch.qemu_name == 'arm' and self.state.arch.is_thumb(self.state.addr)
+        uc = Uniwrapper(self.state.arch, self.cache_key, thumb=is_thumb)
+        uc_state = _UC_NATIVE.fork(self._uc_state, uc._uch)
+        if not uc_state:
+            raise SimUnicornError("failed to fork the native unicorn state")
+
+        # set_regs maps the gdt again
+        if self.gdt is not None:
+            unicorn.Uc.mem_unmap(uc, self.gdt.addr, self.gdt.limit)
+
+        other._uc = uc
+        other._uc_state = uc_state
+
+        # holding a reference to every page makes the copy's memory copy a page before writing to it, so any page
+        # written to from now on is a different object
+        other._fork_pages = dict(pages)
+        for page in other._fork_pages.values():
+            if page is not None:
+                page.acquire_shared()
+
+    def _fork_unchanged(self):
+        pages = self.state.memory._pages
+        if len(pages) != len(self._fork_pages):
+            return False
+        return all(pages.get(pageno, None) is page for pageno, page in self._fork_pages.items())
+
+    def _release_fork_pages(self):
+        if self._fork_pages is None:
+            return
+        for page in self._fork_pages.values():
+            if page is not None:
+                page.release_shared()
+        self._fork_pages = None
+
+    def _drop_fork(self):
+        _UC_NATIVE.dealloc(self._uc_state)
+        self._uc_state = None
+        self._uc = None
+
+    def __del__(self):
+        # a forked native state that never ran
+        if getattr(self, '_fork_pages', None) is not None and _UC_NATIVE is not None:
+            self._drop_fork()
+
+    def _prepare_start(self, step):
         self.jumpkind = 'Ijk_Boring'
         self.countdown_nonunicorn_blocks = self.cooldown_nonunicorn_blocks
 
@@ -886,23 +1720,115 @@ class Unicorn(SimStatePlugin):
         self._uncache_regions = []
 
         addr = self.state.solver.eval(self.state.ip)
-        l.info('started emulation at %#x (%d steps)', addr, self.max_steps if step is None else step)
+        step = self.max_steps if step is None else step
+        l.info('started emulation at %#x (%d steps)', addr, step)
+        return addr, step
+
+    def start(self, step=None):
+        addr, step = self._prepare_start(step)
         self.time = time.time()
-        self.errno = _UC_NATIVE.start(self._uc_state, addr, self.max_steps if step is None else step)
+        self.errno = _UC_NATIVE.start(self._uc_state, addr, step)
         self.time = time.time() - self.time
 
+    @staticmethod
+    def start_batch(plugins, step=None, max_updates=0x10000, data_size=0x100000):
+        """
+        Run the unicorn plugins of several states with a single native call. Every plugin must have been set up and
+        hooked, just like for start(), and is then finished with finish() as usual.
+
+        :param plugins:     The Unicorn plugins to run.
+        :param step:        The maximum number of blocks to run each state for, or None for each plugin's max_steps.
+        :param max_updates: The number of dirty memory ranges to collect across all the states.
+        :param data_size:   The number of bytes of dirty memory to collect across all the states.
+        """
+        count = len(plugins)
+        if count == 0:
+            return
+
+        pcs = (ctypes.c_uint64 * count)()
+        steps = (ctypes.c_uint64 * count)()
+        states = (ctypes.c_void_p * count)()
+        for i, plugin in enumerate(plugins):
+            pcs[i], steps[i] = plugin._prepare_start(step)
+            states[i] = plugin._uc_state
+
+        data = bytearray(data_size)
+        results = BATCH_RESULT(
+            (ctypes.c_int * count)(),
+            (ctypes.c_int * count)(),
+            (ctypes.c_uint64 * count)(),
+            (ctypes.c_uint64 * count)(),
+            (ctypes.c_uint64 * count)(),
+            (ctypes.c_uint64 * count)(),
+            (ctypes.c_uint64 * count)(),
+            (ctypes.c_uint8 * count)(),
+            (MEM_PATCH * max_updates)(),
+            max_updates,
+            int(ffi.cast('uint64_t', ffi.from_buffer(data))),
+            data_size,
+        )
+
+        start_time = time.time()
+        _UC_NATIVE.start_batch(count, states, pcs, steps, ctypes.byref(results))
+        elapsed = time.time() - start_time
+
+        view = memoryview(data)
+        for i, plugin in enumerate(plugins):
+            plugin.errno = results.errors[i]
+            plugin.time = elapsed / count
+            if results.update_truncated[i]:
+                updates = None
+            else:
+                first = results.update_first[i]
+                updates = [ ]
+                for j in range(first, first + results.update_count[i]):
+                    update = results.updates[j]
+                    updates.append((update.address, bytes(view[update.offset:update.offset + update.length])))
+            plugin._batch_result = (
+                results.steps[i],
+                results.stop_reasons[i],
+                results.stopping_registers[i],
+                results.stopping_memory[i],
+                updates,
+            )
+
+    def _sync_memory(self):
+        """
+        Read the dirty memory ranges out of the native state.
+
+        :return: A list of (address, bytes) tuples.
+        """
+        update_count = ctypes.c_uint64()
+        update_bytes = ctypes.c_uint64()
+        _UC_NATIVE.sync_size(self._uc_state, ctypes.byref(update_count), ctypes.byref(update_bytes))
+        if not update_count.value:
+            return [ ]
+
+        updates = (MEM_PATCH * update_count.value)()
+        data = bytearray(update_bytes.value)
+        n = _UC_NATIVE.sync(self._uc_state, updates, update_count.value, int(ffi.cast('uint64_t', ffi.from_buffer(data))), len(data))
+        view = memoryview(data)
+        return [ (update.address, bytes(view[update.offset:update.offset + update.length])) for update in updates[:n] ]
+
     def finish(self):
         # do the superficial synchronization
         self.get_regs()
-        self.steps = _UC_NATIVE.step(self._uc_state)
-        self.stop_reason = _UC_NATIVE.stop_reason(self._uc_state)
+        batch_result, self._batch_result = self._batch_result, None
+        if batch_result is None:
+            self.steps = _UC_NATIVE.step(self._uc_state)
+            self.stop_reason = _UC_NATIVE.stop_reason(self._uc_state)
+            updates = None
+        else:
+            self.steps, self.stop_reason, stopping_register, stopping_memory, updates = batch_result
 
         # figure out why we stopped
         if self.stop_reason == STOP.STOP_SYMBOLIC_REG:
-            stopping_register = _UC_NATIVE.stopping_register(self._uc_state)
+            if batch_result is None:
+                stopping_register = _UC_NATIVE.stopping_register(self._uc_state)
             self._report_symbolic_blocker(self.state.registers.load(stopping_register, 1), 'reg')
         elif self.stop_reason == STOP.STOP_SYMBOLIC_MEM:
-            stopping_memory = _UC_NATIVE.stopping_memory(self._uc_state)
+            if batch_result is None:
+                stopping_memory = _UC_NATIVE.stopping_memory(self._uc_state)
             self._report_symbolic_blocker(self.state.memory.load(stopping_memory, 1), 'mem')
 
         if self.stop_reason == STOP.STOP_NOSTART and self.steps > 0:
@@ -918,40 +1844,34 @@ class Unicorn(SimStatePlugin):
         # should this be in destroy?
         _UC_NATIVE.disable_symbolic_reg_tracking(self._uc_state)
 
-        # synchronize memory contents - head is a linked list of memory updates
-        head = _UC_NATIVE.sync(self._uc_state)
-        p_update = head
-        while bool(p_update):
-            update = p_update.contents
-            address, length = update.address, update.length
+        if options.UNICORN_HANDLE_CGC_SYSCALLS in self.state.options and self.state.has_plugin('cgc'):
+            self._finish_cgc_syscalls()
+
+        # synchronize memory contents
+        if updates is None:
+            updates = self._sync_memory()
+        for address, s in updates:
             if self.gdt is not None and self.gdt.addr <= address < self.gdt.addr + self.gdt.limit:
                 l.warning("Emulation touched fake GDT at %#x, discarding changes" % self.gdt.addr)
             else:
-                s = bytes(self.uc.mem_read(address, int(length)))
-                l.debug('...changed memory: [%#x, %#x] = %s', address, address + length, binascii.hexlify(s))
+                l.debug('...changed memory: [%#x, %#x] = %s', address, address + len(s), binascii.hexlify(s))
                 self.state.memory.store(address, s)
 
-            p_update = update.next
-
-        _UC_NATIVE.destroy(head)    # free the linked list
-
         # adjust the countdowns
         #if self.steps >= 128:
         #   self.cooldown_symbolic_registers = 16
         #   self.cooldown_symbolic_memory = 16
 
-        # process the concrete transmits
-        i = 0
-        stdout = self.state.posix.get_fd(1)
-
-        while True:
-            record = _UC_NATIVE.process_transmit(self._uc_state, i)
-            if not bool(record):
-                break
-
-            string = ctypes.string_at(record.contents.data, record.contents.count)
-            stdout.write_data(string)
-            i += 1
+        # process the concrete transmits, straight from the native arena
+        records = ctypes.POINTER(TRANSMIT_RECORD)()
+        count = ctypes.c_uint64()
+        size = ctypes.c_uint64()
+        arena = _UC_NATIVE.transmits(self._uc_state, ctypes.byref(records), ctypes.byref(count), ctypes.byref(size))
+        if count.value:
+            stdout = self.state.posix.get_fd(1)
+            output = memoryview((ctypes.c_char * size.value).from_address(arena)) if size.value else memoryview(b'')
+            for i in range(count.value):
+                stdout.write_data(output[records[i].offset:records[i].offset + records[i].count].tobytes())
 
         if self.stop_reason in (STOP.STOP_NORMAL, STOP.STOP_SYSCALL):
             self.countdown_nonunicorn_blocks = 0
@@ -989,24 +1909,30 @@ class Unicorn(SimStatePlugin):
 
         # get the address list out of the state
         if options.UNICORN_TRACK_BBL_ADDRS in self.state.options:
-            bbl_addrs = _UC_NATIVE.bbl_addrs(self._uc_state)
-            #bbl_addr_count = _UC_NATIVE.bbl_addr_count(self._uc_state)
-            # why is bbl_addr_count unused?
-            if self.steps:
+            if self.trace_capacity:
+                self.state.history.recent_bbl_addrs = self.drain_trace(TRACE.TRACE_BBL_ADDRS)
+            elif self.steps:
+                bbl_addrs = _UC_NATIVE.bbl_addrs(self._uc_state)
+                #bbl_addr_count = _UC_NATIVE.bbl_addr_count(self._uc_state)
+                # why is bbl_addr_count unused?
                 self.state.history.recent_bbl_addrs = bbl_addrs[:self.steps]
         # get the stack pointers
         if options.UNICORN_TRACK_STACK_POINTERS in self.state.options:
-            stack_pointers = _UC_NATIVE.stack_pointers(self._uc_state)
-            self.state.scratch.stack_pointer_list = stack_pointers[:self.steps]
+            if self.trace_capacity:
+                self.state.scratch.stack_pointer_list = self.drain_trace(TRACE.TRACE_STACK_POINTERS)
+            else:
+                stack_pointers = _UC_NATIVE.stack_pointers(self._uc_state)
+                self.state.scratch.stack_pointer_list = stack_pointers[:self.steps]
         # syscall counts
         self.state.history.recent_syscall_count = _UC_NATIVE.syscall_count(self._uc_state)
         # executed page set
-        self.state.scratch.executed_pages_set = set()
-        while True:
-            page = _UC_NATIVE.executed_pages(self._uc_state)
-            if page == 2**64 - 1:
-                break
-            self.state.scratch.executed_pages_set.add(page)
+        page_count = _UC_NATIVE.executed_pages(self._uc_state, None, 0)
+        pages = (ctypes.c_uint64 * page_count)()
+        _UC_NATIVE.executed_pages(self._uc_state, pages, page_count)
+        self.state.scratch.executed_pages_set = set(pages)
+
+        if options.UNICORN_PROFILE in self.state.options:
+            _unicorn_profile.collect(self._uc_state)
 
     def destroy(self):
         #l.debug("Unhooking.")
@@ -1024,6 +1950,7 @@ class Unicorn(SimStatePlugin):
 
         #l.debug("Resetting the unicorn state.")
         self.uc.reset()
+        self._uc = None
 
     def set_regs(self):
         ''' setting unicorn registers '''
@@ -1198,15 +2125,11 @@ class Unicorn(SimStatePlugin):
         # first, get the ignore list (in case of symbolic registers)
         saved_registers = []
         if options.UNICORN_SYM_REGS_SUPPORT in self.state.options:
-            highest_reg_offset, reg_size = max(self.state.arch.registers.values())
-            symbolic_list = (ctypes.c_uint64*(highest_reg_offset + reg_size))()
-            num_regs = _UC_NATIVE.get_symbolic_registers(self._uc_state, symbolic_list)
-
             # we take the approach of saving off the symbolic regs and then writing them back
 
             cur_group = None
             last = None
-            for i in sorted(symbolic_list[:num_regs]):
+            for i in sorted(self._symbolic_registers()):
                 if cur_group is None:
                     cur_group = i
                 elif i != last + 1 or cur_group//self.state.arch.bytes != i//self.state.arch.bytes:
@@ -0,0 +1,326 @@
+/*
+ * Micro-benchmarks for the hot paths of sim_unicorn, built standalone against
+ * unicorn and libpyvex by `make benchmarks`.
+ *
+ * The workloads run real x86-64 loops through a State the way the python side
+ * sets one up, and call the memory primitives directly. Results go to stdout as
+ * one JSON object, so that runs can be diffed across releases:
+ *
+ *   ./bench/bench_unicorn [-s scale] [workload ...]
+ *
+ * ns_per_block and ns_per_op come from an unprofiled run. ns_per_mem_hook comes
+ * from a second, profiled run of the same workload, and includes the timer.
+ *
+ * parallel_N runs the store loop on N threads at once, each with an engine and
+ * State of its own, all sharing the caches of one key in one context. ops is N,
+ * and ns_per_block is the wall time over the blocks of all the threads, so with
+ * near-linear scaling it falls as 1/N.
+ */
+
+#include "../sim_unicorn.cpp"
+
+#include <cstdlib>
+#include <thread>
+
+#define BENCH_CODE 0x400000
+#define BENCH_DATA 0x1000000
+#define BENCH_STOPS 0x40000000
+
+// four stores to [rdi], 32 bytes apart, per block
+static const uint8_t store_loop[] = {
+	0x48, 0x89, 0x0f,		// mov [rdi], rcx
+	0x48, 0x89, 0x4f, 0x08,	// mov [rdi+8], rcx
+	0x48, 0x89, 0x4f, 0x10,	// mov [rdi+16], rcx
+	0x48, 0x89, 0x4f, 0x18,	// mov [rdi+24], rcx
+	0x48, 0x83, 0xc7, 0x20,	// add rdi, 32
+	0x48, 0xff, 0xc1,		// inc rcx
+	0x48, 0x39, 0xd1,		// cmp rcx, rdx
+	0x72, 0xe5,				// jb store_loop
+	0xf4,					// hlt
+};
+
+// four loads from [rsi], out of each 64 bytes
+static const uint8_t load_loop[] = {
+	0x48, 0x8b, 0x06,		// mov rax, [rsi]
+	0x48, 0x8b, 0x5e, 0x08,	// mov rbx, [rsi+8]
+	0x4c, 0x8b, 0x46, 0x10,	// mov r8, [rsi+16]
+	0x4c, 0x8b, 0x4e, 0x18,	// mov r9, [rsi+24]
+	0x48, 0x83, 0xc6, 0x40,	// add rsi, 64
+	0x48, 0xff, 0xc1,		// inc rcx
+	0x48, 0x39, 0xd1,		// cmp rcx, rdx
+	0x72, 0xe5,				// jb load_loop
+	0xf4,					// hlt
+};
+
+typedef struct bench_result {
+	std::string name;
+	uint64_t blocks;
+	double ns_per_block;
+	uint64_t mem_hooks;
+	double ns_per_mem_hook;
+	uint64_t ops;
+	double ns_per_op;
+} bench_result_t;
+
+typedef struct bench_config {
+	const uint8_t *code;
+	size_t code_size;
+	uint64_t iterations;		// of the loop, one block each
+	uint64_t data_pages;
+	bool tainted_pages;			// make every other data page partly symbolic, where the loop doesn't touch
+	bool symbolic_registers;	// track symbolic registers, with registers the loop doesn't use symbolic
+	uint64_t stop_points;		// set this many stop points, none of them on the loop
+} bench_config_t;
+
+static uint64_t bench_cache_key = 1;
+
+static uint64_t now_ns() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// with the caches of a new key in the default context, unless given a context and key
+static State *bench_state(uc_engine **uc, const bench_config_t &config, CacheRegistry *context = NULL, uint64_t key = 0) {
+	uc_open(UC_ARCH_X86, UC_MODE_64, uc);
+	State *state;
+	if (context != NULL) {
+		state = simunicorn_context_alloc_state(context, *uc, key, UC_ARCH_X86, UC_MODE_64);
+	} else {
+		state = simunicorn_alloc(*uc, bench_cache_key++, UC_ARCH_X86, UC_MODE_64);
+	}
+
+	uc_mem_map(*uc, BENCH_CODE, PAGE_SIZE, UC_PROT_READ | UC_PROT_EXEC);
+	uc_mem_write(*uc, BENCH_CODE, config.code, config.code_size);
+	// the code page is not writable, so it is never activated, like a page from the page cache
+	uc_mem_map(*uc, BENCH_DATA, config.data_pages * PAGE_SIZE, UC_PROT_READ | UC_PROT_WRITE);
+
+	std::vector<uint8_t> taint(PAGE_SIZE, TAINT_NONE), partly(PAGE_SIZE, TAINT_NONE);
+	for (int i = 40; i < PAGE_SIZE; i += 64) {
+		partly[i] = TAINT_SYMBOLIC;
+	}
+	for (uint64_t i = 0; i < config.data_pages; i++) {
+		bool tainted = config.tainted_pages && i % 2 == 1;
+		state->page_activate(BENCH_DATA + i * PAGE_SIZE, tainted ? partly.data() : taint.data(), NULL);
+	}
+
+	if (config.symbolic_registers) {
+		VexArchInfo archinfo;
+		LibVEX_default_VexArchInfo(&archinfo);
+		archinfo.endness = VexEndnessLE;
+		simunicorn_enable_symbolic_reg_tracking(state, VexArchAMD64, archinfo);
+		// r12-r15 and a run past the general purpose registers, as vector registers would be
+		register_range_t ranges[2] = {{112, 32}, {0x400, 0x400}};
+		simunicorn_symbolic_register_ranges(state, 2, ranges);
+	}
+
+	if (config.stop_points) {
+		std::vector<uint64_t> stops(config.stop_points);
+		for (uint64_t i = 0; i < config.stop_points; i++) {
+			stops[i] = BENCH_STOPS + i * 0x40;
+		}
+		simunicorn_set_stops(state, stops.size(), stops.data());
+	}
+
+	uint64_t zero = 0, data = BENCH_DATA;
+	uc_reg_write(*uc, UC_X86_REG_RCX, &zero);
+	uc_reg_write(*uc, UC_X86_REG_RDX, &config.iterations);
+	uc_reg_write(*uc, UC_X86_REG_RDI, &data);
+	uc_reg_write(*uc, UC_X86_REG_RSI, &data);
+	simunicorn_hook(state);
+	return state;
+}
+
+static void bench_free(uc_engine *uc, State *state) {
+	simunicorn_dealloc(state);
+	uc_close(uc);
+}
+
+static bench_result_t bench_run(const char *name, const bench_config_t &config) {
+	bench_result_t result = {name, 0, 0, 0, 0, 0, 0};
+	uc_engine *uc;
+
+	State *state = bench_state(&uc, config);
+	uint64_t start = now_ns();
+	simunicorn_start(state, BENCH_CODE, config.iterations + 1);
+	uint64_t elapsed = now_ns() - start;
+	result.blocks = state->cur_steps;
+	result.ns_per_block = result.blocks ? (double)elapsed / result.blocks : 0;
+	bench_free(uc, state);
+
+	state = bench_state(&uc, config);
+	simunicorn_profile_enable(state, true);
+	simunicorn_start(state, BENCH_CODE, config.iterations + 1);
+	profile_stats_t stats;
+	simunicorn_profile_stats(state, &stats);
+	uint64_t hook_ns = stats.hook_nanoseconds[PROFILE_HOOK_MEM_READ] + stats.hook_nanoseconds[PROFILE_HOOK_MEM_WRITE];
+	result.mem_hooks = stats.hook_calls[PROFILE_HOOK_MEM_READ] + stats.hook_calls[PROFILE_HOOK_MEM_WRITE];
+	result.ns_per_mem_hook = result.mem_hooks ? (double)hook_ns / result.mem_hooks : 0;
+	bench_free(uc, state);
+	return result;
+}
+
+/*
+ * the primitives alone, on a state that never runs: write records and their
+ * rollback, taint lookups, page lookups and the sync of dirty pages
+ */
+static std::vector<bench_result_t> bench_primitives(uint64_t scale) {
+	std::vector<bench_result_t> results;
+	bench_config_t config = {store_loop, sizeof(store_loop), 0, 256, true, false, 0};
+	uc_engine *uc;
+	State *state = bench_state(&uc, config);
+	uint64_t pages = config.data_pages, ops = scale * 1024, start, elapsed;
+	volatile int64_t sink = 0;
+
+	start = now_ns();
+	for (uint64_t i = 0; i < ops; i++) {
+		sink = sink + state->find_tainted(BENCH_DATA + (i * 0x340) % (pages * PAGE_SIZE - 64), 32);
+	}
+	elapsed = now_ns() - start;
+	results.push_back({"find_tainted", 0, 0, 0, 0, ops, (double)elapsed / ops});
+
+	// a table of its own, laid out like the state's
+	PageTable table;
+	for (uint64_t i = 0; i < pages; i++) {
+		table.insert(BENCH_DATA + i * PAGE_SIZE, active_page_t());
+	}
+	start = now_ns();
+	for (uint64_t i = 0; i < ops; i++) {
+		sink = sink + (table.lookup(BENCH_DATA + (i * 7 % pages) * PAGE_SIZE) != NULL);
+	}
+	elapsed = now_ns() - start;
+	results.push_back({"page_lookup", 0, 0, 0, 0, ops, (double)elapsed / ops});
+
+	// one block of 64 stores, then its rollback
+	uint64_t rounds = std::max<uint64_t>(ops / 64, 1);
+	state->start(0);
+	start = now_ns();
+	for (uint64_t i = 0; i < rounds; i++) {
+		state->commit();
+		for (uint64_t j = 0; j < 64; j++) {
+			state->handle_write(BENCH_DATA + ((i * 64 + j) * 8) % (pages * PAGE_SIZE), 8);
+		}
+		state->rollback();
+	}
+	elapsed = now_ns() - start;
+	results.push_back({"handle_write_rollback", 0, 0, 0, 0, rounds * 64, (double)elapsed / (rounds * 64)});
+
+	// every data page dirty and committed, synced as one batch per round
+	state->commit();
+	for (uint64_t i = 0; i < pages; i++) {
+		state->handle_write(BENCH_DATA + i * PAGE_SIZE, 8);
+	}
+	state->commit();
+	uint64_t count, bytes;
+	state->sync_size(&count, &bytes);
+	std::vector<mem_update_t> updates(count);
+	std::vector<uint8_t> data(bytes);
+	rounds = std::max<uint64_t>(scale / 4, 1);
+	start = now_ns();
+	for (uint64_t i = 0; i < rounds; i++) {
+		sink = sink + state->sync(updates.data(), count, data.data(), bytes);
+	}
+	elapsed = now_ns() - start;
+	results.push_back({"sync", 0, 0, 0, 0, rounds * pages, (double)elapsed / (rounds * pages)});
+
+	bench_free(uc, state);
+	return results;
+}
+
+/*
+ * the store loop on 1, 2, 4, ... threads, up to the hardware threads. the states
+ * are set up before the clock starts, and run as soon as they all are.
+ */
+static std::vector<bench_result_t> bench_parallel(const bench_config_t &config) {
+	std::vector<bench_result_t> results;
+	unsigned max_threads = std::max(std::thread::hardware_concurrency(), 1u);
+	for (unsigned n = 1; n <= max_threads; n *= 2) {
+		CacheRegistry *context = simunicorn_context_alloc();
+		std::vector<uc_engine *> ucs(n);
+		std::vector<State *> states(n);
+		for (unsigned i = 0; i < n; i++) {
+			states[i] = bench_state(&ucs[i], config, context, 1);
+		}
+
+		std::vector<std::thread> threads;
+		uint64_t start = now_ns();
+		for (unsigned i = 0; i < n; i++) {
+			threads.emplace_back([&config, &states, i]() {
+				simunicorn_start(states[i], BENCH_CODE, config.iterations + 1);
+			});
+		}
+		for (auto &thread : threads) {
+			thread.join();
+		}
+		uint64_t elapsed = now_ns() - start;
+
+		bench_result_t result = {"parallel_" + std::to_string(n), 0, 0, 0, 0, n, 0};
+		for (unsigned i = 0; i < n; i++) {
+			result.blocks += states[i]->cur_steps;
+			bench_free(ucs[i], states[i]);
+		}
+		result.ns_per_block = result.blocks ? (double)elapsed / result.blocks : 0;
+		result.ns_per_op = (double)elapsed / n;
+		results.push_back(result);
+		simunicorn_context_free(context);
+	}
+	return results;
+}
+
+static void print_results(const std::vector<bench_result_t> &results, uint64_t scale) {
+	printf("{\n  \"scale\": %" PRIu64 ",\n  \"benchmarks\": [\n", scale);
+	for (size_t i = 0; i < results.size(); i++) {
+		const bench_result_t &r = results[i];
+		printf("    {\"name\": \"%s\", \"blocks\": %" PRIu64 ", \"ns_per_block\": %.2f, "
+			"\"mem_hooks\": %" PRIu64 ", \"ns_per_mem_hook\": %.2f, \"ops\": %" PRIu64 ", \"ns_per_op\": %.2f}%s\n",
+			r.name.c_str(), r.blocks, r.ns_per_block, r.mem_hooks, r.ns_per_mem_hook, r.ops, r.ns_per_op,
+			i + 1 == results.size() ? "" : ",");
+	}
+	printf("  ]\n}\n");
+}
+
+int main(int argc, char **argv) {
+	uint64_t scale = 64;
+	std::set<std::string> selected;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			scale = strtoull(argv[++i], NULL, 0);
+		} else {
+			selected.insert(argv[i]);
+		}
+	}
+	scale = std::max<uint64_t>(scale, 1);
+	vex_init();
+
+	// enough data pages for every iteration of the loops
+	uint64_t iterations = scale * 256;
+	uint64_t store_pages = (iterations * 32 + PAGE_SIZE - 1) / PAGE_SIZE;
+	uint64_t load_pages = (iterations * 64 + PAGE_SIZE - 1) / PAGE_SIZE;
+	struct {
+		const char *name;
+		bench_config_t config;
+	} workloads[] = {
+		{"store_loop", {store_loop, sizeof(store_loop), iterations, store_pages, false, false, 0}},
+		{"tainted_pages", {load_loop, sizeof(load_loop), iterations, load_pages, true, false, 0}},
+		{"symbolic_registers", {store_loop, sizeof(store_loop), iterations, store_pages, false, true, 0}},
+		{"stop_points", {store_loop, sizeof(store_loop), iterations, store_pages, false, false, scale * 1024}},
+	};
+
+	std::vector<bench_result_t> results;
+	for (auto &workload : workloads) {
+		if (selected.empty() || selected.count(workload.name)) {
+			results.push_back(bench_run(workload.name, workload.config));
+		}
+	}
+	if (selected.empty() || selected.count("primitives")) {
+		for (auto &result : bench_primitives(scale)) {
+			results.push_back(result);
+		}
+	}
+	if (selected.empty() || selected.count("parallel")) {
+		for (auto &result : bench_parallel(workloads[0].config)) {
+			results.push_back(result);
+		}
+	}
+	print_results(results, scale);
+	return 0;
+}
@@ -22,9 +22,12 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -37,9 +40,62 @@
 
 static int log_fd = STDERR_FILENO;
 static bool log_fd_isatty = true;
-enum llevel_t log_level = DEBUG;
+enum llevel_t log_level = WARNING;
 pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+struct ll_t {
+    char *descr;
+    char *prefix;
+    bool print_funcline;
+};
+static const struct ll_t logLevels[] = {
+    {"F", "\033[7;35m", true},
+    {"E", "\033[1;31m", true},
+    {"W", "\033[0;33m", true},
+    {"I", "\033[1m", true},
+    {"D", "\033[0;4m", true},
+    {"HR", "\033[0m", false},
+    {"HB", "\033[1m", false},
+};
+
+struct log_record {
+    uint64_t time_ns;
+    const char *fn;
+    const char *fmt;
+    int32_t line;
+    int32_t tid;
+    uint8_t level;
+    uint8_t nargs;
+    uint64_t args[LOG_MAX_ARGS];
+};
+
+/*
+ * A thread's queue of records. It has one producer, the thread that claimed it, and one consumer, logFlush() under
+ * log_mutex, so head and tail are all the synchronization there is between the two.
+ */
+struct log_ring {
+    _Atomic uint64_t head; /* next record to write */
+    _Atomic uint64_t tail; /* next record to flush */
+    _Atomic uint64_t dropped; /* records that found the ring full */
+    uint64_t dropped_reported;
+    atomic_bool in_use;
+    struct log_ring *next;
+    struct log_record records[LOG_RING_SIZE];
+};
+
+/* never freed, rings of threads that exited are flushed and then claimed by new threads */
+static struct log_ring *log_rings = NULL;
+static _Thread_local struct log_ring *log_ring_self = NULL;
+static _Thread_local pid_t log_tid;
+static pthread_key_t log_ring_key;
+static pthread_once_t log_ring_once = PTHREAD_ONCE_INIT;
+
+static pthread_t log_writer;
+static bool log_writer_running = false;
+static unsigned log_writer_interval_ms;
+static pthread_mutex_t log_writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_writer_cond = PTHREAD_COND_INITIALIZER;
+
 void logSetLogLevel(enum llevel_t level) {
 	log_level = level;
 }
@@ -78,20 +134,8 @@ void logLog(enum llevel_t ll, const char *fn, int ln, bool perr, const char *fmt
     if (perr == true) {
         snprintf(strerr, sizeof(strerr), "%s", strerror(errno));
     }
-    struct ll_t {
-        char *descr;
-        char *prefix;
-        bool print_funcline;
-    };
-    struct ll_t logLevels[] = {
-        {"F", "\033[7;35m", true},
-        {"E", "\033[1;31m", true},
-        {"W", "\033[0;33m", true},
-        {"I", "\033[1m", true},
-        {"D", "\033[0;4m", true},
-        {"HR", "\033[0m", false},
-        {"HB", "\033[1m", false},
-    };
+    /* so that what this thread queued comes out first */
+    logFlush();
 
     time_t ltstamp = time(NULL);
     struct tm utctime;
@@ -130,6 +174,285 @@ void logLog(enum llevel_t ll, const char *fn, int ln, bool perr, const char *fmt
     }
 }
 
+static void logReleaseRing(void *ring)
+{
+    atomic_store(&((struct log_ring *)ring)->in_use, false);
+}
+
+static void logFlushAtExit(void)
+{
+    logFlush();
+}
+
+static void logInitRings(void)
+{
+    pthread_key_create(&log_ring_key, logReleaseRing);
+    atexit(logFlushAtExit);
+}
+
+static struct log_ring *logClaimRing(void)
+{
+    pthread_once(&log_ring_once, logInitRings);
+
+    struct log_ring *ring;
+    pthread_mutex_lock(&log_mutex);
+    for (ring = log_rings; ring != NULL; ring = ring->next) {
+        /* rings still holding records of an exited thread are left to the next flush */
+        if (!atomic_load(&ring->in_use) && atomic_load(&ring->head) == atomic_load(&ring->tail)) {
+            break;
+        }
+    }
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(*ring));
+        if (ring != NULL) {
+            ring->next = log_rings;
+            log_rings = ring;
+        }
+    }
+    if (ring != NULL) {
+        atomic_store(&ring->in_use, true);
+    }
+    pthread_mutex_unlock(&log_mutex);
+
+    if (ring != NULL) {
+        pthread_setspecific(log_ring_key, ring);
+        log_tid = (pid_t)syscall(__NR_gettid);
+    }
+    return ring;
+}
+
+/*
+ * Queue a record in the calling thread's ring without formatting it, or drop it if the ring is full. Integer and
+ * pointer arguments are stored as they are, so strings have to outlive the next logFlush().
+ */
+void logRecord(enum llevel_t ll, const char *fn, int ln, const char *fmt, unsigned nargs, const uint64_t *args)
+{
+    struct log_ring *ring = log_ring_self;
+    if (ring == NULL) {
+        ring = log_ring_self = logClaimRing();
+        if (ring == NULL) {
+            return;
+        }
+    }
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= LOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    struct log_record *record = &ring->records[head % LOG_RING_SIZE];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    record->time_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    record->fn = fn;
+    record->fmt = fmt;
+    record->line = ln;
+    record->tid = log_tid;
+    record->level = ll;
+    record->nargs = nargs > LOG_MAX_ARGS ? LOG_MAX_ARGS : nargs;
+    memcpy(record->args, args, record->nargs * sizeof(record->args[0]));
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/*
+ * printf the arguments of a record one conversion at a time, giving each the type its conversion asks for. Floating
+ * point and %n are not supported.
+ */
+static void logFormatArgs(char *buf, size_t len, const char *fmt, unsigned nargs, const uint64_t *args)
+{
+    size_t used = 0;
+    unsigned next = 0;
+    while (*fmt != '\0' && used + 1 < len) {
+        if (*fmt != '%') {
+            buf[used++] = *fmt++;
+            continue;
+        }
+        if (fmt[1] == '%') {
+            buf[used++] = '%';
+            fmt += 2;
+            continue;
+        }
+
+        char spec[32];
+        size_t n = strspn(fmt + 1, "-+ #0123456789.") + 1;
+        size_t lenmod = strspn(fmt + n, "hljzt");
+        char conv = fmt[n + lenmod];
+        if (conv == '\0' || n + lenmod + 2 > sizeof(spec)) {
+            break;
+        }
+        memcpy(spec, fmt, n + lenmod + 1);
+        spec[n + lenmod + 1] = '\0';
+        fmt += n + lenmod + 1;
+
+        uint64_t arg = next < nargs ? args[next] : 0;
+        next++;
+        char mod = lenmod > 0 ? fmt[-2] : '\0';
+        bool is_long_long = lenmod == 2 && mod == 'l';
+        size_t left = len - used;
+        int written;
+        switch (conv) {
+            case 'd':
+            case 'i':
+                if (is_long_long || mod == 'j') {
+                    written = snprintf(buf + used, left, spec, (long long)arg);
+                } else if (mod == 'l') {
+                    written = snprintf(buf + used, left, spec, (long)arg);
+                } else if (mod == 'z' || mod == 't') {
+                    written = snprintf(buf + used, left, spec, (ptrdiff_t)arg);
+                } else {
+                    written = snprintf(buf + used, left, spec, (int)arg);
+                }
+                break;
+            case 'u':
+            case 'x':
+            case 'X':
+            case 'o':
+                if (is_long_long || mod == 'j') {
+                    written = snprintf(buf + used, left, spec, (unsigned long long)arg);
+                } else if (mod == 'l') {
+                    written = snprintf(buf + used, left, spec, (unsigned long)arg);
+                } else if (mod == 'z' || mod == 't') {
+                    written = snprintf(buf + used, left, spec, (size_t)arg);
+                } else {
+                    written = snprintf(buf + used, left, spec, (unsigned)arg);
+                }
+                break;
+            case 'c':
+                written = snprintf(buf + used, left, spec, (int)arg);
+                break;
+            case 's':
+                written = snprintf(buf + used, left, spec, arg ? (const char *)(uintptr_t)arg : "(null)");
+                break;
+            case 'p':
+                written = snprintf(buf + used, left, spec, (void *)(uintptr_t)arg);
+                break;
+            default:
+                written = snprintf(buf + used, left, "?");
+                break;
+        }
+        if (written < 0) {
+            break;
+        }
+        used += (size_t)written < left ? (size_t)written : left - 1;
+    }
+    buf[used] = '\0';
+}
+
+static void logWriteRecord(const struct log_record *record)
+{
+    time_t ltstamp = (time_t)(record->time_ns / 1000000000);
+    struct tm utctime;
+    localtime_r(&ltstamp, &utctime);
+    char timestr[32];
+    if (strftime(timestr, sizeof(timestr) - 1, "%FT%T%z", &utctime) == 0) {
+        timestr[0] = '\0';
+    }
+
+    char msg[1024];
+    logFormatArgs(msg, sizeof(msg), record->fmt, record->nargs, record->args);
+
+    const struct ll_t *level = &logLevels[record->level];
+    dprintf(log_fd, "%s[%s][%s][%d] %s():%d %s%s\n", log_fd_isatty ? level->prefix : "", timestr, level->descr,
+            record->tid, record->fn, record->line, msg, log_fd_isatty ? "\033[0m" : "");
+}
+
+/*
+ * Write out the records queued by all threads, each thread's in order.
+ *
+ * Returns the number of records written.
+ */
+uint64_t logFlush(void)
+{
+    uint64_t flushed = 0;
+    pthread_mutex_lock(&log_mutex);
+    for (struct log_ring *ring = log_rings; ring != NULL; ring = ring->next) {
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (; tail != head; tail++) {
+            logWriteRecord(&ring->records[tail % LOG_RING_SIZE]);
+            flushed++;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        uint64_t dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+        if (dropped != ring->dropped_reported) {
+            dprintf(log_fd, "%" PRIu64 " log records dropped, the ring was full\n", dropped - ring->dropped_reported);
+            ring->dropped_reported = dropped;
+        }
+    }
+    pthread_mutex_unlock(&log_mutex);
+    return flushed;
+}
+
+/*
+ * Returns the number of records dropped so far because their thread's ring was full.
+ */
+uint64_t logDropped(void)
+{
+    uint64_t dropped = 0;
+    pthread_mutex_lock(&log_mutex);
+    for (struct log_ring *ring = log_rings; ring != NULL; ring = ring->next) {
+        dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&log_mutex);
+    return dropped;
+}
+
+static void *logWriterMain(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&log_writer_mutex);
+    while (log_writer_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        uint64_t nsec = deadline.tv_nsec + (uint64_t)log_writer_interval_ms * 1000000;
+        deadline.tv_sec += nsec / 1000000000;
+        deadline.tv_nsec = nsec % 1000000000;
+        pthread_cond_timedwait(&log_writer_cond, &log_writer_mutex, &deadline);
+
+        pthread_mutex_unlock(&log_writer_mutex);
+        logFlush();
+        pthread_mutex_lock(&log_writer_mutex);
+    }
+    pthread_mutex_unlock(&log_writer_mutex);
+    return NULL;
+}
+
+/*
+ * Flush the queued records every interval_ms from a background thread, until logStopWriter(). Calling it again while
+ * the writer runs only changes the interval.
+ */
+bool logStartWriter(unsigned interval_ms)
+{
+    bool started = true;
+    pthread_mutex_lock(&log_writer_mutex);
+    log_writer_interval_ms = interval_ms > 0 ? interval_ms : 1;
+    if (!log_writer_running) {
+        log_writer_running = true;
+        if (pthread_create(&log_writer, NULL, logWriterMain, NULL) != 0) {
+            log_writer_running = false;
+            started = false;
+        }
+    }
+    pthread_mutex_unlock(&log_writer_mutex);
+    return started;
+}
+
+void logStopWriter(void)
+{
+    pthread_mutex_lock(&log_writer_mutex);
+    bool running = log_writer_running;
+    log_writer_running = false;
+    pthread_cond_signal(&log_writer_cond);
+    pthread_mutex_unlock(&log_writer_mutex);
+
+    if (running) {
+        pthread_join(log_writer, NULL);
+    }
+    logFlush();
+}
+
 void logStop(int sig)
 {
     LOG_I("Server stops due to fatal signal (%d) caught. Exiting", sig);
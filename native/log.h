@@ -23,48 +23,142 @@
 #define _LOG_H
 
 #include <stdbool.h>
+#include <stdint.h>
+
+#define LOG_LEVEL_OFF -1
+#define LOG_LEVEL_FATAL 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARNING 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+/*
+ * log calls for levels above LOG_MIN_LEVEL are compiled out, whatever the level set at runtime. with
+ * LOG_LEVEL_OFF, nothing is logged and nothing from log.c is needed.
+ */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+// most records are queued in a ring of the calling thread, see logRecord
+#define LOG_RING_SIZE 1024
+#define LOG_MAX_ARGS 6
+
+#ifdef _MSC_VER
+#define LOG_FORMAT(fmt, args)
+#else
+#define LOG_FORMAT(fmt, args) __attribute__ ((format(printf, fmt, args)))
+#endif
 
 #define LOG_RAW(...) dprintf(logGetFD(), __VA_ARGS__);
 
 #define LOG_HELP(...) logLog(HELP, __FUNCTION__, __LINE__, false, __VA_ARGS__);
 #define LOG_HELP_BOLD(...) logLog(HELP_BOLD, __FUNCTION__, __LINE__, false, __VA_ARGS__);
 
-#define LOG_D(...) if (logGetLogLevel() >= DEBUG) { logLog(DEBUG, __FUNCTION__, __LINE__, false, __VA_ARGS__); }
-#define LOG_I(...) if (logGetLogLevel() >= INFO) { logLog(INFO, __FUNCTION__, __LINE__, false, __VA_ARGS__); }
-#define LOG_W(...) if (logGetLogLevel() >= WARNING) { logLog(WARNING, __FUNCTION__, __LINE__, false, __VA_ARGS__); }
-#define LOG_E(...) if (logGetLogLevel() >= ERROR) { logLog(ERROR, __FUNCTION__, __LINE__, false, __VA_ARGS__); }
-#define LOG_F(...) if (logGetLogLevel() >= FATAL) { logLog(FATAL, __FUNCTION__, __LINE__, false, __VA_ARGS__); }
+// checks the arguments against the format without evaluating them
+#define LOG_NOP(...) do { if (0) { logFormatCheck(__VA_ARGS__); } } while (0)
+#define LOG_SYNC(ll, perr, ...) do { if (log_level >= ll) { logLog(ll, __FUNCTION__, __LINE__, perr, __VA_ARGS__); } } while (0)
+#ifdef __cplusplus
+#define LOG_QUEUE(ll, ...) do { if (log_level >= ll) { LOG_NOP(__VA_ARGS__); logRecordArgs(ll, __FUNCTION__, __LINE__, __VA_ARGS__); } } while (0)
+#else
+#define LOG_QUEUE(ll, ...) LOG_SYNC(ll, false, __VA_ARGS__)
+#endif
 
-#define PLOG_D(...) if (logGetLogLevel() >= DEBUG) { logLog(DEBUG, __FUNCTION__, __LINE__, true, __VA_ARGS__); }
-#define PLOG_I(...) if (logGetLogLevel() >= INFO) { logLog(INFO, __FUNCTION__, __LINE__, true, __VA_ARGS__); }
-#define PLOG_W(...) if (logGetLogLevel() >= WARNING) { logLog(WARNING, __FUNCTION__, __LINE__, true, __VA_ARGS__); }
-#define PLOG_E(...) if (logGetLogLevel() >= ERROR) { logLog(ERROR, __FUNCTION__, __LINE__, true, __VA_ARGS__); }
-#define PLOG_F(...) if (logGetLogLevel() >= FATAL) { logLog(FATAL, __FUNCTION__, __LINE__, true, __VA_ARGS__); }
+/*
+ * debug, info and warning records are queued and formatted later by logFlush, so from C++ their arguments may only be
+ * integers, pointers, and strings that live until then (literals, uc_strerror). errors, fatal errors and the PLOG_
+ * variants, which add strerror(errno), are written right away.
+ */
+#if LOG_MIN_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_D(...) LOG_QUEUE(DEBUG, __VA_ARGS__)
+#define PLOG_D(...) LOG_SYNC(DEBUG, true, __VA_ARGS__)
+#else
+#define LOG_D(...) LOG_NOP(__VA_ARGS__)
+#define PLOG_D(...) LOG_NOP(__VA_ARGS__)
+#endif
+#if LOG_MIN_LEVEL >= LOG_LEVEL_INFO
+#define LOG_I(...) LOG_QUEUE(INFO, __VA_ARGS__)
+#define PLOG_I(...) LOG_SYNC(INFO, true, __VA_ARGS__)
+#else
+#define LOG_I(...) LOG_NOP(__VA_ARGS__)
+#define PLOG_I(...) LOG_NOP(__VA_ARGS__)
+#endif
+#if LOG_MIN_LEVEL >= LOG_LEVEL_WARNING
+#define LOG_W(...) LOG_QUEUE(WARNING, __VA_ARGS__)
+#define PLOG_W(...) LOG_SYNC(WARNING, true, __VA_ARGS__)
+#else
+#define LOG_W(...) LOG_NOP(__VA_ARGS__)
+#define PLOG_W(...) LOG_NOP(__VA_ARGS__)
+#endif
+#if LOG_MIN_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_E(...) LOG_SYNC(ERROR, false, __VA_ARGS__)
+#define PLOG_E(...) LOG_SYNC(ERROR, true, __VA_ARGS__)
+#else
+#define LOG_E(...) LOG_NOP(__VA_ARGS__)
+#define PLOG_E(...) LOG_NOP(__VA_ARGS__)
+#endif
+#if LOG_MIN_LEVEL >= LOG_LEVEL_FATAL
+#define LOG_F(...) LOG_SYNC(FATAL, false, __VA_ARGS__)
+#define PLOG_F(...) LOG_SYNC(FATAL, true, __VA_ARGS__)
+#else
+#define LOG_F(...) LOG_NOP(__VA_ARGS__)
+#define PLOG_F(...) LOG_NOP(__VA_ARGS__)
+#endif
 
 enum llevel_t {
-    FATAL = 0,
-    ERROR,
-    WARNING,
-    INFO,
-    DEBUG,
+    FATAL = LOG_LEVEL_FATAL,
+    ERROR = LOG_LEVEL_ERROR,
+    WARNING = LOG_LEVEL_WARNING,
+    INFO = LOG_LEVEL_INFO,
+    DEBUG = LOG_LEVEL_DEBUG,
     HELP,
     HELP_BOLD
 };
 
+static inline void logFormatCheck(const char *fmt, ...) LOG_FORMAT(1, 2);
+static inline void logFormatCheck(const char *fmt, ...) {
+    (void)fmt;
+}
+
 #ifdef __cplusplus
 extern "C" {
 #endif
+extern enum llevel_t log_level;
 void logSetLogLevel(enum llevel_t);
 enum llevel_t logGetLogLevel(void);
 int logGetFD();
 bool logInitLogFile(const char *logfile, enum llevel_t ll);
 void logLog(enum llevel_t ll, const char *fn, int ln, bool perr, const char *fmt, ...)
-    __attribute__ ((format(printf, 5, 6)));
+    LOG_FORMAT(5, 6);
 void logStop(int sig);
+void logRecord(enum llevel_t ll, const char *fn, int ln, const char *fmt, unsigned nargs, const uint64_t *args);
+uint64_t logFlush(void);
+uint64_t logDropped(void);
+bool logStartWriter(unsigned interval_ms);
+void logStopWriter(void);
 #ifdef __cplusplus
 }
 #endif
 
+#if defined(__cplusplus) && LOG_MIN_LEVEL > LOG_LEVEL_OFF
+template <typename T>
+static inline uint64_t logArg(T value) {
+    return (uint64_t)value;
+}
+
+template <typename T>
+static inline uint64_t logArg(T *value) {
+    return (uint64_t)(uintptr_t)value;
+}
+
+template <typename... Args>
+static inline void logRecordArgs(enum llevel_t ll, const char *fn, int ln, const char *fmt, Args... args) {
+    static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "too many arguments to log");
+    const uint64_t argv[] = { logArg(args)..., 0 };
+    logRecord(ll, fn, ln, fmt, sizeof...(Args), argv);
+}
+#endif
+
 // courtesy of @pwntester on github
 #if defined(__APPLE__)
   #if !defined(__NR_gettid)
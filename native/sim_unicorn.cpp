@@ -4,6 +4,9 @@
 #include <cinttypes>
 #include <cstring>
 #include <cstdint>
+#include <cstdio>
+#include <string>
+#include <chrono>
 
 #include <memory>
 #include <map>
@@ -11,7 +14,23 @@
 #include <unordered_set>
 #include <unordered_map>
 #include <set>
+#include <list>
 #include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 extern "C" {
 #include <assert.h>
@@ -19,6 +38,8 @@ extern "C" {
 #include <pyvex.h>
 }
 
+#include "log.h"
+
 #define PAGE_SIZE 0x1000
 #define PAGE_SHIFT 12
 
@@ -53,28 +74,1387 @@ typedef enum stop {
 	STOP_HLT,
 } stop_t;
 
-typedef struct block_entry {
-	bool try_unicorn;
-	std::unordered_set<uint64_t> used_registers;
-	std::unordered_set<uint64_t> clobbered_registers;
-} block_entry_t;
+#define STOP_REASON_COUNT (STOP_HLT + 1)
+
+// a run of bytes in the guest register file
+typedef struct register_range {
+	uint16_t offset;
+	uint16_t length;
+} register_range_t;
+
+// sorted, non-overlapping, non-adjacent runs of register bytes
+typedef std::vector<register_range_t> RegisterRanges;
+
+// a run of register bytes that became symbolic, or concrete
+typedef struct register_change {
+	uint16_t offset;
+	uint16_t length;
+	uint8_t symbolic;
+} register_change_t;
+
+typedef struct block_entry {
+	bool try_unicorn;
+	uint32_t size; // the bytes that were lifted, or 0 if not known
+	bool loads_dead; // nothing the block reads from memory outlives it, see State::loads_dead
+	RegisterRanges used_registers;
+	RegisterRanges clobbered_registers;
+} block_entry_t;
+
+// an extent of the page cache: pages with the same permissions whose bytes follow on each other
+typedef struct CachedPage {
+	size_t size;
+	uint8_t *bytes;
+	uint64_t perms;
+	bool shared; // bytes are in a SharedPages mapping, not in the key's PageArena
+} CachedPage;
+
+/*
+ * Packed taint of a page: one bit per byte in each of two planes, so that
+ * range queries can be answered 64 bytes at a time. Bit i of word w covers
+ * byte (w * 64 + i) of the page. A byte is never both symbolic and dirty.
+ */
+#define PAGE_BITMAP_WORDS (PAGE_SIZE / 64)
+
+typedef struct PageBitmap {
+	uint64_t symbolic[PAGE_BITMAP_WORDS];
+	uint64_t dirty[PAGE_BITMAP_WORDS];
+	std::atomic<uint64_t> refs; // the States sharing this bitmap: forks copy it on their first write
+} PageBitmap;
+typedef std::map<uint64_t, CachedPage> PageCache;
+typedef std::unordered_map<uint64_t, block_entry_t> BlockCache;
+
+// rough per-element overhead of the node-based containers, for budgeting only
+#define CACHE_NODE_OVERHEAD 32
+
+static inline size_t block_entry_bytes(const block_entry_t &entry) {
+	return sizeof(block_entry_t) + CACHE_NODE_OVERHEAD +
+		(entry.used_registers.capacity() + entry.clobbered_registers.capacity()) * sizeof(register_range_t);
+}
+
+static inline size_t cached_page_bytes(const CachedPage &page) {
+	return (page.shared ? 0 : page.size) + sizeof(CachedPage) + CACHE_NODE_OVERHEAD;
+}
+
+/*
+ * The page cache holds extents rather than single pages, so that a run of
+ * cached pages can be mapped into unicorn as one region and take one fault.
+ * Its keys are the start addresses of the extents, which never overlap. A page
+ * merges with the extents next to it when their permissions match and its
+ * bytes come right before or after theirs in host memory.
+ */
+
+// the extent holding the page at address, or the end of cache
+static PageCache::iterator find_extent(PageCache *cache, uint64_t address) {
+	auto it = cache->upper_bound(address);
+	if (it == cache->begin()) {
+		return cache->end();
+	}
+	it--;
+	return address < it->first + it->second.size ? it : cache->end();
+}
+
+static inline bool extents_continue(const PageCache::value_type &first, const PageCache::value_type &second) {
+	return first.first + first.second.size == second.first &&
+		first.second.bytes + first.second.size == second.second.bytes &&
+		first.second.perms == second.second.perms && first.second.shared == second.second.shared;
+}
+
+// append second to first. returns the change in the bytes held by the cache
+static int64_t merge_extents(PageCache *cache, PageCache::iterator first, PageCache::iterator second) {
+	int64_t delta = -(int64_t)(cached_page_bytes(first->second) + cached_page_bytes(second->second));
+	first->second.size += second->second.size;
+	cache->erase(second);
+	return delta + cached_page_bytes(first->second);
+}
+
+/*
+ * add the page at address, which must not be in cache, merging it with the extents around it. *extent is set to
+ * the extent that holds it. returns the change in the bytes held by the cache.
+ */
+static int64_t insert_page(PageCache *cache, uint64_t address, uint8_t *bytes, uint64_t perms, bool shared, PageCache::iterator *extent) {
+	CachedPage page = {PAGE_SIZE, bytes, perms, shared};
+	auto it = cache->insert(std::make_pair(address, page)).first;
+	int64_t delta = cached_page_bytes(page);
+
+	auto next = std::next(it);
+	if (next != cache->end() && extents_continue(*it, *next)) {
+		delta += merge_extents(cache, it, next);
+	}
+	if (it != cache->begin()) {
+		auto prev = std::prev(it);
+		if (extents_continue(*prev, *it)) {
+			delta += merge_extents(cache, prev, it);
+			it = prev;
+		}
+	}
+	*extent = it;
+	return delta;
+}
+
+/*
+ * take [start, end) out of extent, keeping the parts of it before and after. returns the change in the bytes held
+ * by the cache.
+ */
+static int64_t cut_extent(PageCache *cache, PageCache::iterator extent, uint64_t start, uint64_t end) {
+	uint64_t extent_start = extent->first;
+	CachedPage page = extent->second;
+	int64_t delta = -(int64_t)cached_page_bytes(page);
+	cache->erase(extent);
+
+	if (start > extent_start) {
+		CachedPage before = {start - extent_start, page.bytes, page.perms, page.shared};
+		cache->insert(std::make_pair(extent_start, before));
+		delta += cached_page_bytes(before);
+	}
+	if (end < extent_start + page.size) {
+		CachedPage after = {extent_start + page.size - end, page.bytes + (end - extent_start), page.perms, page.shared};
+		cache->insert(std::make_pair(end, after));
+		delta += cached_page_bytes(after);
+	}
+	return delta;
+}
+
+// unmap whatever uc has mapped in [start, end), which may cover regions only in part
+static void unmap_range(uc_engine *uc, uint64_t start, uint64_t end) {
+	uc_mem_region *regions;
+	uint32_t count;
+	if (uc_mem_regions(uc, &regions, &count) != UC_ERR_OK) {
+		return;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		uint64_t lo = std::max(start, regions[i].begin);
+		uint64_t hi = std::min(end - 1, regions[i].end);
+		if (lo <= hi) {
+			uc_mem_unmap(uc, lo, hi - lo + 1);
+		}
+	}
+	uc_free(regions);
+}
+
+/*
+ * Host memory for the private pages of one key's page cache. Each aligned chunk
+ * of the guest address space gets one reservation, and a page lives at its own
+ * offset in there, so pages that are next to each other in the guest are next
+ * to each other here too, whenever and in whatever order they were cached.
+ * Reservations are not backed until their pages are written, and released
+ * pages are given back to the system. On Windows every page is allocated on
+ * its own, and extents only hold shared pages that happen to be in order.
+ */
+#define PAGE_ARENA_CHUNK_SIZE 0x400000ULL
+
+class PageArena {
+private:
+	// by the guest address of the chunk, or of the page on Windows
+	std::map<uint64_t, uint8_t *> chunks;
+
+public:
+	~PageArena() {
+		for (auto it = chunks.begin(); it != chunks.end(); it++) {
+#ifdef _MSC_VER
+			free(it->second);
+#else
+			munmap(it->second, PAGE_ARENA_CHUNK_SIZE);
+#endif
+		}
+	}
+
+	// the bytes of the page at address, or NULL when we're out of memory
+	uint8_t *alloc(uint64_t address) {
+#ifdef _MSC_VER
+		uint8_t *bytes = (uint8_t *)malloc(PAGE_SIZE);
+		if (bytes != NULL) {
+			chunks[address] = bytes;
+		}
+		return bytes;
+#else
+		uint64_t base = address & ~(PAGE_ARENA_CHUNK_SIZE - 1);
+		auto chunk = chunks.find(base);
+		if (chunk == chunks.end()) {
+			void *reservation = mmap(NULL, PAGE_ARENA_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (reservation == MAP_FAILED) {
+				return NULL;
+			}
+			chunk = chunks.insert(std::make_pair(base, (uint8_t *)reservation)).first;
+		}
+		return chunk->second + (address - base);
+#endif
+	}
+
+	void release(uint64_t address, uint8_t *bytes) {
+#ifdef _MSC_VER
+		chunks.erase(address);
+		free(bytes);
+#else
+		madvise(bytes, PAGE_SIZE, MADV_DONTNEED);
+#endif
+	}
+};
+
+class SharedPages;
+
+// counters kept by each State while it runs, and added to the registry when it is released
+typedef struct cache_counters {
+	uint64_t page_hits;
+	uint64_t page_misses;
+	uint64_t block_hits;
+	uint64_t block_misses;
+	uint64_t block_full_lifts;
+	uint64_t blocks_prelifted;
+} cache_counters_t;
+
+typedef struct cache_stats {
+	uint64_t page_hits;
+	uint64_t page_misses;
+	uint64_t block_hits;
+	uint64_t block_misses;
+	uint64_t evictions;
+	uint64_t bytes_resident;
+	uint64_t keys_resident;
+	uint64_t bytes_budget;
+	uint64_t block_full_lifts; // blocks whose cheap summary was not enough to decide
+	uint64_t blocks_prelifted; // blocks lifted by the prelift worker
+} cache_stats_t;
+
+#define ENTRY_RECENT_RUNS 8
+
+// how the runs of unicorn that started at one address went
+typedef struct entry_stats {
+	uint64_t address;
+	uint64_t runs;
+	uint64_t steps; // over all the runs
+	uint64_t skips; // entries python passed on since the last run, see simunicorn_skip_entry
+	uint32_t recent_steps[ENTRY_RECENT_RUNS]; // of the last runs, newest first
+	uint8_t recent_stops[ENTRY_RECENT_RUNS];  // stop_t of the last runs, newest first
+} entry_stats_t;
+typedef std::unordered_map<uint64_t, entry_stats_t> EntryStats;
+
+class CacheRegistry;
+
+/*
+ * The caches of one cache key. They are shared by all the States with that key,
+ * which may live on different threads, so the containers are only touched
+ * with lock held. Block entries are never moved once inserted, so pointers to
+ * them stay valid after the lock is dropped; extents are merged and split.
+ */
+typedef struct caches {
+	uint64_t key;
+	CacheRegistry *registry; // that they belong to
+	PageCache *page_cache;
+	PageArena *page_arena;
+	BlockCache *block_cache;   // from full lifts
+	BlockCache *summary_cache; // from cheap lifts, for the blocks that have no full one
+	BlockCache *prelift_cache; // from full lifts by the prelift worker, only good for blocks of the same size
+	EntryStats *entry_stats;
+	std::mutex lock;
+
+	// the following are guarded by the registry
+	uint64_t refcount;
+	uint64_t last_use;
+	bool idle; // on the registry's LRU list
+	bool pinned; // loaded for States that haven't taken it yet: kept off the LRU until one does
+	std::list<struct caches *>::iterator lru_position;
+
+	// engines that have pages of page_cache mapped with uc_mem_map_ptr; guarded by lock
+	std::set<uc_engine *> engines;
+
+	// pages shared with other processes, if any, and the pages that were uncached here since, which must not be taken
+	// from there again; guarded by lock
+	SharedPages *shared;
+	std::set<uint64_t> unshared;
+} caches_t;
+
+// pages of an evicted key that some engines may still have mapped
+typedef struct retired_pages {
+	PageCache *page_cache;
+	PageArena *page_arena;
+	std::set<uc_engine *> engines;
+} retired_pages_t;
+
+#define CACHE_SHARDS 16
+
+/*
+ * Registry of the caches of every cache key: the process-wide one, and those of
+ * the contexts made with simunicorn_context_alloc.
+ *
+ * The key -> caches map is split into shards, each with its own lock. A key's
+ * caches are refcounted by the States using it; once the last one goes away
+ * the key becomes idle and goes on an LRU list, and idle keys are evicted
+ * (oldest first) whenever the bytes held by all the caches exceed the budget.
+ * The default budget is unlimited, which keeps caches around for as long as
+ * the process lives; a budget of 0 frees a key's caches as soon as the last
+ * State using it is released.
+ *
+ * Cached pages are mapped into unicorn without a copy, so the pages of an
+ * evicted key are only freed once every engine that mapped them has unmapped
+ * them. This happens the next time a State is allocated on that engine.
+ */
+class CacheRegistry {
+private:
+	typedef struct shard {
+		std::mutex lock;
+		std::map<uint64_t, caches_t *> caches;
+	} shard_t;
+
+	shard_t shards[CACHE_SHARDS];
+
+	// guards lru, retired, tick, shared_pages and the stats
+	std::mutex lock;
+	std::list<caches_t *> lru;
+	std::list<retired_pages_t *> retired;
+	uint64_t tick;
+	cache_stats_t stats;
+
+	// the keys whose page cache is backed by shared pages. kept here rather than only in the caches, so that a key
+	// gets them back when its caches are created again after an eviction.
+	std::map<uint64_t, SharedPages *> shared_pages;
+
+	std::atomic<uint64_t> bytes_resident;
+	std::atomic<uint64_t> bytes_budget;
+
+	shard_t &shard_for(uint64_t key) {
+		return shards[(key ^ (key >> 17) ^ (key >> 31)) % CACHE_SHARDS];
+	}
+
+	void free_page_cache(PageCache *page_cache, PageArena *page_arena) {
+		delete page_arena;
+		delete page_cache;
+	}
+
+	// evict idle keys until we're under budget
+	void evict() {
+		while (bytes_resident.load() > bytes_budget.load()) {
+			caches_t *victim;
+			uint64_t key;
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				if (lru.empty()) {
+					return;
+				}
+				victim = lru.front();
+				key = victim->key;
+				lru.pop_front();
+				victim->idle = false;
+			}
+
+			shard_t &shard = shard_for(key);
+			std::unique_lock<std::mutex> shard_guard(shard.lock);
+			if (victim->refcount != 0) {
+				// someone picked it up again while we weren't looking
+				continue;
+			}
+			shard.caches.erase(key);
+			shard_guard.unlock();
+			free_caches(victim);
+		}
+	}
+
+	// free the caches of a key that has been dropped from its shard
+	void free_caches(caches_t *victim) {
+		uint64_t bytes = sizeof(caches_t);
+		for (auto it = victim->page_cache->begin(); it != victim->page_cache->end(); it++) {
+			bytes += cached_page_bytes(it->second);
+		}
+		for (auto it = victim->block_cache->begin(); it != victim->block_cache->end(); it++) {
+			bytes += block_entry_bytes(it->second);
+		}
+		for (auto it = victim->summary_cache->begin(); it != victim->summary_cache->end(); it++) {
+			bytes += block_entry_bytes(it->second);
+		}
+		for (auto it = victim->prelift_cache->begin(); it != victim->prelift_cache->end(); it++) {
+			bytes += block_entry_bytes(it->second);
+		}
+		bytes += victim->entry_stats->size() * (sizeof(entry_stats_t) + CACHE_NODE_OVERHEAD);
+		bytes_resident -= bytes;
+
+		delete victim->block_cache;
+		delete victim->summary_cache;
+		delete victim->prelift_cache;
+		delete victim->entry_stats;
+		std::lock_guard<std::mutex> guard(lock);
+		if (victim->engines.empty() || victim->page_cache->empty()) {
+			free_page_cache(victim->page_cache, victim->page_arena);
+		} else {
+			retired.push_back(new retired_pages_t{victim->page_cache, victim->page_arena, victim->engines});
+		}
+		stats.evictions++;
+		stats.keys_resident--;
+		delete victim;
+	}
+
+public:
+	CacheRegistry() : tick(0), bytes_resident(0), bytes_budget(UINT64_MAX) {
+		memset(&stats, 0, sizeof(stats));
+	}
+
+	/*
+	 * only once no State uses any of the caches, and the engines the States ran on are closed: cached pages are
+	 * freed even if they're still mapped somewhere.
+	 */
+	~CacheRegistry() {
+		for (auto &shard : shards) {
+			for (auto &entry : shard.caches) {
+				entry.second->engines.clear();
+				free_caches(entry.second);
+			}
+			shard.caches.clear();
+		}
+		for (retired_pages_t *r : retired) {
+			free_page_cache(r->page_cache, r->page_arena);
+			delete r;
+		}
+	}
+
+	/*
+	 * get the caches for a key, creating them if needed, for a State that runs on uc
+	 * (or NULL when the caches are not going to be mapped anywhere).
+	 */
+	caches_t *acquire(uint64_t key, uc_engine *uc) {
+		if (uc != NULL) {
+			unmap_retired(uc);
+		}
+
+		shard_t &shard = shard_for(key);
+		caches_t *caches;
+		{
+			std::lock_guard<std::mutex> shard_guard(shard.lock);
+			auto it = shard.caches.find(key);
+			if (it == shard.caches.end()) {
+				caches = new caches_t();
+				caches->key = key;
+				caches->registry = this;
+				caches->page_cache = new PageCache();
+				caches->page_arena = new PageArena();
+				caches->block_cache = new BlockCache();
+				caches->summary_cache = new BlockCache();
+				caches->prelift_cache = new BlockCache();
+				caches->entry_stats = new EntryStats();
+				caches->refcount = 0;
+				caches->idle = false;
+				caches->pinned = false;
+				caches->shared = NULL;
+				shard.caches[key] = caches;
+				bytes_resident += sizeof(caches_t);
+
+				std::lock_guard<std::mutex> guard(lock);
+				stats.keys_resident++;
+				auto shared = shared_pages.find(key);
+				if (shared != shared_pages.end()) {
+					caches->shared = shared->second;
+				}
+			} else {
+				caches = it->second;
+			}
+
+			std::lock_guard<std::mutex> guard(lock);
+			if (caches->idle) {
+				lru.erase(caches->lru_position);
+				caches->idle = false;
+			}
+			caches->refcount++;
+			caches->last_use = ++tick;
+			if (uc != NULL) {
+				caches->pinned = false;
+			}
+		}
+		return caches;
+	}
+
+	/*
+	 * call fn with the caches of key if there are any, without creating them,
+	 * taking a reference or touching the LRU. they can't be evicted meanwhile,
+	 * as eviction takes the shard's lock. returns whether there were any.
+	 */
+	template <typename F>
+	bool peek(uint64_t key, F fn) {
+		shard_t &shard = shard_for(key);
+		std::lock_guard<std::mutex> shard_guard(shard.lock);
+		auto it = shard.caches.find(key);
+		if (it == shard.caches.end()) {
+			return false;
+		}
+		fn(it->second);
+		return true;
+	}
+
+	/*
+	 * back the page cache of key with shared, from now on and whenever its caches are created again. this doesn't
+	 * create the caches.
+	 */
+	void share_pages(uint64_t key, SharedPages *shared) {
+		shard_t &shard = shard_for(key);
+		std::lock_guard<std::mutex> shard_guard(shard.lock);
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			shared_pages[key] = shared;
+		}
+		auto it = shard.caches.find(key);
+		if (it != shard.caches.end()) {
+			std::lock_guard<std::mutex> guard(it->second->lock);
+			it->second->shared = shared;
+		}
+	}
+
+	/*
+	 * drop a State's reference to its caches, and fold in the counters it collected. with pin, and no other
+	 * reference, the caches stay out of eviction until a State takes them.
+	 */
+	void release(caches_t *caches, const cache_counters_t &counters, bool pin = false) {
+		shard_t &shard = shard_for(caches->key);
+		{
+			std::lock_guard<std::mutex> shard_guard(shard.lock);
+			std::lock_guard<std::mutex> guard(lock);
+			stats.page_hits += counters.page_hits;
+			stats.page_misses += counters.page_misses;
+			stats.block_hits += counters.block_hits;
+			stats.block_misses += counters.block_misses;
+			stats.block_full_lifts += counters.block_full_lifts;
+			stats.blocks_prelifted += counters.blocks_prelifted;
+
+			if (--caches->refcount == 0 && pin) {
+				caches->pinned = true;
+			}
+			if (caches->refcount == 0 && !caches->pinned) {
+				caches->idle = true;
+				caches->lru_position = lru.insert(lru.end(), caches);
+			}
+		}
+		evict();
+	}
+
+	/*
+	 * unmap and free the retired pages that uc still has mapped. uc must not be running.
+	 */
+	void unmap_retired(uc_engine *uc) {
+		std::lock_guard<std::mutex> guard(lock);
+		for (auto it = retired.begin(); it != retired.end(); ) {
+			retired_pages_t *r = *it;
+			if (r->engines.erase(uc) != 0) {
+				for (auto extent = r->page_cache->begin(); extent != r->page_cache->end(); extent++) {
+					unmap_range(uc, extent->first, extent->first + extent->second.size);
+				}
+			}
+			if (r->engines.empty()) {
+				free_page_cache(r->page_cache, r->page_arena);
+				delete r;
+				it = retired.erase(it);
+			} else {
+				it++;
+			}
+		}
+	}
+
+	void account(int64_t bytes) {
+		bytes_resident += bytes;
+	}
+
+	void set_budget(uint64_t bytes) {
+		bytes_budget = bytes;
+		evict();
+	}
+
+	void get_stats(cache_stats_t *out) {
+		std::lock_guard<std::mutex> guard(lock);
+		*out = stats;
+		out->bytes_resident = bytes_resident.load();
+		out->bytes_budget = bytes_budget.load();
+	}
+};
+
+// the default context
+CacheRegistry global_cache;
+
+// libvex is not reentrant. python's lifts take it too, through simunicorn_vex_lock.
+static std::mutex vex_lift_lock;
+
+/*
+ * Non-writable pages shared between the processes working on the same binary,
+ * in a named POSIX shared memory object, so that they hold one physical copy
+ * of its code and read-only data:
+ *
+ *   shared_pages_header_t
+ *   shared_page_slot_t[slot_count], open-addressed by page address
+ *   shared_page_info_t[capacity]
+ *   uint8_t[capacity][PAGE_SIZE]
+ *
+ * Pages are only ever added, by the first process to cache them, and never
+ * change after that. There is no lock, so a process that dies halfway through
+ * adding a page can't hold up the others: it claims a data index with a
+ * fetch_add on used, fills in the page and its info, and then publishes the
+ * index with a CAS on an empty slot. At worst a dead process, or one that
+ * loses a race for the same page, wastes its index. Unicorn gets the pages
+ * from a second, read-only mapping of the object.
+ *
+ * A mapping stays for as long as the process lives, since engines may have its
+ * pages mapped at any time. Not available on Windows.
+ */
+#define SHARED_PAGES_MAGIC 0x5345474150534e41ULL
+#define SHARED_PAGES_VERSION 2
+
+typedef struct shared_pages_header {
+	uint64_t magic;
+	uint64_t version;
+	uint64_t binary_hash;
+	uint64_t capacity;
+	uint64_t slot_count; // a power of two
+	std::atomic<uint64_t> ready; // set once the process that created the object has filled in the above
+	std::atomic<uint64_t> used; // data indices claimed so far, which may run past capacity
+} shared_pages_header_t;
+
+typedef struct shared_page_slot {
+	std::atomic<uint64_t> index; // data index + 1, or 0 when the slot is empty
+} shared_page_slot_t;
+
+// written by the process that claimed the data index, before it publishes it
+typedef struct shared_page_info {
+	uint64_t address;
+	uint64_t perms;
+} shared_page_info_t;
+
+class SharedPages {
+private:
+	uint8_t *rw;
+	const uint8_t *ro;
+	size_t size;
+	shared_pages_header_t *header;
+	shared_page_slot_t *slots;
+	shared_page_info_t *info;
+	size_t data_offset;
+
+	SharedPages() : rw(NULL), ro(NULL), size(0), header(NULL), slots(NULL), info(NULL), data_offset(0) {}
+
+	static size_t layout(uint64_t capacity, uint64_t slot_count) {
+		size_t index = sizeof(shared_pages_header_t) + slot_count * sizeof(shared_page_slot_t) +
+			capacity * sizeof(shared_page_info_t);
+		return ((index + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1)) + capacity * PAGE_SIZE;
+	}
+
+	inline uint64_t first_slot(uint64_t address) const {
+		uint64_t h = (address >> PAGE_SHIFT) * 0x9E3779B97F4A7C15ULL;
+		return (h >> 32) & (header->slot_count - 1);
+	}
+
+	// the slot of address, or the empty slot where it would go, starting the search at slot i. *index gets its
+	// content as it was seen.
+	shared_page_slot_t *probe(uint64_t address, uint64_t i, uint64_t *index) const {
+		for (; ; i = (i + 1) & (header->slot_count - 1)) {
+			*index = slots[i].index.load(std::memory_order_acquire);
+			if (*index == 0 || info[*index - 1].address == address) {
+				return &slots[i];
+			}
+		}
+	}
+
+	inline const uint8_t *page(uint64_t index) const {
+		return ro + data_offset + (size_t)index * PAGE_SIZE;
+	}
+
+public:
+	~SharedPages() {
+#ifndef _MSC_VER
+		if (rw != NULL) munmap(rw, size);
+		if (ro != NULL) munmap((void *)ro, size);
+#endif
+	}
+
+	/*
+	 * open the object called name, creating it with room for capacity pages if it doesn't exist. returns NULL if it
+	 * can't, or if it was created for another binary.
+	 */
+	static SharedPages *open(const char *name, uint64_t binary_hash, uint64_t capacity) {
+#ifdef _MSC_VER
+		return NULL;
+#else
+		uint64_t slot_count = 1;
+		while (slot_count < capacity * 2) slot_count <<= 1;
+
+		bool created = true;
+		int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd == -1 && errno == EEXIST) {
+			created = false;
+			fd = shm_open(name, O_RDWR, 0600);
+		}
+		if (fd == -1) {
+			return NULL;
+		}
+
+		size_t size;
+		if (created) {
+			size = layout(capacity, slot_count);
+			if (ftruncate(fd, size) != 0) {
+				close(fd);
+				shm_unlink(name);
+				return NULL;
+			}
+		} else {
+			// wait for the process that is creating it to size it
+			struct stat st;
+			for (int tries = 0; ; tries++) {
+				if (fstat(fd, &st) != 0 || tries == 1000) {
+					close(fd);
+					return NULL;
+				}
+				if ((size_t)st.st_size >= sizeof(shared_pages_header_t)) break;
+				usleep(1000);
+			}
+			size = st.st_size;
+		}
+
+		std::unique_ptr<SharedPages> pages(new SharedPages());
+		void *rw = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		void *ro = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		pages->rw = rw == MAP_FAILED ? NULL : (uint8_t *)rw;
+		pages->ro = ro == MAP_FAILED ? NULL : (const uint8_t *)ro;
+		pages->size = size;
+		if (pages->rw == NULL || pages->ro == NULL) {
+			return NULL;
+		}
+
+		shared_pages_header_t *header = (shared_pages_header_t *)pages->rw;
+		if (created) {
+			header->magic = SHARED_PAGES_MAGIC;
+			header->version = SHARED_PAGES_VERSION;
+			header->binary_hash = binary_hash;
+			header->capacity = capacity;
+			header->slot_count = slot_count;
+			header->ready.store(1, std::memory_order_release);
+		} else {
+			for (int tries = 0; header->ready.load(std::memory_order_acquire) == 0; tries++) {
+				if (tries == 1000) return NULL;
+				usleep(1000);
+			}
+			if (header->magic != SHARED_PAGES_MAGIC || header->version != SHARED_PAGES_VERSION ||
+					header->binary_hash != binary_hash || size < layout(header->capacity, header->slot_count)) {
+				return NULL;
+			}
+		}
+
+		pages->header = header;
+		pages->slots = (shared_page_slot_t *)(pages->rw + sizeof(shared_pages_header_t));
+		pages->info = (shared_page_info_t *)(pages->slots + header->slot_count);
+		pages->data_offset = layout(header->capacity, header->slot_count) - header->capacity * PAGE_SIZE;
+		return pages.release();
+#endif
+	}
+
+	// the pages added so far, counting any that are still being added
+	inline uint64_t count() const {
+		return std::min(header->used.load(std::memory_order_acquire), header->capacity);
+	}
+
+	inline uint64_t binary_hash() const {
+		return header->binary_hash;
+	}
+
+	// the shared copy of the page at address, or NULL
+	const uint8_t *find(uint64_t address, uint64_t *perms) const {
+		uint64_t index;
+		probe(address, first_slot(address), &index);
+		if (index == 0) {
+			return NULL;
+		}
+		*perms = info[index - 1].perms;
+		return page(index - 1);
+	}
+
+	/*
+	 * add a copy of the page at address, unless some process already did. returns the shared copy, or NULL once the
+	 * object is full.
+	 */
+	const uint8_t *insert(uint64_t address, const uint8_t *bytes, uint64_t perms) {
+		uint64_t existing_perms;
+		const uint8_t *existing = find(address, &existing_perms);
+		if (existing != NULL) {
+			return existing;
+		}
+		if (header->used.load(std::memory_order_relaxed) >= header->capacity) {
+			return NULL;
+		}
+
+		uint64_t index = header->used.fetch_add(1, std::memory_order_relaxed);
+		if (index >= header->capacity) {
+			return NULL;
+		}
+		memcpy(rw + data_offset + index * PAGE_SIZE, bytes, PAGE_SIZE);
+		info[index].address = address;
+		info[index].perms = perms;
+
+		uint64_t i = first_slot(address);
+		while (true) {
+			uint64_t seen;
+			shared_page_slot_t *slot = probe(address, i, &seen);
+			if (seen == 0 && slot->index.compare_exchange_strong(seen, index + 1, std::memory_order_acq_rel)) {
+				return page(index);
+			}
+			if (info[seen - 1].address == address) {
+				// another process added it first: our index goes unused
+				return page(seen - 1);
+			}
+			// another page took the slot: keep probing after it
+			i = ((slot - slots) + 1) & (header->slot_count - 1);
+		}
+	}
+};
+
+// the shared page objects this process has opened, by name
+static std::map<std::string, SharedPages *> shared_page_objects;
+static std::mutex shared_page_objects_lock;
+
+/*
+ * On-disk format of a block cache, so that workers analyzing the same binary
+ * don't have to lift every block again:
+ *
+ *   block_cache_file_header_t
+ *   block_cache_file_entry_t[entry_count], sorted by address
+ *   register_range_t[range_count]
+ *
+ * Each entry owns used_ranges + clobbered_ranges consecutive ranges starting at
+ * first_range, the used registers first. Everything is fixed-size and naturally
+ * aligned, so the file can be mmapped and searched in place as well. Files are
+ * written in host byte order, which byte_order records.
+ */
+static const char BLOCK_CACHE_MAGIC[8] = {'A', 'N', 'G', 'R', 'B', 'L', 'K', 'C'};
+#define BLOCK_CACHE_VERSION 1
+#define BLOCK_CACHE_BYTE_ORDER 0x01020304
+
+typedef struct block_cache_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint64_t binary_hash;
+	uint64_t entry_count;
+	uint64_t range_count;
+} block_cache_file_header_t;
+
+typedef struct block_cache_file_entry {
+	uint64_t address;
+	uint32_t first_range;
+	uint16_t used_ranges;
+	uint16_t clobbered_ranges;
+	uint8_t try_unicorn;
+	uint8_t loads_dead;
+	uint8_t padding[6];
+} block_cache_file_entry_t;
+
+/*
+ * write the block cache of a key to path, replacing it atomically.
+ * returns the number of blocks written, or -1 on error.
+ */
+static int64_t save_block_cache(caches_t *caches, const char *path, uint64_t binary_hash) {
+	std::vector<block_cache_file_entry_t> entries;
+	std::vector<register_range_t> ranges;
+	{
+		std::lock_guard<std::mutex> guard(caches->lock);
+		std::vector<uint64_t> addresses;
+		for (auto it = caches->block_cache->begin(); it != caches->block_cache->end(); it++) {
+			addresses.push_back(it->first);
+		}
+		std::sort(addresses.begin(), addresses.end());
+
+		for (uint64_t address : addresses) {
+			const block_entry_t &block = caches->block_cache->at(address);
+			block_cache_file_entry_t entry;
+			memset(&entry, 0, sizeof(entry));
+			entry.address = address;
+			entry.first_range = ranges.size();
+			entry.try_unicorn = block.try_unicorn;
+			entry.loads_dead = block.loads_dead;
+			ranges.insert(ranges.end(), block.used_registers.begin(), block.used_registers.end());
+			ranges.insert(ranges.end(), block.clobbered_registers.begin(), block.clobbered_registers.end());
+			entry.used_ranges = block.used_registers.size();
+			entry.clobbered_ranges = block.clobbered_registers.size();
+			entries.push_back(entry);
+		}
+	}
+
+	block_cache_file_header_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, BLOCK_CACHE_MAGIC, sizeof(header.magic));
+	header.version = BLOCK_CACHE_VERSION;
+	header.byte_order = BLOCK_CACHE_BYTE_ORDER;
+	header.binary_hash = binary_hash;
+	header.entry_count = entries.size();
+	header.range_count = ranges.size();
+
+	// other workers may be reading the old file, so write a new one and move it into place
+	std::string tmp_path = std::string(path) + ".tmp" +
+		std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+	FILE *f = fopen(tmp_path.c_str(), "wb");
+	if (f == NULL) {
+		return -1;
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+	ok = ok && (entries.empty() || fwrite(&entries[0], sizeof(entries[0]), entries.size(), f) == entries.size());
+	ok = ok && (ranges.empty() || fwrite(&ranges[0], sizeof(ranges[0]), ranges.size(), f) == ranges.size());
+	ok = (fclose(f) == 0) && ok;
+	if (ok && rename(tmp_path.c_str(), path) != 0) {
+		// windows won't rename over an existing file
+		remove(path);
+		ok = rename(tmp_path.c_str(), path) == 0;
+	}
+	if (!ok) {
+		remove(tmp_path.c_str());
+		return -1;
+	}
+	return entries.size();
+}
+
+/*
+ * add the blocks in the file at path to the block cache of a key. blocks that are
+ * already cached are kept. returns the number of blocks read, or -1 if the file
+ * can't be read or was written for a different binary.
+ */
+static int64_t load_block_cache(caches_t *caches, const char *path, uint64_t binary_hash) {
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		return -1;
+	}
+
+	block_cache_file_header_t header;
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+			memcmp(header.magic, BLOCK_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+			header.version != BLOCK_CACHE_VERSION ||
+			header.byte_order != BLOCK_CACHE_BYTE_ORDER ||
+			header.binary_hash != binary_hash) {
+		fclose(f);
+		return -1;
+	}
+
+	std::vector<block_cache_file_entry_t> entries(header.entry_count);
+	std::vector<register_range_t> ranges(header.range_count);
+	bool ok = entries.empty() || fread(&entries[0], sizeof(entries[0]), entries.size(), f) == entries.size();
+	ok = ok && (ranges.empty() || fread(&ranges[0], sizeof(ranges[0]), ranges.size(), f) == ranges.size());
+	fclose(f);
+	if (!ok) {
+		return -1;
+	}
+
+	for (auto &entry : entries) {
+		if ((uint64_t)entry.first_range + entry.used_ranges + entry.clobbered_ranges > ranges.size()) {
+			return -1;
+		}
+	}
+
+	std::lock_guard<std::mutex> guard(caches->lock);
+	for (auto &entry : entries) {
+		block_entry_t block;
+		block.try_unicorn = entry.try_unicorn != 0;
+		block.size = 0;
+		// with no size, there's no telling whether the extent unicorn runs is the one that was lifted
+		block.loads_dead = false;
+		const register_range_t *used = ranges.data() + entry.first_range;
+		const register_range_t *clobbered = used + entry.used_ranges;
+		block.used_registers.assign(used, used + entry.used_ranges);
+		block.clobbered_registers.assign(clobbered, clobbered + entry.clobbered_ranges);
+
+		auto inserted = caches->block_cache->emplace(entry.address, std::move(block));
+		if (inserted.second) {
+			caches->registry->account(block_entry_bytes(inserted.first->second));
+		}
+	}
+	return entries.size();
+}
+
+
+// an active page: its packed taint bitmap, and the page data if the page is direct-mapped (otherwise NULL).
+// direct-mapped pages also keep a pointer to the byte bitmap owned by python, which must see taint we clear.
+// in undo log mode, undo_lines marks the cache lines of the page already saved during block undo_epoch.
+// in guard mode, guard says how writes to the page are caught, and perms are its permissions in unicorn before that.
+typedef struct active_page {
+	PageBitmap *bitmap;
+	uint8_t *data;
+	taint_t *py_bitmap;
+	uint64_t undo_epoch;
+	uint64_t undo_lines;
+	uint8_t guard;
+	uint32_t perms;
+} active_page_t;
+
+typedef enum guard {
+	GUARD_NONE = 0, // by the write hooks, or not at all if the page isn't writable
+	GUARD_ARMED,    // write-protected in unicorn, the first write opens it
+	GUARD_OPEN,     // writable and saved whole at each checkpoint, see State::checkpoint_guards
+} guard_t;
+
+//
+// Bit plane helpers. Ranges are [start, start + length) in bits, and never cross the end of a plane.
+//
+
+static inline int bit_ctz64(uint64_t x) {
+#ifdef _MSC_VER
+	unsigned long idx;
+	_BitScanForward64(&idx, x);
+	return (int)idx;
+#else
+	return __builtin_ctzll(x);
+#endif
+}
+
+static inline int bit_popcount64(uint64_t x) {
+#ifdef _MSC_VER
+	return (int)__popcnt64(x);
+#else
+	return __builtin_popcountll(x);
+#endif
+}
+
+// mask of the bits of word w that fall into [start, end)
+static inline uint64_t bit_word_mask(int w, int start, int end) {
+	int lo = std::max(start - w * 64, 0);
+	int hi = std::min(end - w * 64, 64);
+	uint64_t mask = (hi == 64) ? ~0ULL : ((1ULL << hi) - 1);
+	return mask & ~((1ULL << lo) - 1);
+}
+
+// index of the first set bit in [start, end), or -1
+static inline int bit_find_set(const uint64_t *plane, int start, int end) {
+	if (start >= end) return -1;
+	for (int w = start / 64; w * 64 < end; w++) {
+		uint64_t bits = plane[w] & bit_word_mask(w, start, end);
+		if (bits) {
+			return w * 64 + bit_ctz64(bits);
+		}
+	}
+	return -1;
+}
+
+// index of the first clear bit in [start, end), or end
+static inline int bit_find_clear(const uint64_t *plane, int start, int end) {
+	if (start >= end) return end;
+	for (int w = start / 64; w * 64 < end; w++) {
+		uint64_t bits = ~plane[w] & bit_word_mask(w, start, end);
+		if (bits) {
+			return w * 64 + bit_ctz64(bits);
+		}
+	}
+	return end;
+}
+
+// the (at most 64) bits at [start, start + length), shifted down to bit 0
+static inline uint64_t bit_extract(const uint64_t *plane, int start, int length) {
+	int w = start / 64, shift = start % 64;
+	uint64_t bits = plane[w] >> shift;
+	if (shift + length > 64) {
+		bits |= plane[w + 1] << (64 - shift);
+	}
+	return length == 64 ? bits : bits & ((1ULL << length) - 1);
+}
+
+// set (or clear) the bits at [start, start + length) that are set in mask
+static inline void bit_update(uint64_t *plane, int start, int length, uint64_t mask, bool set) {
+	if (length < 64) mask &= (1ULL << length) - 1;
+	int w = start / 64, shift = start % 64;
+	uint64_t lo = mask << shift;
+	uint64_t hi = (shift + length > 64) ? mask >> (64 - shift) : 0;
+	if (set) {
+		plane[w] |= lo;
+		if (hi) plane[w + 1] |= hi;
+	} else {
+		plane[w] &= ~lo;
+		if (hi) plane[w + 1] &= ~hi;
+	}
+}
+
+// pack the low bit of each of 64 taint bytes into one word
+static inline uint64_t bit_pack_bytes(const uint8_t *bytes, int bit) {
+	uint64_t out = 0;
+	for (int i = 0; i < 8; i++) {
+		uint64_t x;
+		memcpy(&x, &bytes[i * 8], 8);
+		x = (x >> bit) & 0x0101010101010101ULL;
+		out |= ((x * 0x0102040810204080ULL) >> 56) << (i * 8);
+	}
+	return out;
+}
+
+#define REGISTER_BITSET_WORDS (MAX_REG_SIZE / 64)
+
+/*
+ * Set of byte offsets into the guest register file, one bit per byte and a
+ * running count of the set bits. Offsets past MAX_REG_SIZE are ignored.
+ */
+class RegisterBitset {
+private:
+	uint64_t words[REGISTER_BITSET_WORDS];
+	uint64_t count;
+
+	static void clamp(uint64_t &offset, uint64_t &length) {
+		if (offset >= MAX_REG_SIZE) {
+			offset = MAX_REG_SIZE;
+			length = 0;
+		} else if (length > MAX_REG_SIZE - offset) {
+			length = MAX_REG_SIZE - offset;
+		}
+	}
+
+public:
+	RegisterBitset() {
+		clear();
+	}
+
+	void clear() {
+		memset(words, 0, sizeof(words));
+		count = 0;
+	}
+
+	inline bool empty() const {
+		return count == 0;
+	}
+
+	inline uint64_t size() const {
+		return count;
+	}
+
+	inline bool contains(uint64_t offset) const {
+		return offset < MAX_REG_SIZE && ((words[offset / 64] >> (offset % 64)) & 1);
+	}
+
+	inline void insert(uint64_t offset, uint64_t length = 1) {
+		clamp(offset, length);
+		int start = offset, end = offset + length;
+		for (int w = start / 64; w * 64 < end; w++) {
+			uint64_t mask = bit_word_mask(w, start, end);
+			count += bit_popcount64(mask & ~words[w]);
+			words[w] |= mask;
+		}
+	}
+
+	inline void erase(uint64_t offset, uint64_t length = 1) {
+		clamp(offset, length);
+		int start = offset, end = offset + length;
+		for (int w = start / 64; w * 64 < end; w++) {
+			uint64_t mask = bit_word_mask(w, start, end);
+			count -= bit_popcount64(mask & words[w]);
+			words[w] &= ~mask;
+		}
+	}
+
+	// insert the offsets of [offset, offset + length) that are not in exclude
+	inline void insert_excluding(uint64_t offset, uint64_t length, const RegisterBitset &exclude) {
+		clamp(offset, length);
+		int start = offset, end = offset + length;
+		for (int w = start / 64; w * 64 < end; w++) {
+			uint64_t mask = bit_word_mask(w, start, end) & ~exclude.words[w];
+			count += bit_popcount64(mask & ~words[w]);
+			words[w] |= mask;
+		}
+	}
+
+	// the lowest offset in [offset, offset + length) that is in the set, or -1
+	inline int64_t find(uint64_t offset, uint64_t length) const {
+		clamp(offset, length);
+		return bit_find_set(words, offset, offset + length);
+	}
+
+	inline void insert(const RegisterRanges &ranges) {
+		for (auto &r : ranges) insert(r.offset, r.length);
+	}
+
+	inline void erase(const RegisterRanges &ranges) {
+		for (auto &r : ranges) erase(r.offset, r.length);
+	}
+
+	// the lowest offset covered by ranges that is in the set, or -1
+	inline int64_t find(const RegisterRanges &ranges) const {
+		for (auto &r : ranges) {
+			int64_t found = find(r.offset, r.length);
+			if (found != -1) return found;
+		}
+		return -1;
+	}
+
+	void to_ranges(RegisterRanges &out) const {
+		out.clear();
+		for (int i = bit_find_set(words, 0, MAX_REG_SIZE); i != -1; ) {
+			int j = bit_find_clear(words, i, MAX_REG_SIZE);
+			out.push_back({(uint16_t)i, (uint16_t)(j - i)});
+			i = bit_find_set(words, j, MAX_REG_SIZE);
+		}
+		out.shrink_to_fit();
+	}
+
+	// append the runs of offsets that are in this set but not in base, or the other way around
+	void changes_since(const RegisterBitset &base, std::vector<register_change_t> &out) const {
+		uint64_t added[REGISTER_BITSET_WORDS], removed[REGISTER_BITSET_WORDS];
+		bool any = false;
+		for (int w = 0; w < REGISTER_BITSET_WORDS; w++) {
+			added[w] = words[w] & ~base.words[w];
+			removed[w] = base.words[w] & ~words[w];
+			any |= (added[w] | removed[w]) != 0;
+		}
+		if (!any) {
+			return;
+		}
+		for (int symbolic = 0; symbolic < 2; symbolic++) {
+			const uint64_t *plane = symbolic ? added : removed;
+			for (int i = bit_find_set(plane, 0, MAX_REG_SIZE); i != -1; ) {
+				int j = bit_find_clear(plane, i, MAX_REG_SIZE);
+				out.push_back({(uint16_t)i, (uint16_t)(j - i), (uint8_t)symbolic});
+				i = bit_find_set(plane, j, MAX_REG_SIZE);
+			}
+		}
+	}
+
+	// call f(offset) for each offset in the set, in ascending order
+	template <typename F>
+	void for_each(F f) const {
+		for (int w = 0; w < REGISTER_BITSET_WORDS; w++) {
+			for (uint64_t bits = words[w]; bits; bits &= bits - 1) {
+				f((uint64_t)(w * 64 + bit_ctz64(bits)));
+			}
+		}
+	}
+};
+
+// Each leaf of the page table covers 4MB of address space
+#define PAGE_TABLE_LEAF_BITS 10
+#define PAGE_TABLE_LEAF_SIZE (1ULL << PAGE_TABLE_LEAF_BITS)
+
+/*
+ * Two-level index from page address to active page. The directory is keyed by
+ * the upper bits of the page number and only grows one node per 4MB region that
+ * has active pages (stack, heap, each segment of the binary), so it stays tiny;
+ * the leaves are flat arrays indexed directly by the lower bits of the page
+ * number. The last page and the last leaf we looked at are remembered, which
+ * turns the common case of repeated accesses to the same page into a single
+ * compare. Iteration is in ascending address order, just like the std::map
+ * that it replaces.
+ */
+class PageTable {
+private:
+	typedef struct page_table_leaf {
+		active_page_t pages[PAGE_TABLE_LEAF_SIZE];
+	} page_table_leaf_t;
+
+	std::map<uint64_t, page_table_leaf_t *> directory;
+
+	// lookups happen in const contexts but still update the hit cache
+	mutable uint64_t last_page;
+	mutable active_page_t *last_entry;
+	mutable uint64_t last_leaf_key;
+	mutable page_table_leaf_t *last_leaf;
+	mutable bool last_leaf_valid;
+
+	static uint64_t leaf_key(uint64_t address) {
+		return address >> (PAGE_SHIFT + PAGE_TABLE_LEAF_BITS);
+	}
+
+	static uint64_t leaf_index(uint64_t address) {
+		return (address >> PAGE_SHIFT) & (PAGE_TABLE_LEAF_SIZE - 1);
+	}
+
+	page_table_leaf_t *find_leaf(uint64_t key) const {
+		if (last_leaf_valid && last_leaf_key == key) {
+			return last_leaf;
+		}
+
+		auto it = directory.find(key);
+		last_leaf_key = key;
+		last_leaf = (it == directory.end()) ? NULL : it->second;
+		last_leaf_valid = true;
+		return last_leaf;
+	}
+
+	void invalidate() {
+		last_entry = NULL;
+		last_leaf_valid = false;
+	}
+
+public:
+	PageTable() {
+		invalidate();
+	}
+
+	~PageTable() {
+		clear();
+	}
+
+	/*
+	 * return the entry for the page containing address, or NULL if the page is not active.
+	 */
+	inline active_page_t *lookup(uint64_t address) const {
+		address &= ~0xFFFULL;
+		if (last_entry && last_page == address) {
+			return last_entry;
+		}
+
+		page_table_leaf_t *leaf = find_leaf(leaf_key(address));
+		if (leaf == NULL) {
+			return NULL;
+		}
 
-typedef struct CachedPage {
-	size_t size;
-	uint8_t *bytes;
-	uint64_t perms;
-} CachedPage;
+		active_page_t *entry = &leaf->pages[leaf_index(address)];
+		if (entry->bitmap == NULL) {
+			return NULL;
+		}
 
-typedef taint_t PageBitmap[PAGE_SIZE];
-typedef std::map<uint64_t, CachedPage> PageCache;
-typedef std::unordered_map<uint64_t, block_entry_t> BlockCache;
-typedef struct caches {
-	PageCache *page_cache;
-	BlockCache *block_cache;
-} caches_t;
-std::map<uint64_t, caches_t> global_cache;
+		last_page = address;
+		last_entry = entry;
+		return entry;
+	}
+
+	/*
+	 * add a page to the index. returns false if the page is already active.
+	 */
+	bool insert(uint64_t address, active_page_t page) {
+		address &= ~0xFFFULL;
+		uint64_t key = leaf_key(address);
+		page_table_leaf_t *leaf = find_leaf(key);
+		if (leaf == NULL) {
+			leaf = new page_table_leaf_t();
+			directory[key] = leaf;
+			// the cached negative lookup for this leaf is now stale
+			invalidate();
+		}
+
+		active_page_t *entry = &leaf->pages[leaf_index(address)];
+		if (entry->bitmap != NULL) {
+			return false;
+		}
+		*entry = page;
+		return true;
+	}
+
+	/*
+	 * remove a page from the index. returns its entry, which has a NULL bitmap if the page was not active.
+	 */
+	active_page_t erase(uint64_t address) {
+		active_page_t page = {NULL, NULL, NULL, 0, 0};
+		page_table_leaf_t *leaf = find_leaf(leaf_key(address));
+		if (leaf != NULL) {
+			active_page_t *entry = &leaf->pages[leaf_index(address)];
+			page = *entry;
+			memset(entry, 0, sizeof(*entry));
+			last_entry = NULL;
+		}
+		return page;
+	}
+
+	/*
+	 * call f(address, page) for each active page, in ascending address order.
+	 */
+	template <typename F>
+	void for_each(F f) const {
+		for (auto it = directory.begin(); it != directory.end(); it++) {
+			uint64_t base = it->first << (PAGE_SHIFT + PAGE_TABLE_LEAF_BITS);
+			for (uint64_t i = 0; i < PAGE_TABLE_LEAF_SIZE; i++) {
+				active_page_t *entry = &it->second->pages[i];
+				if (entry->bitmap != NULL) {
+					f(base + (i << PAGE_SHIFT), entry);
+				}
+			}
+		}
+	}
 
-typedef std::unordered_set<uint64_t> RegisterSet;
+	void clear() {
+		for (auto it = directory.begin(); it != directory.end(); it++) {
+			delete it->second;
+		}
+		directory.clear();
+		invalidate();
+	}
+};
 
 typedef struct mem_access {
 	uint64_t address;
@@ -83,16 +1463,538 @@ typedef struct mem_access {
 	int clean; // save current page bitmap
 } mem_access_t; // actually it should be `mem_write_t` :)
 
+// One cache line of a page is exactly one word of each bit plane
+#define UNDO_LINE_SIZE 64
+
+// the contents and taint of a cache line, saved before the first write to it in the current block
+typedef struct undo_line {
+	uint64_t address;
+	uint8_t data[UNDO_LINE_SIZE];
+	uint64_t symbolic;
+	uint64_t dirty;
+} undo_line_t;
+
+// A guarded page as it was at the last checkpoint
+typedef struct guard_snapshot {
+	uint64_t address;
+	uint32_t idle; // checkpoints in a row that found the page unchanged
+	uint8_t data[PAGE_SIZE];
+} guard_snapshot_t;
+
+// Open guarded pages cost a copy each at every checkpoint, so there are only so many
+#define GUARD_MAX_OPEN 16
+// and those that stop changing for this many checkpoints are armed again
+#define GUARD_IDLE_CHECKPOINTS 4
+
+// a dirty run of memory; its bytes live at offset in the caller's sync buffer
 typedef struct mem_update {
-	uint64_t address, length;
-	struct mem_update *next;
+	uint64_t address;
+	uint64_t length;
+	uint64_t offset;
 } mem_update_t;
 
+/*
+ * results of simunicorn_start_batch, one array element per state. The dirty
+ * runs of state i are updates[update_first[i], update_first[i] + update_count[i]),
+ * with offsets into data. update_truncated[i] is set when they did not all
+ * fit, in which case the caller should sync that state on its own.
+ */
+typedef struct batch_result {
+	uc_err *errors;
+	stop_t *stop_reasons;
+	uint64_t *steps;
+	uint64_t *stopping_registers;
+	uint64_t *stopping_memory;
+	uint64_t *update_first;
+	uint64_t *update_count;
+	uint8_t *update_truncated;
+	mem_update_t *updates;
+	uint64_t max_updates;
+	uint8_t *data;
+	uint64_t data_size;
+} batch_result_t;
+
+// a transmit, as where its bytes are in the transmit arena
 typedef struct transmit_record {
-	void *data;
+	uint64_t offset;
 	uint32_t count;
 } transmit_record_t;
 
+//
+// Native syscalls
+//
+
+// what a syscall in the syscall table is emulated with (the CGC syscalls so far)
+typedef enum syscall_handler {
+	SYSCALL_HANDLER_NONE = 0,
+	SYSCALL_HANDLER_TRANSMIT,
+	SYSCALL_HANDLER_RECEIVE,
+	SYSCALL_HANDLER_FDWAIT,
+	SYSCALL_HANDLER_ALLOCATE,
+	SYSCALL_HANDLER_DEALLOCATE,
+	SYSCALL_HANDLER_RANDOM,
+} syscall_handler_t;
+
+typedef struct syscall_entry {
+	syscall_handler_t handler;
+	uint64_t bbl_addr; // recorded as the block of the syscall, where its simprocedure would be
+} syscall_entry_t;
+
+typedef struct receive_record {
+	uint32_t fd;
+	uint32_t count;
+} receive_record_t;
+
+// a change that a syscall made to the memory map. perms is 0 for an unmapping.
+typedef struct map_change {
+	uint64_t address;
+	uint64_t length;
+	uint32_t perms;
+} map_change_t;
+
+typedef struct syscall_results {
+	uint64_t allocation_base;
+	uint64_t random_state;
+	uint64_t fdwait_time; // microseconds that fdwait waited with no fds ready
+	uint64_t receives;
+	uint64_t map_changes;
+} syscall_results_t;
+
+//
+// Execution profiling
+//
+
+// both must be powers of two
+#define PROFILE_HISTOGRAM_SIZE 4096
+#define PROFILE_HISTOGRAM_PROBES 8
+
+typedef enum profile_hook {
+	PROFILE_HOOK_MEM_READ=0,
+	PROFILE_HOOK_MEM_WRITE,
+	PROFILE_HOOK_MEM_UNMAPPED,
+	PROFILE_HOOK_MEM_PROT,
+	PROFILE_HOOK_BLOCK,
+	PROFILE_HOOK_INTR,
+} profile_hook_t;
+
+#define PROFILE_HOOK_COUNT (PROFILE_HOOK_INTR + 1)
+
+typedef struct profile_block {
+	uint64_t address;
+	uint64_t executions;
+	uint64_t rejections; // times check_block sent the block back to VEX
+} profile_block_t;
+
+// hook times include the hooks called from inside them, e.g. unmapped faults handled as writes
+typedef struct profile_stats {
+	uint64_t blocks;
+	uint64_t rejected_blocks;
+	uint64_t histogram_dropped; // executions of blocks that found no free histogram slot
+	uint64_t stop_reasons[STOP_REASON_COUNT];
+	uint64_t hook_calls[PROFILE_HOOK_COUNT];
+	uint64_t hook_nanoseconds[PROFILE_HOOK_COUNT];
+} profile_stats_t;
+
+/*
+ * Counts executed blocks in a fixed-size open-addressed histogram, so that the
+ * memory used stays bounded however long we run. Disabled, every call returns
+ * right away and the histogram is never allocated.
+ */
+class Profiler {
+private:
+	bool enabled;
+	std::vector<profile_block_t> histogram;
+	profile_stats_t stats;
+
+	profile_block_t *slot(uint64_t address) {
+		uint64_t hash = (address * 0x9E3779B97F4A7C15ULL) >> 52;
+		for (uint64_t i = 0; i < PROFILE_HISTOGRAM_PROBES; i++) {
+			profile_block_t *entry = &histogram[(hash + i) & (PROFILE_HISTOGRAM_SIZE - 1)];
+			if (entry->executions == 0) {
+				entry->address = address;
+				return entry;
+			}
+			if (entry->address == address) {
+				return entry;
+			}
+		}
+		return NULL;
+	}
+
+public:
+	Profiler() {
+		enabled = false;
+		memset(&stats, 0, sizeof(stats));
+	}
+
+	void enable(bool enable) {
+		enabled = enable;
+		if (enabled && histogram.empty()) {
+			profile_block_t empty = {0, 0, 0};
+			histogram.assign(PROFILE_HISTOGRAM_SIZE, empty);
+		}
+	}
+
+	inline bool is_enabled() const {
+		return enabled;
+	}
+
+	inline void record_block(uint64_t address) {
+		if (!enabled) return;
+		stats.blocks++;
+		profile_block_t *entry = slot(address);
+		if (entry) {
+			entry->executions++;
+		} else {
+			stats.histogram_dropped++;
+		}
+	}
+
+	inline void record_rejection(uint64_t address) {
+		if (!enabled) return;
+		stats.rejected_blocks++;
+		profile_block_t *entry = slot(address);
+		if (entry && entry->executions) {
+			entry->rejections++;
+		}
+	}
+
+	inline void record_stop(stop_t reason) {
+		if (!enabled) return;
+		if (reason < STOP_REASON_COUNT) stats.stop_reasons[reason]++;
+	}
+
+	inline void record_hook(profile_hook_t hook, uint64_t nanoseconds) {
+		stats.hook_calls[hook]++;
+		stats.hook_nanoseconds[hook] += nanoseconds;
+	}
+
+	void get_stats(profile_stats_t *out) const {
+		*out = stats;
+	}
+
+	/*
+	 * copy out up to max blocks, the most executed ones first. returns the number written.
+	 */
+	uint64_t get_histogram(profile_block_t *out, uint64_t max) const {
+		std::vector<profile_block_t> blocks;
+		for (auto &entry : histogram) {
+			if (entry.executions) blocks.push_back(entry);
+		}
+		uint64_t count = std::min<uint64_t>(max, blocks.size());
+		std::partial_sort(blocks.begin(), blocks.begin() + count, blocks.end(),
+			[](const profile_block_t &a, const profile_block_t &b) { return a.executions > b.executions; });
+		std::copy(blocks.begin(), blocks.begin() + count, out);
+		return count;
+	}
+};
+
+// adds the time until the end of the scope to a hook's total, if profiling is enabled
+class ProfileTimer {
+private:
+	Profiler *profiler;
+	profile_hook_t hook;
+	std::chrono::steady_clock::time_point start;
+
+public:
+	ProfileTimer(Profiler *_profiler, profile_hook_t _hook) : hook(_hook) {
+		profiler = _profiler->is_enabled() ? _profiler : NULL;
+		if (profiler) start = std::chrono::steady_clock::now();
+	}
+
+	~ProfileTimer() {
+		if (profiler) {
+			auto elapsed = std::chrono::steady_clock::now() - start;
+			profiler->record_hook(hook, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+		}
+	}
+};
+
+//
+// Stop points
+//
+
+// stop points are filtered by the 64-byte bucket they fall in, hashed into a bitmap of this many bits
+#define STOP_BUCKET_SHIFT 6
+#define STOP_FILTER_BITS_LOG2 15
+#define STOP_FILTER_WORDS ((1ULL << STOP_FILTER_BITS_LOG2) / 64)
+
+/*
+ * The set of stop points, with a bitmap filter in front of it. A block only
+ * looks at the set when one of the buckets it covers has its bit set, which
+ * for most blocks is never. Removing points leaves the filter stale; it is
+ * rebuilt from the set on the next lookup.
+ */
+class StopPoints {
+private:
+	std::set<uint64_t> points;
+	uint64_t filter[STOP_FILTER_WORDS];
+	bool stale;
+
+	static inline uint64_t filter_bit(uint64_t bucket) {
+		return (bucket * 0x9E3779B97F4A7C15ULL) >> (64 - STOP_FILTER_BITS_LOG2);
+	}
+
+	inline void filter_add(uint64_t address) {
+		uint64_t bit = filter_bit(address >> STOP_BUCKET_SHIFT);
+		filter[bit / 64] |= 1ULL << (bit % 64);
+	}
+
+	inline bool filter_test(uint64_t bucket) const {
+		uint64_t bit = filter_bit(bucket);
+		return (filter[bit / 64] >> (bit % 64)) & 1;
+	}
+
+	void rebuild() {
+		memset(filter, 0, sizeof(filter));
+		for (uint64_t address : points) {
+			filter_add(address);
+		}
+		stale = false;
+	}
+
+public:
+	StopPoints() {
+		memset(filter, 0, sizeof(filter));
+		stale = false;
+	}
+
+	void clear() {
+		points.clear();
+		memset(filter, 0, sizeof(filter));
+		stale = false;
+	}
+
+	void add(uint64_t address) {
+		points.insert(address);
+		filter_add(address);
+	}
+
+	void remove(uint64_t address) {
+		if (points.erase(address)) {
+			stale = true;
+		}
+	}
+
+	/*
+	 * whether any stop point lies in [address, address + size)
+	 */
+	inline bool any_in(uint64_t address, uint64_t size) {
+		if (points.empty()) {
+			return false;
+		}
+		if (stale) {
+			rebuild();
+		}
+
+		uint64_t last = (address + size - 1) >> STOP_BUCKET_SHIFT;
+		bool maybe = false;
+		for (uint64_t bucket = address >> STOP_BUCKET_SHIFT; bucket <= last && !maybe; bucket++) {
+			maybe = filter_test(bucket);
+		}
+		if (!maybe) {
+			return false;
+		}
+
+		auto stop_point = points.lower_bound(address);
+		return stop_point != points.end() && *stop_point < address + size;
+	}
+};
+
+//
+// Block traces
+//
+
+typedef enum trace_kind {
+	TRACE_BBL_ADDRS=0,
+	TRACE_STACK_POINTERS,
+} trace_kind_t;
+
+// the longest varint encoding of a 64-bit value
+#define TRACE_VARINT_MAX 10
+
+/*
+ * Fixed-capacity trace of 64-bit values, one per block. When it is full the
+ * oldest entries are dropped, so it always holds the most recent ones. In delta
+ * mode it stores the difference from the previous value as a zigzag varint,
+ * which is one or two bytes for most block addresses and stack pointers.
+ *
+ * The newest value stays pending until the next one is pushed, so that the
+ * block being executed when we roll back can be discarded and never reaches
+ * the ring.
+ */
+class TraceRing {
+private:
+	bool delta;
+	uint64_t capacity; // in bytes
+	std::vector<uint64_t> values;
+	std::vector<uint8_t> bytes;
+	uint64_t head, count, used; // used is in bytes, for delta mode
+	uint64_t base; // delta mode: the value just before the oldest entry
+	uint64_t last; // delta mode: the value of the newest entry
+	uint64_t dropped;
+	bool has_pending;
+	uint64_t pending;
+
+	static uint64_t zigzag(int64_t v) {
+		return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+	}
+
+	static int64_t unzigzag(uint64_t v) {
+		return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+	}
+
+	// the oldest byte in delta mode
+	uint64_t tail() const {
+		return (head + capacity - used) % capacity;
+	}
+
+	// decode the oldest delta entry without removing it; returns its length
+	uint64_t peek_delta(uint64_t *value) const {
+		uint64_t v = 0, pos = tail();
+		uint64_t length = 0;
+		for (int shift = 0; ; shift += 7) {
+			uint8_t b = bytes[(pos + length) % capacity];
+			length++;
+			v |= (uint64_t)(b & 0x7f) << shift;
+			if (!(b & 0x80)) break;
+		}
+		*value = base + unzigzag(v);
+		return length;
+	}
+
+	void drop_oldest() {
+		if (delta) {
+			uint64_t value;
+			uint64_t length = peek_delta(&value);
+			base = value;
+			used -= length;
+		}
+		count--;
+		dropped++;
+	}
+
+	void append(uint64_t value) {
+		if (!delta) {
+			values[head] = value;
+			head = (head + 1) % values.size();
+			if (count == values.size()) {
+				dropped++;
+			} else {
+				count++;
+			}
+			return;
+		}
+
+		uint8_t encoded[TRACE_VARINT_MAX];
+		uint64_t length = 0;
+		for (uint64_t v = zigzag(value - last); ; v >>= 7) {
+			encoded[length++] = (v & 0x7f) | (v >= 0x80 ? 0x80 : 0);
+			if (v < 0x80) break;
+		}
+		if (length > capacity) {
+			dropped++;
+			return;
+		}
+		while (capacity - used < length) {
+			drop_oldest();
+		}
+		for (uint64_t i = 0; i < length; i++) {
+			bytes[(head + i) % capacity] = encoded[i];
+		}
+		head = (head + length) % capacity;
+		used += length;
+		count++;
+		last = value;
+	}
+
+public:
+	TraceRing() {
+		configure(0, false);
+	}
+
+	/*
+	 * a capacity of 0 turns the ring off. in raw mode it holds capacity / 8 values.
+	 */
+	void configure(uint64_t _capacity, bool _delta) {
+		delta = _delta;
+		capacity = _capacity;
+		values.clear();
+		bytes.clear();
+		if (delta) {
+			bytes.assign(capacity, 0);
+		} else {
+			values.assign(capacity / sizeof(uint64_t), 0);
+			capacity = values.size() * sizeof(uint64_t);
+		}
+		head = count = used = 0;
+		base = last = 0;
+		dropped = 0;
+		has_pending = false;
+	}
+
+	inline bool enabled() const {
+		return capacity != 0;
+	}
+
+	inline void push(uint64_t value) {
+		if (has_pending) append(pending);
+		pending = value;
+		has_pending = true;
+	}
+
+	inline void discard_pending() {
+		has_pending = false;
+	}
+
+	void stats(uint64_t *entries, uint64_t *size, uint64_t *dropped_entries) const {
+		*entries = count;
+		*size = delta ? used : count * sizeof(uint64_t);
+		*dropped_entries = dropped;
+	}
+
+	/*
+	 * move the oldest entries into out, as many whole entries as fit in size bytes.
+	 * out gets raw uint64_t values, or in delta mode the varint deltas, with *start
+	 * set to the value the first delta is relative to. returns the number of bytes.
+	 */
+	uint64_t drain(uint8_t *out, uint64_t size, uint64_t *start) {
+		uint64_t written = 0;
+		*start = base;
+		if (!delta) {
+			while (count && written + sizeof(uint64_t) <= size) {
+				uint64_t first = (head + values.size() - count) % values.size();
+				memcpy(out + written, &values[first], sizeof(uint64_t));
+				written += sizeof(uint64_t);
+				count--;
+			}
+			return written;
+		}
+
+		while (count) {
+			uint64_t value;
+			uint64_t length = peek_delta(&value);
+			if (written + length > size) break;
+			uint64_t pos = tail();
+			for (uint64_t i = 0; i < length; i++) {
+				out[written + i] = bytes[(pos + i) % capacity];
+			}
+			written += length;
+			used -= length;
+			count--;
+			base = value;
+		}
+		return written;
+	}
+};
+
+//
+// Edge coverage
+//
+
+// the size of a coverage map, one byte per edge hash, as afl's
+#define COVERAGE_MAP_SIZE (1 << 16)
+
 // These prototypes may be found in <unicorn/unicorn.h> by searching for "Callback"
 static void hook_mem_read(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, void *user_data);
 static void hook_mem_write(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, void *user_data);
@@ -101,28 +2003,65 @@ static bool hook_mem_prot(uc_engine *uc, uc_mem_type type, uint64_t address, int
 static void hook_block(uc_engine *uc, uint64_t address, int32_t size, void *user_data);
 static void hook_intr(uc_engine *uc, uint32_t intno, void *user_data);
 
+// In scoped hook mode, memory hooks cover the active pages in chunks of this many bytes
+#define HOOK_CHUNK_SHIFT 16
+#define HOOK_CHUNK_SIZE (1ULL << HOOK_CHUNK_SHIFT)
+// accesses that start this far below a chunk can still reach into it
+#define HOOK_MAX_ACCESS 16
+
+// stands in for the summary of a block we can't know
+static const block_entry_t unknown_block = {false, 0, false, RegisterRanges(), RegisterRanges()};
+
 class State {
 private:
 	uc_engine *uc;
+	caches_t *caches;
 	PageCache *page_cache;
 	BlockCache *block_cache;
+	BlockCache *summary_cache;
+	BlockCache *prelift_cache;
+	cache_counters_t cache_counters;
 	bool hooked;
 
+	// scoped hook mode: read/write hooks only cover chunks that have active pages
+	bool scoped_hooks;
+	std::set<uint64_t> hooked_chunks;
+	std::vector<uc_hook> chunk_hooks;
+
 	uc_context *saved_regs;
 
 	std::vector<mem_access_t> mem_writes;
-	// the latter part of the pair is a pointer to the page data if the page is direct-mapped, otherwise NULL
-	std::map<uint64_t, std::pair<taint_t *, uint8_t *>> active_pages;
-	//std::map<uint64_t, taint_t *> active_pages;
-	std::set<uint64_t> stop_points;
+	// undo log mode: lines saved in this block. the arena is reused and not freed between blocks.
+	bool undo_log;
+	uint64_t undo_epoch;
+	std::vector<undo_line_t> undo_lines;
+	PageTable active_pages;
+	uint64_t symbolic_bytes; // symbolic bytes over all the active pages
+
+	// guard mode, with scoped hooks: concrete direct-mapped pages are left out of the hooked chunks, and writes to
+	// them are caught by write-protecting them in unicorn instead. guard_snapshots has each open page as it was at
+	// the last checkpoint.
+	bool guard_pages;
+	std::vector<guard_snapshot_t> guard_snapshots;
+
+	// concrete fast mode: with no taint live, commit only every checkpoint_interval blocks.
+	// a rollback then restores the last checkpoint and replays up to the block we stopped in.
+	uint64_t checkpoint_interval;
+	uint64_t checkpoint_step; // cur_steps at the last commit
+	uint64_t checkpoint_pc;
+	bool force_checkpoint;
+	bool replaying;
+	uint64_t replay_remaining;
+	StopPoints stop_points;
 
 public:
 	std::vector<uint64_t> bbl_addrs;
 	std::vector<uint64_t> stack_pointers;
 	std::unordered_set<uint64_t> executed_pages;
-	std::unordered_set<uint64_t>::iterator *executed_pages_iterator;
+	uint64_t last_executed_page; // saves the hash insert while we stay in one page
 	uint64_t syscall_count;
 	std::vector<transmit_record_t> transmit_records;
+	std::vector<uint8_t> transmit_arena; // the bytes of all transmits of this run, back to back
 	uint64_t cur_steps, max_steps;
 	uc_hook h_read, h_write, h_block, h_prot, h_unmap, h_intr;
 	bool stopped;
@@ -134,49 +2073,87 @@ public:
 	bool ignore_next_selfmod;
 	uint64_t cur_address;
 	int32_t cur_size;
+	const block_entry_t *cur_block; // its summary, if we looked it up
 
 	uc_arch arch;
 	uc_mode mode;
 	bool interrupt_handled;
-	uint32_t transmit_sysno;
-	uint32_t transmit_bbl_addr;
+	// natively emulated syscalls by number. the table and the preloaded input are set up from python.
+	std::map<uint32_t, syscall_entry_t> syscalls;
+	std::map<uint32_t, std::vector<uint8_t>> receive_data;
+	std::map<uint32_t, uint64_t> receive_offset;
+	std::vector<receive_record_t> receive_records;
+	bool allocation_enabled; // off once a native deallocate leaves a hole that python would reuse
+	uint64_t allocation_base;
+	uint64_t max_allocation;
+	bool allocation_nx;
+	std::vector<std::pair<uint64_t, uint64_t>> allocations; // made natively in this run
+	std::vector<map_change_t> map_changes;
+	uint64_t random_state;
+	uint64_t fdwait_time;
 
 	VexArch vex_guest;
 	VexArchInfo vex_archinfo;
-	RegisterSet symbolic_registers; // tracking of symbolic registers
+	RegisterBitset symbolic_registers; // tracking of symbolic registers
+	RegisterBitset entry_symbolic_registers; // what python set symbolic_registers to before this run
 
 	bool track_bbls;
 	bool track_stack;
+	TraceRing bbl_trace;
+	TraceRing stack_trace;
+
+	uint8_t *coverage_map; // of COVERAGE_MAP_SIZE bytes owned by the caller, or NULL
+	uint64_t coverage_prev; // the hash of the previous block, shifted
+	bool coverage_only; // hook blocks alone, for the coverage
+
+	Profiler profiler;
 
 	uc_cb_eventmem_t py_mem_callback;
 
-	State(uc_engine *_uc, uint64_t cache_key):uc(_uc)
+	State(CacheRegistry *registry, uc_engine *_uc, uint64_t cache_key, uc_arch _arch, uc_mode _mode):uc(_uc), arch(_arch), mode(_mode)
 	{
 		hooked = false;
-		h_read = h_write = h_block = h_prot = 0;
+		scoped_hooks = false;
+		h_read = h_write = h_block = h_prot = h_unmap = h_intr = 0;
 		max_steps = cur_steps = 0;
 		stopped = true;
 		stop_reason = STOP_NOSTART;
 		ignore_next_block = false;
 		ignore_next_selfmod = false;
 		interrupt_handled = false;
-		transmit_sysno = -1;
+		allocation_enabled = false;
+		allocation_base = max_allocation = 0;
+		allocation_nx = false;
+		random_state = 0;
+		fdwait_time = 0;
 		vex_guest = VexArch_INVALID;
+		memset(&vex_archinfo, 0, sizeof(vex_archinfo));
+		cur_block = NULL;
 		syscall_count = 0;
+		stopping_register = stopping_memory = 0;
+		track_bbls = track_stack = false;
+		coverage_map = NULL;
+		coverage_prev = 0;
+		coverage_only = false;
 		uc_context_alloc(uc, &saved_regs);
-		executed_pages_iterator = NULL;
-
-		auto it = global_cache.find(cache_key);
-		if (it == global_cache.end()) {
-			page_cache = new PageCache();
-			block_cache = new BlockCache();
-			global_cache[cache_key] = {page_cache, block_cache};
-		} else {
-			page_cache = it->second.page_cache;
-			block_cache = it->second.block_cache;
-		}
-		arch = *((uc_arch*)uc); // unicorn hides all its internals...
-		mode = *((uc_mode*)((uc_arch*)uc + 1));
+		last_executed_page = -1;
+		undo_log = false;
+		undo_epoch = 1;
+		symbolic_bytes = 0;
+		guard_pages = false;
+		checkpoint_interval = 0;
+		checkpoint_step = 0;
+		checkpoint_pc = 0;
+		force_checkpoint = true;
+		replaying = false;
+		replay_remaining = 0;
+
+		caches = registry->acquire(cache_key, uc);
+		page_cache = caches->page_cache;
+		block_cache = caches->block_cache;
+		summary_cache = caches->summary_cache;
+		prelift_cache = caches->prelift_cache;
+		memset(&cache_counters, 0, sizeof(cache_counters));
 	}
 	
 	/*
@@ -186,13 +2163,25 @@ public:
 	 */
 	void hook() {
 		if (hooked) {
-			//LOG_D("already hooked");
+			LOG_D("already hooked");
 			return ;
 		}
 		uc_err err;
-		err = uc_hook_add(uc, &h_read, UC_HOOK_MEM_READ, (void *)hook_mem_read, this, 1, 0);
-
-		err = uc_hook_add(uc, &h_write, UC_HOOK_MEM_WRITE, (void *)hook_mem_write, this, 1, 0);
+		if (coverage_only) {
+			err = uc_hook_add(uc, &h_block, UC_HOOK_BLOCK, (void *)hook_block, this, 1, 0);
+			hooked = true;
+			return;
+		}
+		if (scoped_hooks) {
+			// unicorn only takes the slow path for memory accesses, where the hooks are checked,
+			// if some memory hook exists when a block is translated. these cover address 0 alone.
+			err = uc_hook_add(uc, &h_read, UC_HOOK_MEM_READ, (void *)hook_mem_read, this, 0, 0);
+			err = uc_hook_add(uc, &h_write, UC_HOOK_MEM_WRITE, (void *)hook_mem_write, this, 0, 0);
+			hook_active_chunks();
+		} else {
+			err = uc_hook_add(uc, &h_read, UC_HOOK_MEM_READ, (void *)hook_mem_read, this, 1, 0);
+			err = uc_hook_add(uc, &h_write, UC_HOOK_MEM_WRITE, (void *)hook_mem_write, this, 1, 0);
+		}
 
 		err = uc_hook_add(uc, &h_block, UC_HOOK_BLOCK, (void *)hook_block, this, 1, 0);
 
@@ -209,28 +2198,187 @@ public:
 		if (!hooked)
 			return ;
 
-		uc_err err;
-		err = uc_hook_del(uc, h_read);
-		err = uc_hook_del(uc, h_write);
-		err = uc_hook_del(uc, h_block);
-		err = uc_hook_del(uc, h_prot);
-		err = uc_hook_del(uc, h_unmap);
-		err = uc_hook_del(uc, h_intr);
+		uc_err err;
+		err = uc_hook_del(uc, h_read);
+		err = uc_hook_del(uc, h_write);
+		err = uc_hook_del(uc, h_block);
+		err = uc_hook_del(uc, h_prot);
+		err = uc_hook_del(uc, h_unmap);
+		err = uc_hook_del(uc, h_intr);
+
+		for (uc_hook h : chunk_hooks) {
+			err = uc_hook_del(uc, h);
+		}
+		chunk_hooks.clear();
+		hooked_chunks.clear();
+
+		hooked = false;
+		h_read = h_write = h_block = h_prot = h_unmap = 0;
+	}
+
+	/*
+	 * choose between read/write hooks over the whole address space, and hooks
+	 * scoped to the active pages. must be set before hook().
+	 */
+	void set_scoped_hooks(bool enable) {
+		if (!hooked) {
+			scoped_hooks = enable;
+		}
+	}
+
+	/*
+	 * write-protect the concrete pages we get direct-mapped from now on, instead of hooking their writes. only has
+	 * an effect with scoped hooks.
+	 */
+	void set_guard_pages(bool enable) {
+		guard_pages = enable;
+		if (enable) {
+			guard_snapshots.reserve(GUARD_MAX_OPEN);
+		}
+	}
+
+	/*
+	 * add read and write hooks over chunks [first, last] of the address space
+	 */
+	void hook_chunks(uint64_t first, uint64_t last) {
+		uint64_t begin = first << HOOK_CHUNK_SHIFT;
+		uint64_t end = ((last + 1) << HOOK_CHUNK_SHIFT) - 1;
+		begin = begin < HOOK_MAX_ACCESS ? 0 : begin - (HOOK_MAX_ACCESS - 1);
+
+		uc_hook h;
+		if (uc_hook_add(uc, &h, UC_HOOK_MEM_READ, (void *)hook_mem_read, this, begin, end) == UC_ERR_OK) {
+			chunk_hooks.push_back(h);
+		}
+		if (uc_hook_add(uc, &h, UC_HOOK_MEM_WRITE, (void *)hook_mem_write, this, begin, end) == UC_ERR_OK) {
+			chunk_hooks.push_back(h);
+		}
+		for (uint64_t chunk = first; chunk <= last; chunk++) {
+			hooked_chunks.insert(chunk);
+		}
+	}
+
+	/*
+	 * hook the chunks of every page activated so far, one hook pair per run of adjacent chunks
+	 */
+	void hook_active_chunks() {
+		bool in_run = false;
+		uint64_t first = 0, last = 0;
+		active_pages.for_each([&](uint64_t page_address, active_page_t *page) {
+			if (page->guard != GUARD_NONE) {
+				return;
+			}
+			uint64_t chunk = page_address >> HOOK_CHUNK_SHIFT;
+			if (in_run && (chunk == last || chunk == last + 1)) {
+				last = chunk;
+				return;
+			}
+			if (in_run) hook_chunks(first, last);
+			first = last = chunk;
+			in_run = true;
+		});
+		if (in_run) hook_chunks(first, last);
+	}
 
-		hooked = false;
-		h_read = h_write = h_block = h_prot = h_unmap = 0;
+	/*
+	 * in scoped hook mode, whether an access at address is seen by the read and write hooks
+	 */
+	bool mem_hooked(uint64_t address) const {
+		if (!scoped_hooks) {
+			return true;
+		}
+		return address == 0 ||
+			hooked_chunks.count(address >> HOOK_CHUNK_SHIFT) ||
+			hooked_chunks.count((address + HOOK_MAX_ACCESS - 1) >> HOOK_CHUNK_SHIFT);
 	}
 
 	~State() {
-		for (auto it = active_pages.begin(); it != active_pages.end(); it++) {
-			// only delete if not direct-mapped
-			if (!it->second.second) {
-                // delete should use the bracket operator since PageBitmap is an array typedef
-                delete[] it->second.first;
-            }
-		}
+		active_pages.for_each([](uint64_t address, active_page_t *page) {
+			release_bitmap(page->bitmap);
+		});
 		active_pages.clear();
 		uc_free(saved_regs);
+		caches->registry->release(caches, cache_counters);
+	}
+
+	/*
+	 * a copy of parent, which must not be running, on the engine uc (of the same
+	 * arch and mode). the taint bitmaps of the active pages are shared until one
+	 * side writes to them. the memory mapped in parent's engine is copied into uc,
+	 * except for cached pages, which are mapped from the page cache as usual, so
+	 * pages that were direct-mapped into python's memory become ordinary pages of
+	 * the copy and its writes to them reach python through sync(). the settings
+	 * and symbolic registers are copied; traces, the profile and the results of
+	 * the last run are not. returns NULL on failure.
+	 */
+	static State *fork(State *parent, uc_engine *uc) {
+		State *state = new State(parent->caches->registry, uc, parent->caches->key, parent->arch, parent->mode);
+
+		uc_mem_region *regions;
+		uint32_t count;
+		if (uc_mem_regions(parent->uc, &regions, &count) != UC_ERR_OK) {
+			delete state;
+			return NULL;
+		}
+		bool success = true;
+		for (uint32_t i = 0; i < count && success; i++) {
+			uint64_t address = regions[i].begin;
+			size_t size = regions[i].end - regions[i].begin + 1;
+			if (state->in_cache(address) && state->map_cache(address, size)) {
+				continue;
+			}
+			std::unique_ptr<uint8_t[]> data(new uint8_t[size]);
+			success = uc_mem_read(parent->uc, address, data.get(), size) == UC_ERR_OK &&
+				uc_mem_map(uc, address, size, regions[i].perms) == UC_ERR_OK &&
+				uc_mem_write(uc, address, data.get(), size) == UC_ERR_OK;
+		}
+		uc_free(regions);
+		if (!success) {
+			delete state;
+			return NULL;
+		}
+
+		parent->active_pages.for_each([&](uint64_t page_address, active_page_t *page) {
+			page->bitmap->refs++;
+			active_page_t copy = {page->bitmap, NULL, NULL, 0, 0, GUARD_NONE, 0};
+			state->active_pages.insert(page_address, copy);
+			if (page->guard == GUARD_ARMED) {
+				// the copy is an ordinary page, as writable as it was before being guarded
+				uc_mem_protect(uc, page_address, PAGE_SIZE, page->perms);
+			}
+		});
+		state->symbolic_bytes = parent->symbolic_bytes;
+		state->symbolic_registers = parent->symbolic_registers;
+		state->entry_symbolic_registers = parent->entry_symbolic_registers;
+
+		// the registers as they are now go into the engine, and the last checkpoint into saved_regs
+		uc_context *current;
+		uc_context_alloc(parent->uc, &current);
+		uc_context_save(parent->uc, current);
+		uc_context_restore(uc, parent->saved_regs);
+		uc_context_save(uc, state->saved_regs);
+		uc_context_restore(uc, current);
+		uc_free(current);
+
+		state->scoped_hooks = parent->scoped_hooks;
+		state->guard_pages = parent->guard_pages;
+		state->undo_log = parent->undo_log;
+		state->checkpoint_interval = parent->checkpoint_interval;
+		state->stop_points = parent->stop_points;
+		state->syscalls = parent->syscalls;
+		state->receive_data = parent->receive_data;
+		state->receive_offset = parent->receive_offset;
+		state->allocation_enabled = parent->allocation_enabled;
+		state->allocation_base = parent->allocation_base;
+		state->max_allocation = parent->max_allocation;
+		state->allocation_nx = parent->allocation_nx;
+		state->random_state = parent->random_state;
+		state->vex_guest = parent->vex_guest;
+		state->vex_archinfo = parent->vex_archinfo;
+		state->track_bbls = parent->track_bbls;
+		state->track_stack = parent->track_stack;
+		state->coverage_map = parent->coverage_map;
+		state->coverage_only = parent->coverage_only;
+		return state;
 	}
 
 	uc_err start(uint64_t pc, uint64_t step = 1) {
@@ -238,13 +2386,20 @@ public:
 		stop_reason = STOP_NOSTART;
 		max_steps = step;
 		cur_steps = -1;
+		checkpoint_step = cur_steps;
+		force_checkpoint = true;
 		executed_pages.clear();
+		transmit_records.clear();
+		transmit_arena.clear();
+		last_executed_page = -1;
+		coverage_prev = 0;
 
 		// error if pc is 0
 		// TODO: why is this check here and not elsewhere
 		if (pc == 0) {
 			stop_reason = STOP_ZEROPAGE;
 			cur_steps = 0;
+			profiler.record_stop(stop_reason);
 			return UC_ERR_MAP;
 		}
 
@@ -254,7 +2409,10 @@ public:
 		    commit();
 		    stop_reason = STOP_ZEROPAGE;
 		}
-		rollback();
+		if (!coverage_only) {
+			rollback();
+			arm_open_guards();
+		}
 
 		if (out == UC_ERR_INSN_INVALID) {
 			stop_reason = STOP_NODECODE;
@@ -263,9 +2421,30 @@ public:
 		// if we errored out right away, fix the step count to 0
 		if (cur_steps == -1) cur_steps = 0;
 
+		profiler.record_stop(stop_reason);
+		record_entry(pc);
 		return out;
 	}
 
+	// fold the run that just ended into the stats of the address it started at
+	void record_entry(uint64_t pc) {
+		std::lock_guard<std::mutex> guard(caches->lock);
+		auto inserted = caches->entry_stats->emplace(pc, entry_stats_t());
+		entry_stats_t &entry = inserted.first->second;
+		if (inserted.second) {
+			memset(&entry, 0, sizeof(entry));
+			entry.address = pc;
+			caches->registry->account(sizeof(entry_stats_t) + CACHE_NODE_OVERHEAD);
+		}
+		entry.runs++;
+		entry.steps += cur_steps;
+		entry.skips = 0;
+		memmove(&entry.recent_steps[1], &entry.recent_steps[0], sizeof(entry.recent_steps) - sizeof(entry.recent_steps[0]));
+		memmove(&entry.recent_stops[1], &entry.recent_stops[0], sizeof(entry.recent_stops) - sizeof(entry.recent_stops[0]));
+		entry.recent_steps[0] = (uint32_t)std::min<uint64_t>(cur_steps, UINT32_MAX);
+		entry.recent_stops[0] = stop_reason;
+	}
+
 	void stop(stop_t reason) {
 		stopped = true;
 		const char *msg = NULL;
@@ -311,20 +2490,43 @@ public:
 				msg = "unknown error";
 		}
 		stop_reason = reason;
-		//LOG_D("stop: %s", msg);
+		LOG_I("stop at %#" PRIx64 ": %s", cur_address, msg);
 		uc_emu_stop(uc);
 	}
 
 	void step(uint64_t current_address, int32_t size, bool check_stop_points=true) {
+		if (coverage_map != NULL) {
+			record_edge(current_address);
+		}
 		if (track_bbls) {
-			bbl_addrs.push_back(current_address);
+			if (bbl_trace.enabled()) {
+				bbl_trace.push(current_address);
+			} else {
+				bbl_addrs.push_back(current_address);
+			}
 		}
 		if (track_stack) {
-			stack_pointers.push_back(get_stack_pointer());
+			if (stack_trace.enabled()) {
+				stack_trace.push(get_stack_pointer());
+			} else {
+				stack_pointers.push_back(get_stack_pointer());
+			}
+		}
+		if ((current_address & ~0xFFFULL) != last_executed_page) {
+			last_executed_page = current_address & ~0xFFFULL;
+			executed_pages.insert(last_executed_page);
+			if (guard_pages) {
+				// writes to code have to be seen by the write hook, in case it modifies itself
+				active_page_t *page = active_pages.lookup(last_executed_page);
+				if (page != NULL && page->guard != GUARD_NONE) {
+					unguard(last_executed_page, page);
+				}
+			}
 		}
-		executed_pages.insert(current_address & ~0xFFFULL);
+		profiler.record_block(current_address);
 		cur_address = current_address;
 		cur_size = size;
+		cur_block = NULL;
 
 		if (cur_steps >= max_steps) {
 			stop(STOP_NORMAL);
@@ -344,20 +2546,105 @@ public:
 			// for us to stop in the middle of a block.
 			// since we do not support stopping in the middle of a block.
 
-			auto stop_point = stop_points.lower_bound(current_address);
-			if (stop_point != stop_points.end() && *stop_point < current_address + real_size) {
+			if (stop_points.any_in(current_address, real_size)) {
 				stop(STOP_STOPPOINT);
 			}
 		}
 	}
 
+	/*
+	 * count the edge from the previous block to this one in the coverage map, the
+	 * way afl does. the count wraps, as there.
+	 */
+	inline void record_edge(uint64_t address) {
+		uint64_t cur = ((address >> 4) ^ (address << 8)) & (COVERAGE_MAP_SIZE - 1);
+		coverage_map[cur ^ coverage_prev]++;
+		coverage_prev = cur >> 1;
+	}
+
+	/*
+	 * count edges into map, which may be shared with other States, or stop with
+	 * NULL. with block_hook_only the next hook() installs the block hook alone:
+	 * memory is then neither tracked nor rolled back, so this is for concrete
+	 * runs whose end state is thrown away, e.g. fuzzing. must be set before
+	 * hook() to take effect.
+	 */
+	void set_coverage(uint8_t *map, bool block_hook_only) {
+		coverage_map = map;
+		if (!hooked) {
+			coverage_only = map != NULL && block_hook_only;
+		}
+	}
+
 	/*
 	 * commit all memory actions.
 	 */
 	void commit() {
+		checkpoint();
+		cur_steps++;
+		checkpoint_step = cur_steps;
+	}
+
+	/*
+	 * whether no rollback can be caused by taint: nothing symbolic in registers or memory
+	 */
+	inline bool fully_concrete() const {
+		return symbolic_bytes == 0 && symbolic_registers.empty();
+	}
+
+	/*
+	 * the commit at the start of each block. in concrete fast mode it only counts
+	 * the step, except every checkpoint_interval blocks or when forced to.
+	 */
+	void commit_block(uint64_t address) {
+		if (checkpoint_interval > 1 && !force_checkpoint && fully_concrete() &&
+				cur_steps + 1 - checkpoint_step < checkpoint_interval) {
+			cur_steps++;
+			return;
+		}
+		commit();
+		checkpoint_pc = address;
+		force_checkpoint = false;
+	}
+
+	/*
+	 * make the next block commit in full, e.g. before a side effect that a replay must not repeat
+	 */
+	void request_checkpoint() {
+		force_checkpoint = true;
+	}
+
+	void set_checkpoint_interval(uint64_t interval) {
+		checkpoint_interval = interval;
+	}
+
+	inline bool is_replaying() const {
+		return replaying;
+	}
+
+	/*
+	 * block hook while replaying: commit each block, and stop when we reach the target one
+	 */
+	void replay_block() {
+		checkpoint();
+		if (replay_remaining == 0) {
+			uc_emu_stop(uc);
+		} else {
+			replay_remaining--;
+		}
+	}
+
+	/*
+	 * save the registers and forget the memory actions so far, without counting a step
+	 */
+	void checkpoint() {
 		// save registers
 		uc_context_save(uc, saved_regs);
 
+		if (!guard_snapshots.empty()) {
+			checkpoint_guards();
+		}
+
 		// mark memory sync status
 		// we might miss some dirty bits, this happens if hitting the memory
 		// write before mapping
@@ -367,76 +2654,220 @@ public:
 				taint_t *bitmap = page_lookup(it->address);
 				memset(&bitmap[it->address & 0xFFFULL], TAINT_DIRTY, sizeof(taint_t) * it->size);
 				it->clean = (1 << it->size) - 1;
-				//LOG_D("commit: lazy initialize mem_write [%#lx, %#lx]", it->address, it->address + it->size);
+				LOG_D("commit: lazy initialize mem_write [%#" PRIx64 ", %#" PRIx64 "]", it->address, it->address + it->size);
 			}
 		}
 		*/
 
 		// clear memory rollback status
 		mem_writes.clear();
-		cur_steps++;
+		undo_lines.clear();
+		undo_epoch++;
 	}
 
 	/*
 	 * undo recent memory actions.
 	 */
 	void rollback() {
+		rollback_to_checkpoint();
+
+		if (cur_steps != checkpoint_step) {
+			replay(cur_steps - checkpoint_step);
+		}
+
+		if (track_bbls) {
+			if (bbl_trace.enabled()) {
+				bbl_trace.discard_pending();
+			} else if (!bbl_addrs.empty()) {
+				bbl_addrs.pop_back();
+			}
+		}
+		if (track_stack) {
+			if (stack_trace.enabled()) {
+				stack_trace.discard_pending();
+			} else if (!stack_pointers.empty()) {
+				stack_pointers.pop_back();
+			}
+		}
+	}
+
+	/*
+	 * we are back at the last checkpoint, a number of blocks before the one we
+	 * stopped in. run those blocks again, with every block committed, and stop
+	 * at the start of the target block. nothing in them can stop us: they ran
+	 * fully concrete the first time, and anything with side effects outside of
+	 * memory and registers forces a checkpoint.
+	 */
+	void replay(uint64_t blocks) {
+		stop_t saved_reason = stop_reason;
+		uint64_t saved_register = stopping_register;
+		uint64_t saved_memory = stopping_memory;
+
+		replaying = true;
+		replay_remaining = blocks;
+		ignore_next_block = false;
+		ignore_next_selfmod = false;
+		uc_err err = uc_emu_start(uc, checkpoint_pc, 0, 0, 0);
+		if (err) {
+			LOG_W("replay: %s", uc_strerror(err));
+		}
+
+		// we stopped at the start of the target block, or earlier if something diverged
+		rollback_to_checkpoint();
+		cur_steps = checkpoint_step + (blocks - replay_remaining);
+		checkpoint_step = cur_steps;
+		replaying = false;
+
+		stopped = true;
+		stop_reason = saved_reason;
+		stopping_register = saved_register;
+		stopping_memory = saved_memory;
+	}
+
+	/*
+	 * restore memory and registers to the last checkpoint
+	 */
+	void rollback_to_checkpoint() {
+		if (undo_log) {
+			rollback_undo_lines();
+		}
+
 		// roll back memory changes
 		for (auto rit = mem_writes.rbegin(); rit != mem_writes.rend(); rit++) {
             uc_err err = uc_mem_write(uc, rit->address, rit->value, rit->size);
             if (err) {
-                //LOG_I("rollback: %s", uc_strerror(err));
+                LOG_W("rollback: %s", uc_strerror(err));
                 break;
             }
-            auto page = page_lookup(rit->address);
-            taint_t *bitmap = page.first;
-            uint8_t *data = page.second;
-
-            if (data == NULL) {
-				if (rit->clean) {
-					// should untaint some bits
-					uint64_t start = rit->address & 0xFFF;
-					int size = rit->size;
-					int clean = rit->clean;
-					for (int i = 0; i < size; i++) {
-						if ((clean >> i) & 1) {
-							// this byte is untouched before this memory action
-							// in the rollback, we already failed to execute, so
-							// we don't care about symoblic address, just mark
-							// it's clean.
-							bitmap[start + i] = TAINT_NONE;
-						}
-					}
-				}
+            active_page_t *page = active_pages.lookup(rit->address);
+            PageBitmap *bitmap = writable_bitmap(page);
+            int start = rit->address & 0xFFF;
+            uint64_t clean = (uint32_t)rit->clean;
+
+            if (page->data == NULL) {
+				// the bytes that were untouched before this memory action should be untainted.
+				// in the rollback, we already failed to execute, so we don't care about
+				// symbolic addresses, just mark them clean.
+				bit_update(bitmap->dirty, start, rit->size, clean, false);
 			} else {
-                uint64_t start = rit->address & 0xFFF;
-                int size = rit->size;
-                int clean = rit->clean;
-                for (int i = 0; i < size; i++) {
-                    bitmap[start + i] = (clean & (1 << i)) != 0 ? TAINT_NONE : TAINT_SYMBOLIC;
-                }
+				// bytes that were symbolic before this memory action become symbolic again
+				symbolic_bytes += bit_popcount64(~clean & ~bit_extract(bitmap->symbolic, start, rit->size) &
+					(rit->size < 64 ? (1ULL << rit->size) - 1 : ~0ULL));
+				bit_update(bitmap->symbolic, start, rit->size, ~clean, true);
+				for (int i = 0; i < rit->size; i++) {
+					page->py_bitmap[start + i] = ((clean >> i) & 1) ? TAINT_NONE : TAINT_SYMBOLIC;
+				}
 			}
 		}
 		mem_writes.clear();
+		undo_epoch++;
+
+		// guarded pages written since the checkpoint
+		for (auto &snapshot : guard_snapshots) {
+			active_page_t *page = active_pages.lookup(snapshot.address);
+			if (page != NULL && page->data != NULL) {
+				memcpy(page->data, snapshot.data, PAGE_SIZE);
+			}
+		}
 
 		// restore registers
 		uc_context_restore(uc, saved_regs);
+	}
+
+	/*
+	 * switch between per-write records and the undo log. only takes effect
+	 * between runs, when nothing is waiting to be committed.
+	 */
+	void set_undo_log(bool enable) {
+		if (mem_writes.empty() && undo_lines.empty()) {
+			undo_log = enable;
+		}
+	}
+
+	/*
+	 * restore every cache line saved in the undo log, data and taint both.
+	 * lines that are adjacent in the log and in memory are written back to
+	 * unicorn with a single call.
+	 */
+	void rollback_undo_lines() {
+		size_t i = 0;
+		while (i < undo_lines.size()) {
+			active_page_t *page = active_pages.lookup(undo_lines[i].address);
+			uint64_t page_address = undo_lines[i].address & ~0xFFFULL;
+
+			// the run of lines in the same page that also follow each other in memory
+			size_t j = i + 1;
+			while (j < undo_lines.size() &&
+					undo_lines[j].address == undo_lines[j - 1].address + UNDO_LINE_SIZE &&
+					(undo_lines[j].address & ~0xFFFULL) == page_address) {
+				j++;
+			}
+
+			uint8_t chunk[PAGE_SIZE];
+			for (size_t k = i; k < j; k++) {
+				undo_line_t *line = &undo_lines[k];
+				int word = (line->address & 0xFFF) / UNDO_LINE_SIZE;
+				symbolic_bytes += bit_popcount64(line->symbolic);
+				PageBitmap *bitmap = writable_bitmap(page);
+				symbolic_bytes -= bit_popcount64(bitmap->symbolic[word]);
+				bitmap->symbolic[word] = line->symbolic;
+				bitmap->dirty[word] = line->dirty;
+				if (page->data != NULL) {
+					memcpy(&page->data[line->address & 0xFFF], line->data, UNDO_LINE_SIZE);
+					for (int b = 0; b < UNDO_LINE_SIZE; b++) {
+						page->py_bitmap[(line->address & 0xFFF) + b] = ((line->symbolic >> b) & 1) ? TAINT_SYMBOLIC : TAINT_NONE;
+					}
+				} else {
+					memcpy(&chunk[(k - i) * UNDO_LINE_SIZE], line->data, UNDO_LINE_SIZE);
+				}
+			}
 
-		if (track_bbls) bbl_addrs.pop_back();
-		if (track_stack) stack_pointers.pop_back();
+			if (page->data == NULL) {
+				uc_err err = uc_mem_write(uc, undo_lines[i].address, chunk, (j - i) * UNDO_LINE_SIZE);
+				if (err) {
+					LOG_W("rollback: %s", uc_strerror(err));
+					break;
+				}
+			}
+			i = j;
+		}
+		undo_lines.clear();
 	}
 
 	/*
 	 * return the PageBitmap only if the page is remapped for writing,
-	 * or initialized with symbolic variable, otherwise return NULL.
+	 * or initialized with symbolic variable, otherwise the bitmap is NULL.
 	 */
-	std::pair<taint_t *, uint8_t *> page_lookup(uint64_t address) const {
-		address &= ~0xFFFULL;
-		auto it = active_pages.find(address);
-		if (it == active_pages.end()) {
-			return std::pair<taint_t *, uint8_t *>(NULL, NULL);
+	inline active_page_t page_lookup(uint64_t address) const {
+		active_page_t *page = active_pages.lookup(address);
+		if (page == NULL) {
+			active_page_t none = {NULL, NULL, NULL};
+			return none;
+		}
+		return *page;
+	}
+
+	/*
+	 * the bitmap of page, ready to be modified. a bitmap that is still shared
+	 * with a fork is copied first.
+	 */
+	inline PageBitmap *writable_bitmap(active_page_t *page) {
+		PageBitmap *bitmap = page->bitmap;
+		if (bitmap->refs.load() > 1) {
+			PageBitmap *copy = new PageBitmap;
+			memcpy(copy->symbolic, bitmap->symbolic, sizeof(copy->symbolic));
+			memcpy(copy->dirty, bitmap->dirty, sizeof(copy->dirty));
+			copy->refs = 1;
+			release_bitmap(bitmap);
+			page->bitmap = copy;
+		}
+		return page->bitmap;
+	}
+
+	static void release_bitmap(PageBitmap *bitmap) {
+		if (--bitmap->refs == 0) {
+			delete bitmap;
 		}
-		return it->second;
 	}
 
 	/*
@@ -444,18 +2875,32 @@ public:
 	 */
 	void page_activate(uint64_t address, uint8_t *taint, uint8_t *data) {
 		address &= ~0xFFFULL;
-		auto it = active_pages.find(address);
-		if (it == active_pages.end()) {
-		    if (data == NULL) {
-		        // We need to copy the taint bitmap
-                taint_t *bitmap = new PageBitmap;
-                memcpy(bitmap, taint, sizeof(PageBitmap));
-
-                active_pages.insert(std::pair<uint64_t, std::pair<taint_t*, uint8_t*>>(address, std::pair<taint_t*, uint8_t*>(bitmap, NULL)));
-            } else {
-                // We can directly use the passed taint and data
-                taint_t *bitmap = (taint_t*)taint;
-                active_pages.insert(std::pair<uint64_t, std::pair<taint_t*, uint8_t*>>(address, std::pair<taint_t*, uint8_t*>(bitmap, data)));
+		if (active_pages.lookup(address) == NULL) {
+			// python hands us one taint_t per byte; pack it into the bit planes
+			PageBitmap *bitmap = new PageBitmap;
+			bitmap->refs = 1;
+			uint64_t page_symbolic = 0;
+			for (int w = 0; w < PAGE_BITMAP_WORDS; w++) {
+				bitmap->symbolic[w] = bit_pack_bytes(&taint[w * 64], 0);
+				bitmap->dirty[w] = bit_pack_bytes(&taint[w * 64], 1);
+				page_symbolic += bit_popcount64(bitmap->symbolic[w]);
+			}
+			symbolic_bytes += page_symbolic;
+
+			// for direct-mapped pages, the original byte bitmap belongs to python and stays in sync with ours
+			active_page_t page = {bitmap, data, data == NULL ? NULL : (taint_t *)taint};
+			active_pages.insert(address, page);
+
+			// a concrete page in python's memory only needs to be told about writes, and doesn't need them one by one
+			uint64_t chunk = address >> HOOK_CHUNK_SHIFT;
+			if (guard_pages && scoped_hooks && data != NULL && page_symbolic == 0 && !hooked_chunks.count(chunk) &&
+					guard_page(address)) {
+				return;
+			}
+
+			// mid-run, chunks are only ever added: unicorn may be iterating the hook lists right now
+			if (hooked && scoped_hooks && !hooked_chunks.count(chunk)) {
+				hook_chunks(chunk, chunk);
 			}
 		} else {
 		    // TODO: un-hardcode this address, or at least do this warning from python land
@@ -496,40 +2941,225 @@ public:
 	}
 
 	/*
-	 * record consecutive dirty bit rage, return a linked list of ranges
+	 * activate count consecutive pages starting at address. taint has the byte
+	 * bitmap of each page. data is NULL if none of them is direct-mapped, and
+	 * otherwise has the data of each page, or NULL for the pages that are not.
 	 */
-	mem_update_t *sync() {
-		mem_update *head = NULL;
+	void page_activate_range(uint64_t address, uint64_t count, uint8_t **taint, uint8_t **data) {
+		for (uint64_t i = 0; i < count; i++) {
+			page_activate(address + i * PAGE_SIZE, taint[i], data == NULL ? NULL : data[i]);
+		}
+	}
 
-		for (auto it = active_pages.begin(); it != active_pages.end(); it++) {
-			uint8_t *data = it->second.second;
-			if (data != NULL) {
-			    // nothing to sync, direct mapped :)
-			    continue;
-			}
-			taint_t *start = it->second.first;
-			taint_t *end = &it->second.first[0x1000];
-			//LOG_D("found active page %#lx (%p)", it->first, start);
-			for (taint_t *i = start; i < end; i++)
-				if ((*i) == TAINT_DIRTY) {
-					taint_t *j = i;
-					while (j < end && (*j) == TAINT_DIRTY) j++;
-
-					char buf[0x1000];
-					uc_mem_read(uc, it->first + (i - start), buf, j - i);
-					//LOG_D("sync [%#lx, %#lx] = %#lx", it->first + (i - start), it->first + (j - start), *(uint64_t *)buf);
-
-					mem_update_t *range = new mem_update_t;
-					range->address = it->first + (i - start);
-					range->length = j - i;
-					range->next = head;
-					head = range;
-
-					i = j;
+	/*
+	 * write-protect the active page at address in unicorn, unless it isn't writable anyway or has run as code.
+	 * returns whether it is guarded now.
+	 */
+	bool guard_page(uint64_t address) {
+		uc_mem_region *regions;
+		uint32_t count;
+		uint32_t perms = 0;
+		if (uc_mem_regions(uc, &regions, &count) != UC_ERR_OK) {
+			return false;
+		}
+		for (uint32_t i = 0; i < count; i++) {
+			if (regions[i].begin <= address && address <= regions[i].end) {
+				perms = regions[i].perms;
+				break;
+			}
+		}
+		uc_free(regions);
+
+		if (!(perms & UC_PROT_WRITE) || executed_pages.count(address) ||
+				uc_mem_protect(uc, address, PAGE_SIZE, perms & ~UC_PROT_WRITE) != UC_ERR_OK) {
+			return false;
+		}
+		active_page_t *page = active_pages.lookup(address);
+		page->guard = GUARD_ARMED;
+		page->perms = perms;
+		return true;
+	}
+
+	/*
+	 * hand a guarded page back to the write hooks. a snapshot of it is kept until the next checkpoint, since the
+	 * writes so far weren't recorded.
+	 */
+	void unguard(uint64_t page_address, active_page_t *page) {
+		if (page->guard == GUARD_ARMED) {
+			uc_mem_protect(uc, page_address, PAGE_SIZE, page->perms);
+		}
+		page->guard = GUARD_NONE;
+
+		uint64_t chunk = page_address >> HOOK_CHUNK_SHIFT;
+		if (hooked && !hooked_chunks.count(chunk)) {
+			hook_chunks(chunk, chunk);
+		}
+	}
+
+	/*
+	 * the write protection hook for an access to [address, address + size). the guarded pages in there are saved
+	 * and made writable, and the store done by hand, since unicorn may drop it as a write to read-only memory.
+	 * returns false if there is no guarded page there, i.e. for a real permissions error.
+	 */
+	bool open_guards(uint64_t address, int size, int64_t value) {
+		bool opened = false;
+		uint64_t last = (address + size - 1) & ~0xFFFULL;
+		for (uint64_t page_address = address & ~0xFFFULL; page_address <= last; page_address += PAGE_SIZE) {
+			active_page_t *page = active_pages.lookup(page_address);
+			if (page == NULL || page->guard != GUARD_ARMED) {
+				continue;
+			}
+			opened = true;
+
+			if (guard_snapshots.size() >= GUARD_MAX_OPEN || page_address == (cur_address & ~0xFFFULL)) {
+				// this one goes back to the hooks, which have been passed for this store already
+				bool seen = mem_hooked(address);
+				unguard(page_address, page);
+				if (!seen) {
+					hook_mem_write(uc, UC_MEM_WRITE, address, size, value, this);
+				}
+				continue;
+			}
+
+			guard_snapshots.emplace_back();
+			guard_snapshot_t &snapshot = guard_snapshots.back();
+			snapshot.address = page_address;
+			snapshot.idle = 0;
+			memcpy(snapshot.data, page->data, PAGE_SIZE);
+			page->guard = GUARD_OPEN;
+			uc_mem_protect(uc, page_address, PAGE_SIZE, page->perms);
+		}
+		if (!opened) {
+			return false;
+		}
+
+		// the mode the engine was opened with: vex_archinfo is only set with symbolic register tracking
+		bool big_endian = (mode & UC_MODE_BIG_ENDIAN) != 0;
+		for (int i = 0; i < size; i++) {
+			active_page_t *page = active_pages.lookup(address + i);
+			if (page != NULL && page->data != NULL) {
+				page->data[(address + i) & 0xFFF] = (uint8_t)(value >> (8 * (big_endian ? size - 1 - i : i)));
+			}
+		}
+		return true;
+	}
+
+	/*
+	 * save the open guarded pages as they are now, the way checkpoint() saves the registers. pages that stopped
+	 * changing are armed again, so that they don't cost a copy every time.
+	 */
+	void checkpoint_guards() {
+		size_t i = 0;
+		while (i < guard_snapshots.size()) {
+			guard_snapshot_t &snapshot = guard_snapshots[i];
+			active_page_t *page = active_pages.lookup(snapshot.address);
+			bool keep = page != NULL && page->guard == GUARD_OPEN;
+			if (keep && memcmp(snapshot.data, page->data, PAGE_SIZE) != 0) {
+				memcpy(snapshot.data, page->data, PAGE_SIZE);
+				snapshot.idle = 0;
+			} else if (keep && ++snapshot.idle >= GUARD_IDLE_CHECKPOINTS &&
+					uc_mem_protect(uc, snapshot.address, PAGE_SIZE, page->perms & ~UC_PROT_WRITE) == UC_ERR_OK) {
+				page->guard = GUARD_ARMED;
+				keep = false;
+			}
+
+			if (keep) {
+				i++;
+			} else {
+				if (i + 1 != guard_snapshots.size()) {
+					snapshot = guard_snapshots.back();
 				}
+				guard_snapshots.pop_back();
+			}
+		}
+	}
+
+	/*
+	 * at the end of a run, write-protect the open guarded pages again. python may change them before the next one.
+	 */
+	void arm_open_guards() {
+		for (auto &snapshot : guard_snapshots) {
+			active_page_t *page = active_pages.lookup(snapshot.address);
+			if (page != NULL && page->guard == GUARD_OPEN &&
+					uc_mem_protect(uc, snapshot.address, PAGE_SIZE, page->perms & ~UC_PROT_WRITE) == UC_ERR_OK) {
+				page->guard = GUARD_ARMED;
+			} else if (page != NULL && page->guard == GUARD_OPEN) {
+				unguard(snapshot.address, page);
+			}
 		}
+		guard_snapshots.clear();
+	}
+
+	/*
+	 * call f(address, length) for each run of dirty bytes, in ascending order.
+	 * runs that continue across a page boundary are reported as one.
+	 */
+	template <typename F>
+	void for_each_dirty_run(F f) {
+		uint64_t run_start = 0, run_end = 0;
+
+		active_pages.for_each([&](uint64_t page_address, active_page_t *page) {
+			if (page->data != NULL) {
+			    // nothing to sync, direct mapped :)
+			    return;
+			}
+			const uint64_t *dirty = page->bitmap->dirty;
+			for (int i = bit_find_set(dirty, 0, PAGE_SIZE); i != -1; ) {
+				int j = bit_find_clear(dirty, i, PAGE_SIZE);
+
+				if (run_end == page_address + i && run_end != run_start) {
+					run_end = page_address + j;
+				} else {
+					if (run_end != run_start) f(run_start, run_end - run_start);
+					run_start = page_address + i;
+					run_end = page_address + j;
+				}
+
+				i = bit_find_set(dirty, j, PAGE_SIZE);
+			}
+		});
+
+		if (run_end != run_start) f(run_start, run_end - run_start);
+	}
+
+	/*
+	 * the number of dirty runs and the total number of dirty bytes, i.e. the
+	 * buffer sizes sync() needs to copy out everything
+	 */
+	void sync_size(uint64_t *count, uint64_t *bytes) {
+		*count = 0;
+		*bytes = 0;
+		for_each_dirty_run([&](uint64_t address, uint64_t length) {
+			(*count)++;
+			*bytes += length;
+		});
+	}
+
+	/*
+	 * record consecutive dirty bit ranges into updates, and their contents
+	 * packed into data. stops at the first run that does not fit either
+	 * buffer. returns the number of updates written.
+	 */
+	uint64_t sync(mem_update_t *updates, uint64_t max_updates, uint8_t *data, uint64_t data_size) {
+		uint64_t count = 0, offset = 0;
+		bool full = false;
+
+		for_each_dirty_run([&](uint64_t address, uint64_t length) {
+			if (full || count == max_updates || length > data_size - offset) {
+				full = true;
+				return;
+			}
+			uc_mem_read(uc, address, data + offset, length);
+			//LOG_D("sync [%#lx, %#lx] = %#lx", address, address + length, *(uint64_t *)(data + offset));
 
-		return head;
+			updates[count].address = address;
+			updates[count].length = length;
+			updates[count].offset = offset;
+			count++;
+			offset += length;
+		});
+
+		return count;
 	}
 
 	/*
@@ -539,8 +3169,20 @@ public:
 	void set_stops(uint64_t count, uint64_t *stops)
 	{
 		stop_points.clear();
-		for (int i = 0; i < count; i++) {
-			stop_points.insert(stops[i]);
+		add_stops(count, stops);
+	}
+
+	void add_stops(uint64_t count, uint64_t *stops)
+	{
+		for (uint64_t i = 0; i < count; i++) {
+			stop_points.add(stops[i]);
+		}
+	}
+
+	void remove_stops(uint64_t count, uint64_t *stops)
+	{
+		for (uint64_t i = 0; i < count; i++) {
+			stop_points.remove(stops[i]);
 		}
 	}
 
@@ -549,100 +3191,184 @@ public:
 		assert(address % 0x1000 == 0);
 		assert(size % 0x1000 == 0);
 
+		std::lock_guard<std::mutex> guard(caches->lock);
 		for (uint64_t offset = 0; offset < size; offset += 0x1000)
 		{
-			auto page = page_cache->find(address+offset);
-			if (page != page_cache->end())
+			auto extent = find_extent(page_cache, address+offset);
+			if (extent != page_cache->end())
 			{
 				fprintf(stderr, "[%#" PRIx64 ", %#" PRIx64 "](%#zx) already in cache.\n", address+offset, address+offset + 0x1000, 0x1000lu);
-				assert(page->second.size == 0x1000);
-				assert(memcmp(page->second.bytes, bytes + offset, 0x1000) == 0);
+				assert(memcmp(extent->second.bytes + (address + offset - extent->first), bytes + offset, 0x1000) == 0);
 
 				continue;
 			}
 
-			uint8_t *copy = (uint8_t *)malloc(0x1000);
-			CachedPage cached_page = {
-				0x1000,
-				copy,
-				permissions
-			};
-			// address should be aligned to 0x1000
-			memcpy(copy, &bytes[offset], 0x1000);
-			page_cache->insert(std::pair<uint64_t, CachedPage>(address+offset, cached_page));
+			// the pages of the binary itself go to the shared copy, if there is one
+			uint8_t *page_bytes = NULL;
+			bool shared = false;
+			if (caches->shared != NULL && caches->unshared.count(address + offset) == 0) {
+				page_bytes = (uint8_t *)caches->shared->insert(address + offset, (uint8_t *)&bytes[offset], permissions);
+				shared = page_bytes != NULL;
+			}
+			if (page_bytes == NULL) {
+				page_bytes = caches->page_arena->alloc(address + offset);
+				if (page_bytes == NULL) {
+					fprintf(stderr, "[%#" PRIx64 ", %#" PRIx64 "] not cached: out of memory.\n", address+offset, address+offset + 0x1000);
+					continue;
+				}
+				memcpy(page_bytes, &bytes[offset], 0x1000);
+			}
+			caches->registry->account(insert_page(page_cache, address + offset, page_bytes, permissions, shared, &extent));
 		}
 		return std::make_pair(address, size);
 	}
 
-    void wipe_page_from_cache(uint64_t address) {
-		auto page = page_cache->find(address);
-		if (page != page_cache->end()) {
-			//printf("Internal: unmapping %#llx size %#x, result %#x", page->first, page->second.size, uc_mem_unmap(uc, page->first, page->second.size));
-			uc_err err = uc_mem_unmap(uc, page->first, page->second.size);
-			//if (err) {
-			//	fprintf(stderr, "wipe_page_from_cache [%#lx, %#lx]: %s\n", page->first, page->first + page->second.size, uc_strerror(err));
-			//}
-			free(page->second.bytes); // might explode
-			page_cache->erase(page);
-		} else {
-			//printf("Uh oh! Couldn't find page at %#llx\n", address);
+	/*
+	 * drop [start, end) from the page cache and unmap it, splitting the extents that reach outside of it. start and
+	 * end are page aligned, and the cache lock must be held.
+	 */
+	void wipe_range_from_cache(uint64_t start, uint64_t end) {
+		auto extent = find_extent(page_cache, start);
+		if (extent == page_cache->end()) {
+			extent = page_cache->lower_bound(start);
 		}
-    }
+		while (extent != page_cache->end() && extent->first < end) {
+			uint64_t extent_start = extent->first;
+			CachedPage page = extent->second;
+			uint64_t lo = std::max(start, extent_start);
+			uint64_t hi = std::min(end, extent_start + page.size);
+
+			unmap_range(uc, lo, hi);
+			for (uint64_t address = lo; address < hi; address += 0x1000) {
+				if (page.shared) {
+					// what python has there now may not be what other processes have
+					caches->unshared.insert(address);
+				} else {
+					caches->page_arena->release(address, page.bytes + (address - extent_start));
+				}
+			}
+			caches->registry->account(cut_extent(page_cache, extent, lo, hi));
+			extent = page_cache->lower_bound(hi);
+		}
+	}
 
     void uncache_pages_touching_region(uint64_t address, uint64_t length)
     {
     	    address &= ~(0x1000-1);
+	    std::lock_guard<std::mutex> guard(caches->lock);
 
-	    for (uint64_t offset = 0; offset < length; offset += 0x1000)
-	    {
-            	    wipe_page_from_cache(address + offset);
-	    }
-
+	    wipe_range_from_cache(address, address + ((length + 0xfff) & ~0xfffULL));
     }
 
     void clear_page_cache()
     {
+        std::lock_guard<std::mutex> guard(caches->lock);
         while (!page_cache->empty())
         {
-            wipe_page_from_cache(page_cache->begin()->first);
+            wipe_range_from_cache(page_cache->begin()->first, page_cache->begin()->first + page_cache->begin()->second.size);
         }
     }
 
+	/*
+	 * take the page at address into the page cache from the shared pages, some other process having cached it. the
+	 * cache lock must be held. returns the extent that holds it, or the end of the page cache.
+	 */
+	PageCache::iterator find_shared_page(uint64_t address) {
+		uint64_t perms;
+		const uint8_t *bytes;
+		if (caches->shared == NULL || caches->unshared.count(address) != 0 ||
+				(bytes = caches->shared->find(address, &perms)) == NULL) {
+			return page_cache->end();
+		}
+		PageCache::iterator extent;
+		caches->registry->account(insert_page(page_cache, address, (uint8_t *)bytes, perms, true, &extent));
+		return extent;
+	}
+
+	/*
+	 * map the cached pages in [address, address + size) into unicorn. a page
+	 * brings the rest of its extent along, as far as uc has nothing mapped
+	 * there yet, so a run of cached pages becomes one region and takes a single
+	 * fault. pages that uc has mapped already are left alone.
+	 */
 	bool map_cache(uint64_t address, size_t size) {
 		assert(address % 0x1000 == 0);
 		assert(size % 0x1000 == 0);
 
 		bool success = true;
+		std::vector<uc_mem_region> mapped;
+		bool have_mapped = false;
 
-		for (uint64_t offset = 0; offset < size; offset += 0x1000)
+		std::lock_guard<std::mutex> guard(caches->lock);
+		for (uint64_t offset = 0; offset < size; )
 		{
-			auto page = page_cache->find(address+offset);
-			if (page == page_cache->end())
+			uint64_t page_address = address + offset;
+			offset += 0x1000;
+
+			auto extent = find_extent(page_cache, page_address);
+			if (extent == page_cache->end())
+			{
+				extent = find_shared_page(page_address);
+			}
+			if (extent == page_cache->end())
 			{
+				cache_counters.page_misses++;
 				success = false;
 				continue;
 			}
+			cache_counters.page_hits++;
+
+			if (!have_mapped) {
+				uc_mem_region *regions;
+				uint32_t count;
+				if (uc_mem_regions(uc, &regions, &count) == UC_ERR_OK) {
+					mapped.assign(regions, regions + count);
+					uc_free(regions);
+				}
+				have_mapped = true;
+			}
 
-			auto cached_page = page->second;
-			size_t page_size = cached_page.size;
-			uint8_t *bytes = cached_page.bytes;
-			uint64_t permissions = cached_page.perms;
-
-			assert(page_size == 0x1000);
+			// the part of the extent around the page that nothing is mapped in
+			uint64_t lo = extent->first;
+			uint64_t hi = extent->first + extent->second.size;
+			bool present = false;
+			for (auto &region : mapped) {
+				if (region.end < lo || region.begin >= hi) {
+					continue;
+				}
+				if (region.begin <= page_address && page_address <= region.end) {
+					present = true;
+					break;
+				}
+				if (region.end < page_address) {
+					lo = region.end + 1;
+				} else {
+					hi = region.begin;
+				}
+			}
+			if (present) {
+				continue;
+			}
 
-			//LOG_D("hit cache [%#lx, %#lx]", address, address + size);
-			uc_err err = uc_mem_map_ptr(uc, page->first, page_size, permissions, bytes);
+			LOG_D("hit cache [%#" PRIx64 ", %#" PRIx64 "]", lo, hi);
+			uc_err err = uc_mem_map_ptr(uc, lo, hi - lo, extent->second.perms, extent->second.bytes + (lo - extent->first));
 			if (err) {
-				fprintf(stderr, "map_cache [%#lx, %#lx]: %s\n", address, address + size, uc_strerror(err));
+				fprintf(stderr, "map_cache [%#lx, %#lx]: %s\n", lo, hi, uc_strerror(err));
 				success = false;
 				continue;
 			}
+			caches->engines.insert(uc);
+			mapped.push_back(uc_mem_region{lo, hi - 1, (uint32_t)extent->second.perms});
+			if (hi > address + offset) {
+				offset = hi - address;
+			}
 		}
 		return success;
 	}
 
 	bool in_cache(uint64_t address) {
-		return page_cache->find(address) != page_cache->end();
+		std::lock_guard<std::mutex> guard(caches->lock);
+		return find_extent(page_cache, address) != page_cache->end() || find_shared_page(address) != page_cache->end();
 	}
 
 	//
@@ -650,7 +3376,7 @@ public:
 	//
 
 	// check if we can clobberedly handle this IRExpr
-	inline bool check_expr(RegisterSet *clobbered, RegisterSet *danger, IRExpr *e)
+	static inline bool check_expr(RegisterBitset *clobbered, RegisterBitset *danger, IRExpr *e)
 	{
 		int i, expr_size;
 		if (e == NULL) return true;
@@ -671,45 +3397,45 @@ public:
 			case Iex_Get:
 				if (e->Iex.Get.ty == Ity_I1)
 				{
-					//LOG_W("seeing a 1-bit get from a register");
+					LOG_D("seeing a 1-bit get from a register");
 					return false;
 				}
 
 				expr_size = sizeofIRType(e->Iex.Get.ty);
-				this->check_register_read(clobbered, danger, e->Iex.Get.offset, expr_size);
+				check_register_read(clobbered, danger, e->Iex.Get.offset, expr_size);
 				break;
 			case Iex_Qop:
-				if (!this->check_expr(clobbered, danger, e->Iex.Qop.details->arg1)) return false;
-				if (!this->check_expr(clobbered, danger, e->Iex.Qop.details->arg2)) return false;
-				if (!this->check_expr(clobbered, danger, e->Iex.Qop.details->arg3)) return false;
-				if (!this->check_expr(clobbered, danger, e->Iex.Qop.details->arg4)) return false;
+				if (!check_expr(clobbered, danger, e->Iex.Qop.details->arg1)) return false;
+				if (!check_expr(clobbered, danger, e->Iex.Qop.details->arg2)) return false;
+				if (!check_expr(clobbered, danger, e->Iex.Qop.details->arg3)) return false;
+				if (!check_expr(clobbered, danger, e->Iex.Qop.details->arg4)) return false;
 				break;
 			case Iex_Triop:
-				if (!this->check_expr(clobbered, danger, e->Iex.Triop.details->arg1)) return false;
-				if (!this->check_expr(clobbered, danger, e->Iex.Triop.details->arg2)) return false;
-				if (!this->check_expr(clobbered, danger, e->Iex.Triop.details->arg3)) return false;
+				if (!check_expr(clobbered, danger, e->Iex.Triop.details->arg1)) return false;
+				if (!check_expr(clobbered, danger, e->Iex.Triop.details->arg2)) return false;
+				if (!check_expr(clobbered, danger, e->Iex.Triop.details->arg3)) return false;
 				break;
 			case Iex_Binop:
-				if (!this->check_expr(clobbered, danger, e->Iex.Binop.arg1)) return false;
-				if (!this->check_expr(clobbered, danger, e->Iex.Binop.arg2)) return false;
+				if (!check_expr(clobbered, danger, e->Iex.Binop.arg1)) return false;
+				if (!check_expr(clobbered, danger, e->Iex.Binop.arg2)) return false;
 				break;
 			case Iex_Unop:
-				if (!this->check_expr(clobbered, danger, e->Iex.Unop.arg)) return false;
+				if (!check_expr(clobbered, danger, e->Iex.Unop.arg)) return false;
 				break;
 			case Iex_Load:
-				if (!this->check_expr(clobbered, danger, e->Iex.Load.addr)) return false;
+				if (!check_expr(clobbered, danger, e->Iex.Load.addr)) return false;
 				break;
 			case Iex_Const:
 				break;
 			case Iex_ITE:
-				if (!this->check_expr(clobbered, danger, e->Iex.ITE.cond)) return false;
-				if (!this->check_expr(clobbered, danger, e->Iex.ITE.iffalse)) return false;
-				if (!this->check_expr(clobbered, danger, e->Iex.ITE.iftrue)) return false;
+				if (!check_expr(clobbered, danger, e->Iex.ITE.cond)) return false;
+				if (!check_expr(clobbered, danger, e->Iex.ITE.iffalse)) return false;
+				if (!check_expr(clobbered, danger, e->Iex.ITE.iftrue)) return false;
 				break;
 			case Iex_CCall:
 				for (i = 0; e->Iex.CCall.args[i] != NULL; i++)
 				{
-					if (!this->check_expr(clobbered, danger, e->Iex.CCall.args[i])) return false;
+					if (!check_expr(clobbered, danger, e->Iex.CCall.args[i])) return false;
 				}
 				break;
 		}
@@ -718,39 +3444,33 @@ public:
 	}
 
 	// mark the register as clobbered
-	inline void mark_register_clobbered(RegisterSet *clobbered, uint64_t offset, int size)
+	static inline void mark_register_clobbered(RegisterBitset *clobbered, uint64_t offset, int size)
 	{
-		for (int i = 0; i < size; i++)
-			clobbered->insert(offset + i);
+		clobbered->insert(offset, size);
 	}
 
 	// check register access
-	inline void check_register_read(RegisterSet *clobbered, RegisterSet *danger, uint64_t offset, int size)
+	static inline void check_register_read(RegisterBitset *clobbered, RegisterBitset *danger, uint64_t offset, int size)
 	{
-		for (int i = 0; i < size; i++)
-		{
-			if (clobbered->count(offset + i) == 0) {
-				danger->insert(offset + i);
-			}
-		}
+		danger->insert_excluding(offset, size, *clobbered);
 	}
 
 	// check if we can clobberedly handle this IRStmt
-	inline bool check_stmt(RegisterSet *clobbered, RegisterSet *danger, IRTypeEnv *tyenv, IRStmt *s)
+	static inline bool check_stmt(RegisterBitset *clobbered, RegisterBitset *danger, IRTypeEnv *tyenv, IRStmt *s)
 	{
 		switch (s->tag)
 		{
 			case Ist_Put: {
-				if (!this->check_expr(clobbered, danger, s->Ist.Put.data)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.Put.data)) return false;
 				IRType expr_type = typeOfIRExpr(tyenv, s->Ist.Put.data);
 				if (expr_type == Ity_I1)
 				{
-					//LOG_W("seeing a 1-bit write to a register");
+					LOG_D("seeing a 1-bit write to a register");
 					return false;
 				}
 
 				int expr_size = sizeofIRType(expr_type);
-				this->mark_register_clobbered(clobbered, s->Ist.Put.offset, expr_size);
+				mark_register_clobbered(clobbered, s->Ist.Put.offset, expr_size);
 				break;
 			}
 			case Ist_PutI:
@@ -766,44 +3486,44 @@ public:
 				return false;
 				break;
 			case Ist_WrTmp:
-				if (!this->check_expr(clobbered, danger, s->Ist.WrTmp.data)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.WrTmp.data)) return false;
 				break;
 			case Ist_Store:
-				if (!this->check_expr(clobbered, danger, s->Ist.Store.addr)) return false;
-				if (!this->check_expr(clobbered, danger, s->Ist.Store.data)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.Store.addr)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.Store.data)) return false;
 				break;
 			case Ist_CAS:
-				if (!this->check_expr(clobbered, danger, s->Ist.CAS.details->addr)) return false;
-				if (!this->check_expr(clobbered, danger, s->Ist.CAS.details->dataLo)) return false;
-				if (!this->check_expr(clobbered, danger, s->Ist.CAS.details->dataHi)) return false;
-				if (!this->check_expr(clobbered, danger, s->Ist.CAS.details->expdLo)) return false;
-				if (!this->check_expr(clobbered, danger, s->Ist.CAS.details->expdHi)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.CAS.details->addr)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.CAS.details->dataLo)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.CAS.details->dataHi)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.CAS.details->expdLo)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.CAS.details->expdHi)) return false;
 				break;
 			case Ist_LLSC:
-				if (!this->check_expr(clobbered, danger, s->Ist.LLSC.addr)) return false;
-				if (!this->check_expr(clobbered, danger, s->Ist.LLSC.storedata)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.LLSC.addr)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.LLSC.storedata)) return false;
 				break;
 			case Ist_Dirty: {
-				if (!this->check_expr(clobbered, danger, s->Ist.Dirty.details->guard)) return false;
-				if (!this->check_expr(clobbered, danger, s->Ist.Dirty.details->mAddr)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.Dirty.details->guard)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.Dirty.details->mAddr)) return false;
 				for (int i = 0; s->Ist.Dirty.details->args[i] != NULL; i++)
 				{
-					if (!this->check_expr(clobbered, danger, s->Ist.Dirty.details->args[i])) return false;
+					if (!check_expr(clobbered, danger, s->Ist.Dirty.details->args[i])) return false;
 				}
 				break;
 							}
 			case Ist_Exit:
-				if (!this->check_expr(clobbered, danger, s->Ist.Exit.guard)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.Exit.guard)) return false;
 				break;
 			case Ist_LoadG:
-				if (!this->check_expr(clobbered, danger, s->Ist.LoadG.details->addr)) return false;
-				if (!this->check_expr(clobbered, danger, s->Ist.LoadG.details->alt)) return false;
-				if (!this->check_expr(clobbered, danger, s->Ist.LoadG.details->guard)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.LoadG.details->addr)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.LoadG.details->alt)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.LoadG.details->guard)) return false;
 				break;
 			case Ist_StoreG:
-				if (!this->check_expr(clobbered, danger, s->Ist.StoreG.details->addr)) return false;
-				if (!this->check_expr(clobbered, danger, s->Ist.StoreG.details->data)) return false;
-				if (!this->check_expr(clobbered, danger, s->Ist.StoreG.details->guard)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.StoreG.details->addr)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.StoreG.details->data)) return false;
+				if (!check_expr(clobbered, danger, s->Ist.StoreG.details->guard)) return false;
 				break;
 			case Ist_NoOp:
 			case Ist_IMark:
@@ -812,14 +3532,211 @@ public:
 				// no-ops for our purposes
 				break;
 			default:
-				//LOG_W("Encountered unknown VEX statement -- can't determine clobberedty.")
+				LOG_W("Encountered unknown VEX statement -- can't determine clobberedty.");
+				return false;
+		}
+
+		return true;
+	}
+
+	// whether e may hold a value read from memory in this block. sets *escapes
+	// if such a value is used as an address to load from.
+	static bool expr_loaded(IRExpr *e, const std::vector<bool> &loaded_tmps, const RegisterBitset &loaded_regs, bool *escapes)
+	{
+		bool loaded = false;
+		if (e == NULL) return false;
+		switch (e->tag)
+		{
+			case Iex_Get:
+				return loaded_regs.find(e->Iex.Get.offset, sizeofIRType(e->Iex.Get.ty)) != -1;
+			case Iex_GetI:
+				return true;
+			case Iex_RdTmp:
+				return loaded_tmps[e->Iex.RdTmp.tmp];
+			case Iex_Load:
+				*escapes |= expr_loaded(e->Iex.Load.addr, loaded_tmps, loaded_regs, escapes);
+				return true;
+			case Iex_Qop:
+				loaded |= expr_loaded(e->Iex.Qop.details->arg1, loaded_tmps, loaded_regs, escapes);
+				loaded |= expr_loaded(e->Iex.Qop.details->arg2, loaded_tmps, loaded_regs, escapes);
+				loaded |= expr_loaded(e->Iex.Qop.details->arg3, loaded_tmps, loaded_regs, escapes);
+				loaded |= expr_loaded(e->Iex.Qop.details->arg4, loaded_tmps, loaded_regs, escapes);
+				return loaded;
+			case Iex_Triop:
+				loaded |= expr_loaded(e->Iex.Triop.details->arg1, loaded_tmps, loaded_regs, escapes);
+				loaded |= expr_loaded(e->Iex.Triop.details->arg2, loaded_tmps, loaded_regs, escapes);
+				loaded |= expr_loaded(e->Iex.Triop.details->arg3, loaded_tmps, loaded_regs, escapes);
+				return loaded;
+			case Iex_Binop:
+				loaded |= expr_loaded(e->Iex.Binop.arg1, loaded_tmps, loaded_regs, escapes);
+				loaded |= expr_loaded(e->Iex.Binop.arg2, loaded_tmps, loaded_regs, escapes);
+				return loaded;
+			case Iex_Unop:
+				return expr_loaded(e->Iex.Unop.arg, loaded_tmps, loaded_regs, escapes);
+			case Iex_ITE:
+				loaded |= expr_loaded(e->Iex.ITE.cond, loaded_tmps, loaded_regs, escapes);
+				loaded |= expr_loaded(e->Iex.ITE.iffalse, loaded_tmps, loaded_regs, escapes);
+				loaded |= expr_loaded(e->Iex.ITE.iftrue, loaded_tmps, loaded_regs, escapes);
+				return loaded;
+			case Iex_CCall:
+				for (int i = 0; e->Iex.CCall.args[i] != NULL; i++)
+				{
+					loaded |= expr_loaded(e->Iex.CCall.args[i], loaded_tmps, loaded_regs, escapes);
+				}
+				return loaded;
+			default:
 				return false;
 		}
+	}
+
+	/*
+	 * taint liveness: whether every value the block reads from memory is dead
+	 * by the time it leaves the block, i.e. it never gets to memory, to an
+	 * address, to an exit condition or the next pc, and every register it gets
+	 * to has been overwritten with something else by the next exit. a symbolic
+	 * read in such a block changes nothing the block leaves behind. if the
+	 * block stops halfway, it's rolled back anyway. statements that touch
+	 * memory by themselves (CAS, LL/SC, dirty helpers) count as escapes.
+	 */
+	static bool loads_dead(IRSB *block)
+	{
+		std::vector<bool> loaded(block->tyenv->types_used);
+		RegisterBitset live; // register bytes holding loaded values
+		bool escapes = false;
+
+		for (int i = 0; i < block->stmts_used && !escapes; i++) {
+			IRStmt *s = block->stmts[i];
+			switch (s->tag)
+			{
+				case Ist_WrTmp:
+					loaded[s->Ist.WrTmp.tmp] = expr_loaded(s->Ist.WrTmp.data, loaded, live, &escapes);
+					break;
+				case Ist_Put: {
+					int size = sizeofIRType(typeOfIRExpr(block->tyenv, s->Ist.Put.data));
+					if (expr_loaded(s->Ist.Put.data, loaded, live, &escapes)) {
+						live.insert(s->Ist.Put.offset, size);
+					} else {
+						live.erase(s->Ist.Put.offset, size);
+					}
+					break;
+				}
+				case Ist_Store:
+					escapes |= expr_loaded(s->Ist.Store.addr, loaded, live, &escapes);
+					escapes |= expr_loaded(s->Ist.Store.data, loaded, live, &escapes);
+					break;
+				case Ist_StoreG:
+					escapes |= expr_loaded(s->Ist.StoreG.details->addr, loaded, live, &escapes);
+					escapes |= expr_loaded(s->Ist.StoreG.details->data, loaded, live, &escapes);
+					escapes |= expr_loaded(s->Ist.StoreG.details->guard, loaded, live, &escapes);
+					break;
+				case Ist_LoadG:
+					escapes |= expr_loaded(s->Ist.LoadG.details->addr, loaded, live, &escapes);
+					escapes |= expr_loaded(s->Ist.LoadG.details->guard, loaded, live, &escapes);
+					loaded[s->Ist.LoadG.details->dst] = true;
+					break;
+				case Ist_Exit:
+					escapes |= expr_loaded(s->Ist.Exit.guard, loaded, live, &escapes) || !live.empty();
+					break;
+				case Ist_NoOp:
+				case Ist_IMark:
+				case Ist_AbiHint:
+				case Ist_MBE:
+					break;
+				default:
+					escapes = true;
+			}
+		}
+
+		return !escapes && !expr_loaded(block->next, loaded, live, &escapes) && !escapes && live.empty();
+	}
+
+	// lift the size bytes of code at address and record which registers the
+	// block reads and clobbers into entry. opt_level 0 skips VEX's optimizer:
+	// its Gets are then a superset of the optimized block's, and its Puts are
+	// the same. returns false if the block could not be lifted.
+	static bool summarize_block(VexArch guest, VexArchInfo archinfo, uint8_t *code, uint64_t address, int32_t size, int opt_level, block_entry_t &entry)
+	{
+		// wtf i hate c++...
+		VexRegisterUpdates pxControl = VexRegUpdUnwindregsAtMemAccess;
+		entry.try_unicorn = true;
+		entry.loads_dead = false;
+
+		// libvex keeps the lifted block in a static arena, so it's ours until we're done walking it
+		std::lock_guard<std::mutex> guard(vex_lift_lock);
+		VEXLiftResult *lift_ret = vex_lift(
+				guest, archinfo, code, address, 99, size, opt_level, 0, 0, 1, 0,
+				pxControl
+				);
+
+		if (lift_ret == NULL) {
+			return false;
+		}
+		entry.size = lift_ret->size;
+
+		IRSB *the_block = lift_ret->irsb;
+		RegisterBitset clobbered, used;
+
+		for (int i = 0; i < the_block->stmts_used; i++) {
+			if (!check_stmt(&clobbered, &used, the_block->tyenv, the_block->stmts[i])) {
+				entry.try_unicorn = false;
+				return true;
+			}
+		}
 
+		if (!check_expr(&clobbered, &used, the_block->next)) {
+			entry.try_unicorn = false;
+			return true;
+		}
+
+		used.to_ranges(entry.used_registers);
+		clobbered.to_ranges(entry.clobbered_registers);
+		entry.loads_dead = loads_dead(the_block);
+		return true;
+	}
+
+	bool analyze_block(uint64_t address, int32_t size, int opt_level, block_entry_t &entry)
+	{
+		std::unique_ptr<uint8_t[]> instructions(new uint8_t[size]);
+		uc_mem_read(this->uc, address, instructions.get(), size);
+		if (!summarize_block(this->vex_guest, this->vex_archinfo, instructions.get(), address, size, opt_level, entry)) {
+			return false;
+		}
+		if (entry.size != (uint32_t)size) {
+			// VEX gave up before the end of the block, so it missed some loads
+			entry.loads_dead = false;
+		}
 		return true;
 	}
 
-	// check if the block is feasible
+	// add entry to cache unless another State beat us to it, and return the cached one
+	static const block_entry_t *publish_block(caches_t *caches, BlockCache *cache, uint64_t address, block_entry_t &entry)
+	{
+		std::lock_guard<std::mutex> guard(caches->lock);
+		auto inserted = cache->emplace(address, std::move(entry));
+		if (inserted.second) {
+			caches->registry->account(block_entry_bytes(inserted.first->second));
+		}
+		return &inserted.first->second;
+	}
+
+	inline bool block_feasible(const block_entry_t *entry) const
+	{
+		return entry->try_unicorn && this->symbolic_registers.find(entry->used_registers) == -1;
+	}
+
+	/*
+	 * check if the block is feasible.
+	 *
+	 * a new block is first lifted without optimization, which is cheaper, and
+	 * its summary is good enough to let the block run whenever it touches no
+	 * symbolic register. only when it does, or looks unliftable, is the block
+	 * lifted in full to get its exact summary, which then takes precedence.
+	 * both kinds only record which registers the block uses, not which are
+	 * symbolic right now, so a full lift done for one set of symbolic
+	 * registers answers every later check, rejections included. a block that
+	 * the prelift worker got to first needs no lift at all, as long as unicorn
+	 * ended the block where VEX did.
+	 */
 	bool check_block(uint64_t address, int32_t size)
 	{
 		// assume we're good if we're not checking symbolic registers
@@ -827,109 +3744,559 @@ public:
 			return true;
 		}
 
-		// if there are no symbolic registers we're ok
-		if (this->symbolic_registers.size() == 0) {
+		// if there are no symbolic registers we're ok
+		if (this->symbolic_registers.empty()) {
+			return true;
+		}
+
+		bool exact;
+		const block_entry_t *entry = this->find_block(address, size, exact);
+		if (entry == NULL) {
+			// TODO: how to handle?
+			return false;
+		}
+
+		if (!exact && !this->block_feasible(entry)) {
+			cache_counters.block_full_lifts++;
+
+			block_entry_t new_entry;
+			if (!this->analyze_block(address, size, 1, new_entry)) {
+				return false;
+			}
+			entry = publish_block(caches, this->block_cache, address, new_entry);
+			cur_block = entry;
+		}
+
+		if (!entry->try_unicorn) {
+			return false;
+		}
+
+		int64_t used_symbolic = this->symbolic_registers.find(entry->used_registers);
+		if (used_symbolic != -1) {
+			stopping_register = used_symbolic;
+			return false;
+		}
+
+		this->symbolic_registers.erase(entry->clobbered_registers);
+
+		return true;
+	}
+
+	/*
+	 * the summary of a block from the block caches, or from a cheap lift if
+	 * there's none yet. exact is set when it came from a full lift. it's also
+	 * kept as the summary of the current block. returns NULL if the block
+	 * could not be lifted.
+	 */
+	const block_entry_t *find_block(uint64_t address, int32_t size, bool &exact)
+	{
+		// check if it's in the cache already
+		const block_entry_t *entry = NULL;
+		exact = true;
+		{
+			std::lock_guard<std::mutex> guard(caches->lock);
+			auto search = this->block_cache->find(address);
+			if (search != this->block_cache->end()) {
+				entry = &search->second;
+			} else if ((search = this->prelift_cache->find(address)) != this->prelift_cache->end() &&
+					search->second.size == (uint32_t)size) {
+				entry = &search->second;
+			} else if ((search = this->summary_cache->find(address)) != this->summary_cache->end()) {
+				entry = &search->second;
+				exact = false;
+			}
+		}
+
+		if (entry != NULL) {
+			cache_counters.block_hits++;
+		} else {
+			cache_counters.block_misses++;
+
+			// analyze the block without holding the lock, then publish it
+			block_entry_t new_entry;
+			if (!this->analyze_block(address, size, 0, new_entry)) {
+				return NULL;
+			}
+			entry = publish_block(caches, this->summary_cache, address, new_entry);
+			exact = false;
+		}
+
+		cur_block = entry;
+		return entry;
+	}
+
+	/*
+	 * whether the current block can go on after reading symbolic memory: it
+	 * can when its loads are dead (see loads_dead), as it then leaves the same
+	 * concrete state behind whatever it read, and stopping would only cost a
+	 * round trip through python. that only holds for a summary of the very
+	 * bytes unicorn runs, so one lifted to another size doesn't count.
+	 */
+	bool symbolic_read_harmless()
+	{
+		if (cur_block == NULL) {
+			bool exact;
+			if (this->vex_guest == VexArch_INVALID || cur_size <= 0 || this->find_block(cur_address, cur_size, exact) == NULL) {
+				return false;
+			}
+		}
+		return cur_block->loads_dead && cur_size > 0 && cur_block->size == (uint32_t)cur_size;
+	}
+
+	// Finds tainted data in the provided range and returns the address.
+	// Returns -1 if no tainted data is present.
+	uint64_t find_tainted(uint64_t address, int size)
+	{
+		PageBitmap *bitmap = page_lookup(address).bitmap;
+
+		int start = address & 0xFFF;
+		int end = (address + size - 1) & 0xFFF;
+
+		if (end >= start) {
+			if (bitmap) {
+				int i = bit_find_set(bitmap->symbolic, start, end + 1);
+				if (i != -1) {
+					return (address & ~0xFFF) + i;
+				}
+			}
+		} else {
+			// cross page boundary
+			if (bitmap) {
+				int i = bit_find_set(bitmap->symbolic, start, PAGE_SIZE);
+				if (i != -1) {
+					return (address & ~0xFFF) + i;
+				}
+			}
+
+			bitmap = page_lookup(address + size - 1).bitmap;
+			if (bitmap) {
+				int i = bit_find_set(bitmap->symbolic, 0, end + 1);
+				if (i != -1) {
+					return ((address + size - 1) & ~0xFFF) + i;
+				}
+			}
+		}
+
+		return -1;
+	}
+
+	//
+	// Native syscalls
+	//
+
+	void set_syscall(uint32_t sysno, syscall_handler_t handler, uint64_t bbl_addr) {
+		if (handler == SYSCALL_HANDLER_NONE) {
+			syscalls.erase(sysno);
+		} else {
+			syscalls[sysno] = {handler, bbl_addr};
+		}
+	}
+
+	void set_receive_data(uint32_t fd, const uint8_t *data, uint64_t size) {
+		receive_data[fd].assign(data, data + size);
+		receive_offset[fd] = 0;
+	}
+
+	void set_allocation(uint64_t base, uint64_t max_length, bool nx) {
+		allocation_enabled = true;
+		allocation_base = base;
+		max_allocation = max_length;
+		allocation_nx = nx;
+	}
+
+	void set_random_seed(uint64_t seed) {
+		random_state = seed;
+	}
+
+	void get_syscall_results(syscall_results_t *results) {
+		results->allocation_base = allocation_base;
+		results->random_state = random_state;
+		results->fdwait_time = fdwait_time;
+		results->receives = receive_records.size();
+		results->map_changes = map_changes.size();
+	}
+
+	/*
+	 * emulate the syscall of an int 0x80 if the table has a handler for it and
+	 * everything it reads is concrete. otherwise it is left to python, which
+	 * stops on it. arguments are passed in the CGC convention.
+	 */
+	void handle_syscall() {
+		// eax
+		if (symbolic_registers.find(8, 4) != -1) return;
+		uint32_t sysno;
+		uc_reg_read(uc, UC_X86_REG_EAX, &sysno);
+		auto entry = syscalls.find(sysno);
+		if (entry == syscalls.end()) {
+			return;
+		}
+
+		// ebx, ecx, edx, esi, edi, and their vex offsets
+		static const int arg_regs[5] = {UC_X86_REG_EBX, UC_X86_REG_ECX, UC_X86_REG_EDX, UC_X86_REG_ESI, UC_X86_REG_EDI};
+		static const uint64_t arg_offsets[5] = {20, 12, 16, 32, 36};
+		static const int arg_counts[] = {0, 4, 4, 5, 3, 2, 3};
+		uint32_t args[5];
+		for (int i = 0; i < arg_counts[entry->second.handler]; i++) {
+			if (symbolic_registers.find(arg_offsets[i], 4) != -1) return;
+			uc_reg_read(uc, arg_regs[i], &args[i]);
+		}
+
+		bool handled = false;
+		switch (entry->second.handler) {
+			case SYSCALL_HANDLER_TRANSMIT:
+				handled = syscall_transmit(entry->second.bbl_addr, args);
+				break;
+			case SYSCALL_HANDLER_RECEIVE:
+				handled = syscall_receive(entry->second.bbl_addr, args);
+				break;
+			case SYSCALL_HANDLER_FDWAIT:
+				handled = syscall_fdwait(entry->second.bbl_addr, args);
+				break;
+			case SYSCALL_HANDLER_ALLOCATE:
+				handled = syscall_allocate(entry->second.bbl_addr, args);
+				break;
+			case SYSCALL_HANDLER_DEALLOCATE:
+				handled = syscall_deallocate(entry->second.bbl_addr, args);
+				break;
+			case SYSCALL_HANDLER_RANDOM:
+				handled = syscall_random(entry->second.bbl_addr, args);
+				break;
+			default:
+				break;
+		}
+		if (!handled) {
+			return;
+		}
+
+		symbolic_registers.erase(8, 4);
+		interrupt_handled = true;
+		syscall_count++;
+		// a replay from an earlier checkpoint must not run this again
+		request_checkpoint();
+	}
+
+	/*
+	 * count the syscall as a step at bbl_addr, before any of its side effects.
+	 * returns false if that stopped execution, in which case it must not happen.
+	 */
+	bool begin_syscall(uint64_t bbl_addr) {
+		step(bbl_addr, 0, false);
+		commit();
+		return !stopped;
+	}
+
+	void syscall_return(uint32_t result) {
+		uc_reg_write(uc, UC_X86_REG_EAX, &result);
+	}
+
+	/*
+	 * whether nothing in [address, address + size) is symbolic
+	 */
+	bool concrete_range(uint64_t address, uint64_t size) {
+		while (size > 0) {
+			uint64_t length = std::min<uint64_t>(size, PAGE_SIZE - (address & 0xFFF));
+			if (find_tainted(address, length) != (uint64_t)-1) {
+				return false;
+			}
+			address += length;
+			size -= length;
+		}
+		return true;
+	}
+
+	/*
+	 * whether [address, address + size) is mapped writable and tracked in
+	 * active pages, mapping it through python first if needed. a syscall only
+	 * writes anything once all its outputs pass this, so it never fails halfway.
+	 */
+	bool syscall_writable(uint64_t address, uint64_t size) {
+		if (size == 0) {
+			return true;
+		}
+		if (address + size < address || address + size > (1ULL << 32)) {
+			return false;
+		}
+
+		uint64_t first = address & ~0xFFFULL, last = (address + size - 1) & ~0xFFFULL;
+		for (uint64_t page = first; page <= last; page += PAGE_SIZE) {
+			if (unmapped_range(page, PAGE_SIZE) && !py_mem_callback(uc, UC_MEM_WRITE_UNMAPPED, page, 1, 0, NULL)) {
+				return false;
+			}
+		}
+
+		uc_mem_region *regions;
+		uint32_t count;
+		if (uc_mem_regions(uc, &regions, &count) != UC_ERR_OK) {
+			return false;
+		}
+		bool writable = true;
+		for (uint64_t page = first; page <= last && writable; page += PAGE_SIZE) {
+			// pages mapped from the page cache are not active, and never writable anyway
+			writable = false;
+			for (uint32_t i = 0; i < count; i++) {
+				if (regions[i].begin <= page && page <= regions[i].end) {
+					writable = (regions[i].perms & UC_PROT_WRITE) != 0 && active_pages.lookup(page) != NULL;
+					break;
+				}
+			}
+		}
+		uc_free(regions);
+		return writable;
+	}
+
+	/*
+	 * whether the engine has nothing mapped in [address, address + size)
+	 */
+	bool unmapped_range(uint64_t address, uint64_t size) {
+		uc_mem_region *regions;
+		uint32_t count;
+		if (uc_mem_regions(uc, &regions, &count) != UC_ERR_OK) {
+			return false;
+		}
+		bool unmapped = true;
+		for (uint32_t i = 0; i < count && unmapped; i++) {
+			unmapped = regions[i].end < address || regions[i].begin >= address + size;
+		}
+		uc_free(regions);
+		return unmapped;
+	}
+
+	/*
+	 * the taint side of a syscall writing [address, address + size): the bytes
+	 * become concrete, and dirty unless direct-mapped. there is nothing to undo:
+	 * begin_syscall committed, and the next block commits in full.
+	 */
+	void write_taint(uint64_t address, uint64_t size) {
+		while (size > 0) {
+			int start = address & 0xFFF;
+			int length = (int)std::min<uint64_t>(std::min<uint64_t>(size, 64), PAGE_SIZE - start);
+			active_page_t *page = active_pages.lookup(address);
+			if (page != NULL) {
+				PageBitmap *bitmap = writable_bitmap(page);
+				uint64_t symbolic = bit_extract(bitmap->symbolic, start, length);
+				if (symbolic) {
+					symbolic_bytes -= bit_popcount64(symbolic);
+					bit_update(bitmap->symbolic, start, length, symbolic, false);
+					if (page->py_bitmap) {
+						for (int i = 0; i < length; i++) {
+							if ((symbolic >> i) & 1) page->py_bitmap[start + i] = TAINT_NONE;
+						}
+					}
+				}
+				if (page->data == NULL) {
+					bit_update(bitmap->dirty, start, length, ~0ULL, true);
+				}
+			}
+			address += length;
+			size -= length;
+		}
+	}
+
+	void syscall_write(uint64_t address, const void *data, uint64_t size) {
+		uc_mem_write(uc, address, data, size);
+		write_taint(address, size);
+	}
+
+	// transmit(fd, buf, count, tx_bytes)
+	bool syscall_transmit(uint64_t bbl_addr, const uint32_t *args) {
+		uint32_t fd = args[0], buf = args[1], count = args[2], tx_bytes = args[3];
+
+		// we won't try to handle fd 2 prints here, they are uncommon.
+		if (fd != 0 && fd != 1) {
+			return false;
+		}
+
+		// ensure that the memory we're sending is not tainted
+		uint64_t offset = transmit_arena.size();
+		transmit_arena.resize(offset + count);
+		if (uc_mem_read(uc, buf, transmit_arena.data() + offset, count) != UC_ERR_OK || !concrete_range(buf, count) ||
+				(tx_bytes != 0 && !syscall_writable(tx_bytes, 4)) || !begin_syscall(bbl_addr)) {
+			transmit_arena.resize(offset);
+			return false;
+		}
+
+		if (tx_bytes != 0) syscall_write(tx_bytes, &count, 4);
+		transmit_records.push_back({offset, count});
+		syscall_return(0);
+		return true;
+	}
+
+	// receive(fd, buf, count, rx_bytes), from the input preloaded for fd
+	bool syscall_receive(uint64_t bbl_addr, const uint32_t *args) {
+		uint32_t fd = args[0], buf = args[1], count = args[2], rx_bytes = args[3];
+
+		auto data = receive_data.find(fd);
+		if (count == 0 || data == receive_data.end()) {
+			return false;
+		}
+		uint64_t offset = receive_offset[fd];
+		if (offset == data->second.size()) {
+			// out of input: python makes it symbolic
+			return false;
+		}
+
+		// the buffer is checked like the receive simprocedure does. it is the one to figure out other errors.
+		if ((uint64_t)buf + count > 0xc0000000) {
+			if (!begin_syscall(bbl_addr)) return false;
+			syscall_return(2);
+			return true;
+		}
+		uint32_t length = (uint32_t)std::min<uint64_t>(count, data->second.size() - offset);
+		if (!syscall_writable(buf, length) || (rx_bytes != 0 && !syscall_writable(rx_bytes, 4)) ||
+				!begin_syscall(bbl_addr)) {
+			return false;
+		}
+
+		syscall_write(buf, &data->second[offset], length);
+		if (rx_bytes != 0) syscall_write(rx_bytes, &length, 4);
+		receive_offset[fd] = offset + length;
+		receive_records.push_back({fd, length});
+		syscall_return(0);
+		return true;
+	}
+
+	// fdwait(nfds, readfds, writefds, timeout, readyfds), with every fd below nfds always ready
+	bool syscall_fdwait(uint64_t bbl_addr, const uint32_t *args) {
+		uint32_t nfds = args[0], readfds = args[1], writefds = args[2], timeout = args[3], readyfds = args[4];
+
+		uint32_t ready = std::min<uint32_t>(nfds, 32);
+		uint32_t tv[2] = {0, 0};
+		if (ready == 0 && timeout != 0 && (uc_mem_read(uc, timeout, tv, sizeof(tv)) != UC_ERR_OK || !concrete_range(timeout, sizeof(tv)))) {
+			return false;
+		}
+		if ((readfds != 0 && !syscall_writable(readfds, 4)) || (writefds != 0 && !syscall_writable(writefds, 4)) ||
+				(readyfds != 0 && !syscall_writable(readyfds, 4)) || !begin_syscall(bbl_addr)) {
+			return false;
+		}
+
+		// like the simprocedure, the fd sets are stored as big endian words with fd 0 in the top bit
+		uint32_t bits = ready == 32 ? ~0U : ~(~0U >> ready);
+		uint8_t set[4] = {(uint8_t)(bits >> 24), (uint8_t)(bits >> 16), (uint8_t)(bits >> 8), (uint8_t)bits};
+		if (readfds != 0) syscall_write(readfds, set, 4);
+		if (writefds != 0) syscall_write(writefds, set, 4);
+		uint32_t total = ready * 2;
+		if (readyfds != 0) syscall_write(readyfds, &total, 4);
+		if (total == 0) {
+			fdwait_time += (uint64_t)tv[0] * 1000000 + tv[1];
+		}
+		syscall_return(0);
+		return true;
+	}
+
+	// allocate(length, is_x, addr), growing down from allocation_base
+	bool syscall_allocate(uint64_t bbl_addr, const uint32_t *args) {
+		uint32_t length = args[0], is_x = args[1], addr = args[2];
+
+		if (!allocation_enabled) {
+			return false;
+		}
+		if (length == 0 || length > max_allocation || addr == 0) {
+			if (!begin_syscall(bbl_addr)) return false;
+			syscall_return(addr == 0 && length != 0 && length <= max_allocation ? 2 : 3);
+			return true;
+		}
+
+		uint64_t aligned = ((uint64_t)length + 0xFFF) & ~0xFFFULL;
+		if (aligned + PAGE_SIZE > allocation_base) {
+			return false;
+		}
+		uint64_t chosen = allocation_base - aligned;
+		if (!unmapped_range(chosen, aligned) || !syscall_writable(addr, 4) || !begin_syscall(bbl_addr)) {
+			return false;
+		}
+
+		// python maps the region with these permissions, and _map_one_page adds exec without NX
+		uint32_t perms = UC_PROT_READ | UC_PROT_WRITE | (is_x ? UC_PROT_EXEC : 0);
+		if (uc_mem_map(uc, chosen, aligned, allocation_nx ? perms : perms | UC_PROT_EXEC) != UC_ERR_OK) {
+			// nothing else is mapped there, so this is out of memory
+			syscall_return(4);
 			return true;
 		}
+		static uint8_t clean[PAGE_SIZE];
+		for (uint64_t page = chosen; page < chosen + aligned; page += PAGE_SIZE) {
+			page_activate(page, clean, NULL);
+		}
 
-		// check if it's in the cache already
-		RegisterSet *clobbered_registers;
-		RegisterSet *used_registers;
-		auto search = this->block_cache->find(address);
-		if (search != this->block_cache->end()) {
-			if (!search->second.try_unicorn) {
-				return false;
-			}
-			clobbered_registers = &search->second.clobbered_registers;
-			used_registers = &search->second.used_registers;
-		} else {
-			// wtf i hate c++...
-			VexRegisterUpdates pxControl = VexRegUpdUnwindregsAtMemAccess;
-			auto& entry = this->block_cache->emplace(std::make_pair(address, block_entry_t())).first->second;
-			entry.try_unicorn = true;
-			clobbered_registers = &entry.clobbered_registers;
-			used_registers = &entry.used_registers;
-
-			std::unique_ptr<uint8_t[]> instructions(new uint8_t[size]);
-			uc_mem_read(this->uc, address, instructions.get(), size);
-			VEXLiftResult *lift_ret = vex_lift(
-					this->vex_guest, this->vex_archinfo, instructions.get(), address, 99, size, 1, 0, 0, 1, 0,
-					pxControl
-					);
-
-
-			if (lift_ret == NULL) {
-				// TODO: how to handle?
-				return false;
-			}
+		uint32_t result = (uint32_t)chosen;
+		syscall_write(addr, &result, 4);
+		allocation_base = chosen;
+		allocations.push_back(std::make_pair(chosen, aligned));
+		map_changes.push_back({chosen, aligned, perms});
+		syscall_return(0);
+		return true;
+	}
 
-			IRSB *the_block = lift_ret->irsb;
+	// deallocate(addr, length), only of memory allocated natively in this run
+	bool syscall_deallocate(uint64_t bbl_addr, const uint32_t *args) {
+		uint32_t addr = args[0], length = args[1];
 
-			for (int i = 0; i < the_block->stmts_used; i++) {
-				if (!this->check_stmt(clobbered_registers, used_registers, the_block->tyenv, the_block->stmts[i])) {
-					entry.try_unicorn = false;
-					return false;
-				}
-			}
+		if ((addr & 0xFFF) != 0 || length == 0 || addr == 0 || (uint32_t)(addr + length) == 0) {
+			if (!begin_syscall(bbl_addr)) return false;
+			syscall_return(3);
+			return true;
+		}
 
-			if (!this->check_expr(clobbered_registers, used_registers, the_block->next)) {
-				entry.try_unicorn = false;
-				return false;
+		uint64_t aligned = ((uint64_t)length + 0xFFF) & ~0xFFFULL;
+		auto it = allocations.begin();
+		for (; it != allocations.end(); it++) {
+			if (it->first <= addr && addr + aligned <= it->first + it->second) {
+				break;
 			}
 		}
+		if (it == allocations.end() || !begin_syscall(bbl_addr)) {
+			return false;
+		}
 
-		for (uint64_t off : this->symbolic_registers) {
-			if (used_registers->count(off) > 0) {
-				stopping_register = off;
-				return false;
+		uc_mem_unmap(uc, addr, aligned);
+		for (uint64_t page = addr; page < addr + aligned; page += PAGE_SIZE) {
+			active_page_t entry = active_pages.erase(page);
+			if (entry.bitmap != NULL) {
+				for (int w = 0; w < PAGE_BITMAP_WORDS; w++) {
+					symbolic_bytes -= bit_popcount64(entry.bitmap->symbolic[w]);
+				}
+				release_bitmap(entry.bitmap);
 			}
 		}
 
-		for (uint64_t off : *clobbered_registers) {
-			this->symbolic_registers.erase(off);
-		}
+		// keep what is left of the allocation around
+		uint64_t begin = it->first, end = it->first + it->second;
+		allocations.erase(it);
+		if (begin < addr) allocations.push_back(std::make_pair(begin, addr - begin));
+		if (addr + aligned < end) allocations.push_back(std::make_pair(addr + aligned, end - addr - aligned));
 
+		map_changes.push_back({addr, aligned, 0});
+		// python turns the region into a sinkhole, which its allocate reuses before going below allocation_base
+		allocation_enabled = false;
+		syscall_return(0);
 		return true;
 	}
 
-	// Finds tainted data in the provided range and returns the address.
-	// Returns -1 if no tainted data is present.
-	uint64_t find_tainted(uint64_t address, int size)
-	{
-		taint_t *bitmap = page_lookup(address).first;
-
-		int start = address & 0xFFF;
-		int end = (address + size - 1) & 0xFFF;
-
-		if (end >= start) {
-			if (bitmap) {
-				for (int i = start; i <= end; i++) {
-					if (bitmap[i] & TAINT_SYMBOLIC) {
-						return (address & ~0xFFF) + i;
-					}
-				}
-			}
-		} else {
-			// cross page boundary
-			if (bitmap) {
-				for (int i = start; i <= 0xFFF; i++) {
-					if (bitmap[i] & TAINT_SYMBOLIC) {
-						return (address & ~0xFFF) + i;
-					}
-				}
-			}
+	// random(buf, count, rnd_bytes), from a splitmix64 stream
+	bool syscall_random(uint64_t bbl_addr, const uint32_t *args) {
+		uint32_t buf = args[0], count = args[1], rnd_bytes = args[2];
 
-			bitmap = page_lookup(address + size - 1).first;
-			if (bitmap) {
-				for (int i = 0; i <= end; i++) {
-					if (bitmap[i] & TAINT_SYMBOLIC) {
-						return ((address + size - 1) & ~0xFFF) + i;
-					}
-				}
-			}
+		if (buf == 0) {
+			if (!begin_syscall(bbl_addr)) return false;
+			syscall_return(2);
+			return true;
+		}
+		if (!syscall_writable(buf, count) || (rnd_bytes != 0 && !syscall_writable(rnd_bytes, 4)) || !begin_syscall(bbl_addr)) {
+			return false;
 		}
 
-		return -1;
+		std::vector<uint8_t> bytes(count);
+		for (uint32_t i = 0; i < count; i += 8) {
+			random_state += 0x9E3779B97F4A7C15ULL;
+			uint64_t z = random_state;
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+			z ^= z >> 31;
+			memcpy(&bytes[i], &z, std::min<uint32_t>(8, count - i));
+		}
+		syscall_write(buf, bytes.data(), count);
+		if (rnd_bytes != 0) syscall_write(rnd_bytes, &count, 4);
+		syscall_return(0);
+		return true;
 	}
 
 	void handle_write(uint64_t address, int size) {
@@ -943,6 +4310,11 @@ public:
 
 	    // From here, we are definitely only dealing with one page
 
+		if (undo_log) {
+			handle_write_undo_log(address, size);
+			return;
+		}
+
 		mem_access_t record;
 		record.address = address;
 		record.size = size;
@@ -957,41 +4329,110 @@ public:
 		    return;
 		}
 
-		auto pair = page_lookup(address);
-		taint_t *bitmap = pair.first;
-		uint8_t *data = pair.second;
+		active_page_t *page = active_pages.lookup(address);
 		int start = address & 0xFFF;
-		int end = (address + size - 1) & 0xFFF;
-		short clean;
+		uint64_t clean;
 
-		if (!bitmap) {
+		if (page == NULL) {
 		    // We should never have a missing bitmap because we explicitly called the callback!
 		    printf("This should never happen, right? %#" PRIx64 "\n", address);
 		    abort();
 		}
+		PageBitmap *bitmap = writable_bitmap(page);
 
-        clean = 0;
-        if (data == NULL) {
-            for (int i = start; i <= end; i++) {
-                if (bitmap[i] != TAINT_DIRTY) {
-                    clean |= 1 << i; // this bit should not be marked as taint if we undo this action
-                    bitmap[i] = TAINT_DIRTY;
-                }
-            }
-        } else {
-            for (int i = start; i <= end; i++) {
-                if (bitmap[i] == TAINT_NONE) {
-                    clean |= 1 << (i - start);
-                } else {
-                    bitmap[i] = TAINT_NONE;
-                }
-            }
-        }
+		// clean marks the bytes that should not be marked as taint if we undo this action
+		uint64_t symbolic = bit_extract(bitmap->symbolic, start, size);
+		if (page->data == NULL) {
+			clean = ~bit_extract(bitmap->dirty, start, size);
+			bit_update(bitmap->dirty, start, size, ~0ULL, true);
+		} else {
+			clean = ~symbolic;
+		}
+		if (symbolic) {
+			symbolic_bytes -= bit_popcount64(symbolic);
+			bit_update(bitmap->symbolic, start, size, symbolic, false);
+			if (page->py_bitmap) {
+				for (int i = 0; i < size; i++) {
+					if ((symbolic >> i) & 1) page->py_bitmap[start + i] = TAINT_NONE;
+				}
+			}
+		}
+		if (size < 64) clean &= (1ULL << size) - 1;
 
 		record.clean = clean;
 		mem_writes.push_back(record);
 	}
 
+	/*
+	 * undo log version of handle_write for a write within one page: the first
+	 * write to each cache line in this block saves the whole line, instead of
+	 * reading the old value of every single store.
+	 */
+	void handle_write_undo_log(uint64_t address, int size) {
+		active_page_t *page = active_pages.lookup(address);
+		if (page == NULL) {
+			uint8_t probe;
+			uc_err err = uc_mem_read(uc, address, &probe, 1);
+			if (err == UC_ERR_READ_UNMAPPED) {
+				if (py_mem_callback(uc, UC_MEM_WRITE_UNMAPPED, address, size, 0, (void*)1)) {
+					err = UC_ERR_OK;
+				}
+			}
+			if (err) {
+				stop(STOP_ERROR);
+				return;
+			}
+			page = active_pages.lookup(address);
+		}
+
+		if (page == NULL) {
+		    // We should never have a missing bitmap because we explicitly called the callback!
+		    printf("This should never happen, right? %#" PRIx64 "\n", address);
+		    abort();
+		}
+
+		PageBitmap *bitmap = writable_bitmap(page);
+		uint64_t page_address = address & ~0xFFFULL;
+		int start = address & 0xFFF;
+
+		if (page->undo_epoch != undo_epoch) {
+			page->undo_epoch = undo_epoch;
+			page->undo_lines = 0;
+		}
+
+		for (int word = start / UNDO_LINE_SIZE; word <= (start + size - 1) / UNDO_LINE_SIZE; word++) {
+			if ((page->undo_lines >> word) & 1) {
+				continue;
+			}
+			page->undo_lines |= 1ULL << word;
+
+			undo_lines.emplace_back();
+			undo_line_t *line = &undo_lines.back();
+			line->address = page_address + word * UNDO_LINE_SIZE;
+			line->symbolic = bitmap->symbolic[word];
+			line->dirty = bitmap->dirty[word];
+			if (page->data != NULL) {
+				memcpy(line->data, &page->data[word * UNDO_LINE_SIZE], UNDO_LINE_SIZE);
+			} else {
+				uc_mem_read(uc, line->address, line->data, UNDO_LINE_SIZE);
+			}
+		}
+
+		if (page->data == NULL) {
+			bit_update(bitmap->dirty, start, size, ~0ULL, true);
+		}
+		uint64_t symbolic = bit_extract(bitmap->symbolic, start, size);
+		if (symbolic) {
+			symbolic_bytes -= bit_popcount64(symbolic);
+			bit_update(bitmap->symbolic, start, size, symbolic, false);
+			if (page->py_bitmap) {
+				for (int i = 0; i < size; i++) {
+					if ((symbolic >> i) & 1) page->py_bitmap[start + i] = TAINT_NONE;
+				}
+			}
+		}
+	}
+
 	inline unsigned int arch_pc_reg() {
 		switch (arch) {
 			case UC_ARCH_X86:
@@ -1061,179 +4502,556 @@ public:
 	}
 };
 
+// a block to lift ahead of time: its address, and how much code there is from there on
+typedef struct prelift_block {
+	uint64_t address;
+	uint64_t size;
+} prelift_block_t;
+
+/*
+ * Lifts blocks for the block caches on a thread of its own, before unicorn
+ * gets to them, so that check_block finds them cached instead of waiting on
+ * VEX. Python hands over the blocks of a CFG along with their code, and they
+ * are lifted in full in the order given. Each block is lifted from its
+ * address until VEX ends the block, which has to be where unicorn ends it
+ * for the result to be of use: the results go to a cache of their own, and
+ * check_block only takes one whose size matches the block unicorn executes.
+ * Only the hand-off into that cache takes the key's lock. The lifts take
+ * vex_lift_lock, which python holds around its own lifts as well.
+ *
+ * The worker is started by the first submit and stopped by shutdown, which
+ * drops the jobs not done yet and joins it.
+ */
+class Prelifter {
+private:
+	typedef struct job {
+		caches_t *caches;
+		VexArch guest;
+		VexArchInfo archinfo;
+		std::vector<prelift_block_t> blocks;
+		std::vector<uint8_t> code;
+	} job_t;
+
+	std::mutex lock;
+	std::condition_variable wake;
+	std::list<job_t *> jobs;
+	std::atomic<uint64_t> blocks_pending;
+	std::atomic<bool> stopping;
+	std::thread worker;
+
+	// the running one, if any
+	static std::mutex instance_lock;
+	static Prelifter *instance;
+
+	Prelifter() : blocks_pending(0), stopping(false) {
+		worker = std::thread(&Prelifter::run, this);
+	}
+
+	~Prelifter() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		wake.notify_one();
+		worker.join();
+
+		cache_counters_t counters;
+		memset(&counters, 0, sizeof(counters));
+		for (job_t *job : jobs) {
+			finish(job, counters);
+		}
+		jobs.clear();
+	}
+
+	void finish(job_t *job, const cache_counters_t &counters) {
+		job->caches->registry->release(job->caches, counters);
+		blocks_pending -= job->blocks.size();
+		delete job;
+	}
+
+	void run() {
+		for (;;) {
+			job_t *job;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				wake.wait(guard, [this] { return stopping || !jobs.empty(); });
+				if (stopping) {
+					return;
+				}
+				job = jobs.front();
+				jobs.pop_front();
+			}
+
+			cache_counters_t counters;
+			memset(&counters, 0, sizeof(counters));
+			uint64_t offset = 0;
+			for (auto &block : job->blocks) {
+				if (stopping) {
+					break;
+				}
+				uint8_t *code = job->code.data() + offset;
+				offset += block.size;
+
+				bool cached;
+				{
+					std::lock_guard<std::mutex> guard(job->caches->lock);
+					cached = job->caches->block_cache->count(block.address) != 0 ||
+						job->caches->prelift_cache->count(block.address) != 0;
+				}
+				block_entry_t entry;
+				if (!cached && State::summarize_block(job->guest, job->archinfo, code, block.address, (int32_t)block.size, 1, entry)) {
+					State::publish_block(job->caches, job->caches->prelift_cache, block.address, entry);
+					counters.blocks_prelifted++;
+				}
+			}
+
+			finish(job, counters);
+		}
+	}
+
+public:
+	// queue the blocks, starting the worker if it isn't running. returns the number of blocks waiting, these included.
+	static uint64_t submit(CacheRegistry *context, uint64_t cache_key, VexArch guest, VexArchInfo archinfo, uint64_t count, prelift_block_t *blocks, uint8_t *code) {
+		job_t *job = new job_t();
+		job->caches = context->acquire(cache_key, NULL);
+		job->guest = guest;
+		job->archinfo = archinfo;
+		job->blocks.assign(blocks, blocks + count);
+		uint64_t size = 0;
+		for (uint64_t i = 0; i < count; i++) {
+			size += blocks[i].size;
+		}
+		job->code.assign(code, code + size);
+
+		std::lock_guard<std::mutex> instance_guard(instance_lock);
+		if (instance == NULL) {
+			instance = new Prelifter();
+		}
+		uint64_t pending = instance->blocks_pending += count;
+		{
+			std::lock_guard<std::mutex> guard(instance->lock);
+			instance->jobs.push_back(job);
+		}
+		instance->wake.notify_one();
+		return pending;
+	}
+
+	// stop the worker, if it's running, dropping what it hasn't lifted yet
+	static void shutdown() {
+		std::lock_guard<std::mutex> guard(instance_lock);
+		delete instance;
+		instance = NULL;
+	}
+
+	static uint64_t pending() {
+		std::lock_guard<std::mutex> guard(instance_lock);
+		return instance == NULL ? 0 : instance->blocks_pending.load();
+	}
+};
+
+std::mutex Prelifter::instance_lock;
+Prelifter *Prelifter::instance = NULL;
+
 static void hook_mem_read(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, void *user_data) {
 	// uc_mem_read(uc, address, &value, size);
 	// //LOG_D("mem_read [%#lx, %#lx] = %#lx", address, address + size);
-	//LOG_D("mem_read [%#lx, %#lx]", address, address + size);
+	LOG_D("mem_read [%#" PRIx64 ", %#" PRIx64 "]", address, address + size);
+	State *state = (State *)user_data;
+	ProfileTimer timer(&state->profiler, PROFILE_HOOK_MEM_READ);
+
+	auto tainted = state->find_tainted(address, size);
+	if (tainted != -1 && !state->symbolic_read_harmless())
+	{
+		state->stopping_memory = tainted;
+		state->stop(STOP_SYMBOLIC_MEM);
+	}
+}
+
+/*
+ * the goal of hooking memory write is to determine the exact
+ * positions of dirty bytes to writing chaneges back to angr
+ * state. However if the hook is hit before mapping requested
+ * page (as writable), we cannot find the bitmap for this page.
+ * In this case, just mark all the position as clean (before
+ * this access).
+ */
+
+static void hook_mem_write(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, void *user_data) {
+	LOG_D("mem_write [%#" PRIx64 ", %#" PRIx64 "]", address, address + size);
+	State *state = (State *)user_data;
+	ProfileTimer timer(&state->profiler, PROFILE_HOOK_MEM_WRITE);
+
+	if (state->ignore_next_selfmod) {
+		// ...the self-modification gets repeated for internal qemu reasons
+		state->ignore_next_selfmod = false;
+	} else if ((address >= state->cur_address && address < state->cur_address + state->cur_size) ||
+		// CODE IS SELF-MODIFYING: qemu will restart this basic block at this address.
+		// discard the next block hook
+		(state->cur_address >= address && state->cur_address < address + size)) {
+		state->ignore_next_block = true;
+	}
+
+	state->handle_write(address, size);
+}
+
+static void hook_block(uc_engine *uc, uint64_t address, int32_t size, void *user_data) {
+	LOG_D("block [%#" PRIx64 ", %#" PRIx64 "]", address, address + size);
+
+	State *state = (State *)user_data;
+	ProfileTimer timer(&state->profiler, PROFILE_HOOK_BLOCK);
+	if (state->coverage_only) {
+		// nothing to commit: no memory actions are tracked
+		state->cur_steps++;
+		state->step(address, size);
+		return;
+	}
+	if (state->ignore_next_block) {
+		state->ignore_next_block = false;
+		state->ignore_next_selfmod = true;
+		// qemu starts over partway into the block, so what we know about it no longer applies
+		state->cur_block = &unknown_block;
+		return;
+	}
+	if (state->is_replaying()) {
+		state->replay_block();
+		return;
+	}
+	state->commit_block(address);
+	state->step(address, size);
+
+	if (!state->stopped && !state->check_block(address, size)) {
+		state->profiler.record_rejection(address);
+		state->stop(STOP_SYMBOLIC_REG);
+		LOG_I("finishing early at address %#" PRIx64, address);
+	}
+}
+
+static void hook_intr(uc_engine *uc, uint32_t intno, void *user_data) {
+	State *state = (State *)user_data;
+	ProfileTimer timer(&state->profiler, PROFILE_HOOK_INTR);
+	state->interrupt_handled = false;
+
+	if (state->arch == UC_ARCH_X86 && intno == 0x80) {
+		// the syscalls python put in the table, e.g. the cgc ones
+		state->handle_syscall();
+	}
+}
+
+static bool hook_mem_unmapped(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, void *user_data) {
+	State *state = (State *)user_data;
+	ProfileTimer timer(&state->profiler, PROFILE_HOOK_MEM_UNMAPPED);
+	uint64_t start = address & ~0xFFFULL;
+	uint64_t end = (address + size - 1) & ~0xFFFULL;
+
+	// only hook nonwritable pages
+	if (type != UC_MEM_WRITE_UNMAPPED && state->map_cache(start, 0x1000) && (start == end || state->map_cache(end, 0x1000))) {
+		LOG_D("handle unmapped page natively");
+		return true;
+	}
+
+	// with scoped hooks, the read or write hook never saw an access outside the hooked chunks.
+	// map the page through python right away and then treat the access as the hook would.
+	if ((type == UC_MEM_READ_UNMAPPED || type == UC_MEM_WRITE_UNMAPPED) && !state->mem_hooked(address)) {
+		if (!state->py_mem_callback(uc, type, address, size, value, NULL)) {
+			return false;
+		}
+		if (type == UC_MEM_WRITE_UNMAPPED) {
+			hook_mem_write(uc, UC_MEM_WRITE, address, size, value, user_data);
+		} else {
+			hook_mem_read(uc, UC_MEM_READ, address, size, value, user_data);
+		}
+		return true;
+	}
+
+	return false;
+}
+
+static bool hook_mem_prot(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, void *user_data) {
 	State *state = (State *)user_data;
+	ProfileTimer timer(&state->profiler, PROFILE_HOOK_MEM_PROT);
+	//printf("Segfault data: %d %#llx %d %#llx\n", type, address, size, value);
+	if (type == UC_MEM_WRITE_PROT && state->open_guards(address, size, value)) {
+		return true;
+	}
+	state->stop(STOP_SEGFAULT);
+	return true;
+}
+
+/*
+ * C style bindings makes it simple and dirty
+ */
+
+/*
+ * a State for the engine uc, opened with arch and mode, using the caches of cache_key in the default context.
+ */
+extern "C"
+State *simunicorn_alloc(uc_engine *uc, uint64_t cache_key, uc_arch arch, uc_mode mode) {
+	State *state = new State(&global_cache, uc, cache_key, arch, mode);
+	return state;
+}
+
+/*
+ * a cache context of its own: the States allocated in it share caches with
+ * each other by cache key, but not with the rest of the process, and it has
+ * its own budget. States in any contexts may run on different threads at the
+ * same time, each on an engine of its own.
+ */
+extern "C"
+CacheRegistry *simunicorn_context_alloc() {
+	return new CacheRegistry();
+}
+
+/*
+ * free a context and all its caches. its States must be deallocated and their
+ * engines closed first.
+ */
+extern "C"
+void simunicorn_context_free(CacheRegistry *context) {
+	delete context;
+}
+
+extern "C"
+State *simunicorn_context_alloc_state(CacheRegistry *context, uc_engine *uc, uint64_t cache_key, uc_arch arch, uc_mode mode) {
+	return new State(context, uc, cache_key, arch, mode);
+}
+
+extern "C"
+void simunicorn_context_set_budget(CacheRegistry *context, uint64_t bytes) {
+	context->set_budget(bytes);
+}
 
-	auto tainted = state->find_tainted(address, size);
-	if (tainted != -1)
-	{
-		state->stopping_memory = tainted;
-		state->stop(STOP_SYMBOLIC_MEM);
-	}
+extern "C"
+void simunicorn_context_stats(CacheRegistry *context, cache_stats_t *out) {
+	context->get_stats(out);
 }
 
 /*
- * the goal of hooking memory write is to determine the exact
- * positions of dirty bytes to writing chaneges back to angr
- * state. However if the hook is hit before mapping requested
- * page (as writable), we cannot find the bitmap for this page.
- * In this case, just mark all the position as clean (before
- * this access).
+ * clone parent, between two runs, onto the engine uc; see State::fork.
  */
+extern "C"
+State *simunicorn_fork(State *parent, uc_engine *uc) {
+	return State::fork(parent, uc);
+}
 
-static void hook_mem_write(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, void *user_data) {
-	//LOG_D("mem_write [%#lx, %#lx]", address, address + size);
-	State *state = (State *)user_data;
+extern "C"
+void simunicorn_dealloc(State *state) {
+	delete state;
+}
 
-	if (state->ignore_next_selfmod) {
-		// ...the self-modification gets repeated for internal qemu reasons
-		state->ignore_next_selfmod = false;
-	} else if ((address >= state->cur_address && address < state->cur_address + state->cur_size) ||
-		// CODE IS SELF-MODIFYING: qemu will restart this basic block at this address.
-		// discard the next block hook
-		(state->cur_address >= address && state->cur_address < address + size)) {
-		state->ignore_next_block = true;
-	}
+//
+// Cache management. every export on a cache key has a simunicorn_context_ version for the keys of a context of its
+// own, and one for the default context.
+//
 
-	state->handle_write(address, size);
+extern "C"
+int64_t simunicorn_context_load_block_cache(CacheRegistry *context, uint64_t cache_key, const char *path, uint64_t binary_hash) {
+	caches_t *caches = context->acquire(cache_key, NULL);
+	int64_t count = load_block_cache(caches, path, binary_hash);
+	// under a budget, what was just loaded would be evicted before anything used it
+	context->release(caches, cache_counters_t(), count > 0);
+	return count;
 }
 
-static void hook_block(uc_engine *uc, uint64_t address, int32_t size, void *user_data) {
-	//LOG_I("block [%#lx, %#lx]", address, address + size);
+extern "C"
+int64_t simunicorn_load_block_cache(uint64_t cache_key, const char *path, uint64_t binary_hash) {
+	return simunicorn_context_load_block_cache(&global_cache, cache_key, path, binary_hash);
+}
 
-	State *state = (State *)user_data;
-	if (state->ignore_next_block) {
-		state->ignore_next_block = false;
-		state->ignore_next_selfmod = true;
-		return;
-	}
-	state->commit();
-	state->step(address, size);
+extern "C"
+int64_t simunicorn_context_save_block_cache(CacheRegistry *context, uint64_t cache_key, const char *path, uint64_t binary_hash) {
+	caches_t *caches = context->acquire(cache_key, NULL);
+	int64_t count = save_block_cache(caches, path, binary_hash);
+	context->release(caches, cache_counters_t());
+	return count;
+}
 
-	if (!state->stopped && !state->check_block(address, size)) {
-		state->stop(STOP_SYMBOLIC_REG);
-		//LOG_I("finishing early at address %#lx", address);
-	}
+extern "C"
+int64_t simunicorn_save_block_cache(uint64_t cache_key, const char *path, uint64_t binary_hash) {
+	return simunicorn_context_save_block_cache(&global_cache, cache_key, path, binary_hash);
 }
 
-static void hook_intr(uc_engine *uc, uint32_t intno, void *user_data) {
-	State *state = (State *)user_data;
-	state->interrupt_handled = false;
+/*
+ * copy the stats of up to max of the addresses that unicorn runs of cache_key started at to out, see entry_stats_t.
+ * returns the number of addresses there are stats for.
+ */
+extern "C"
+uint64_t simunicorn_context_entry_stats(CacheRegistry *context, uint64_t cache_key, entry_stats_t *out, uint64_t max) {
+	uint64_t count = 0;
+	context->peek(cache_key, [&](caches_t *caches) {
+		std::lock_guard<std::mutex> guard(caches->lock);
+		count = caches->entry_stats->size();
+		uint64_t i = 0;
+		for (auto it = caches->entry_stats->begin(); it != caches->entry_stats->end() && i < max; it++) {
+			out[i++] = it->second;
+		}
+	});
+	return count;
+}
 
-	if (state->arch == UC_ARCH_X86 && intno == 0x80) {
-		// this is the ultimate hack for cgc -- it must be enabled by explitly setting the transmit sysno from python
-		// basically an implementation of the cgc transmit syscall
+extern "C"
+uint64_t simunicorn_entry_stats(uint64_t cache_key, entry_stats_t *out, uint64_t max) {
+	return simunicorn_context_entry_stats(&global_cache, cache_key, out, max);
+}
 
-		for (auto sr : state->symbolic_registers)
-		{
-			// eax,ecx,edx,ebx,esi
-			if ((sr >= 8 && sr <= 23) || (sr >= 32 && sr <= 35)) return;
+/*
+ * whether to leave unicorn out when at address: it's not worth going in when
+ * each of the last min_runs runs from there stopped before executing
+ * short_run blocks, for a reason other than running out of steps. such an
+ * address is still given another try after being passed on retry_interval
+ * times, in case things changed, and a run that goes further clears it.
+ */
+extern "C"
+bool simunicorn_context_skip_entry(CacheRegistry *context, uint64_t cache_key, uint64_t address, uint64_t short_run, uint64_t min_runs, uint64_t retry_interval) {
+	bool skip = false;
+	// a key with no caches has no stats, and asking shouldn't make it some
+	context->peek(cache_key, [&](caches_t *caches) {
+		std::lock_guard<std::mutex> guard(caches->lock);
+		auto it = caches->entry_stats->find(address);
+		if (it != caches->entry_stats->end() && min_runs > 0 && min_runs <= ENTRY_RECENT_RUNS && it->second.runs >= min_runs) {
+			entry_stats_t &entry = it->second;
+			skip = true;
+			for (uint64_t i = 0; i < min_runs && skip; i++) {
+				skip = entry.recent_steps[i] < short_run && entry.recent_stops[i] != STOP_NORMAL;
+			}
+			if (skip && ++entry.skips > retry_interval) {
+				entry.skips = 0;
+				skip = false;
+			}
 		}
+	});
+	return skip;
+}
 
-		uint32_t sysno;
-		uc_reg_read(uc, UC_X86_REG_EAX, &sysno);
-		//printf("SYSCALL: %d\n", sysno);
-		if (sysno == state->transmit_sysno) {
-			//printf(".. TRANSMIT!\n");
-			uint32_t fd, buf, count, tx_bytes;
+extern "C"
+bool simunicorn_skip_entry(uint64_t cache_key, uint64_t address, uint64_t short_run, uint64_t min_runs, uint64_t retry_interval) {
+	return simunicorn_context_skip_entry(&global_cache, cache_key, address, short_run, min_runs, retry_interval);
+}
 
-			uc_reg_read(uc, UC_X86_REG_EBX, &fd);
+/*
+ * queue count blocks of cache_key to be lifted in the background, see Prelifter. the code of each block is in code,
+ * one after the other. returns the number of blocks waiting to be lifted, these included.
+ */
+extern "C"
+uint64_t simunicorn_context_prelift(CacheRegistry *context, uint64_t cache_key, VexArch guest, VexArchInfo archinfo, uint64_t count, prelift_block_t *blocks, uint8_t *code) {
+	return Prelifter::submit(context, cache_key, guest, archinfo, count, blocks, code);
+}
 
-			if (fd == 2) {
-				// we won't try to handle fd 2 prints here, they are uncommon.
-				return;
-			} else if (fd == 0 || fd == 1) {
-				uc_reg_read(uc, UC_X86_REG_ECX, &buf);
-				uc_reg_read(uc, UC_X86_REG_EDX, &count);
-				uc_reg_read(uc, UC_X86_REG_ESI, &tx_bytes);
-
-				// ensure that the memory we're sending is not tainted
-				void *dup_buf = malloc(count);
-				uint32_t tmp_tx;
-				if (uc_mem_read(uc, buf, dup_buf, count) != UC_ERR_OK)
-				{
-					//printf("... fault on buf\n");
-					free(dup_buf);
-					return;
-				}
+extern "C"
+uint64_t simunicorn_prelift(uint64_t cache_key, VexArch guest, VexArchInfo archinfo, uint64_t count, prelift_block_t *blocks, uint8_t *code) {
+	return simunicorn_context_prelift(&global_cache, cache_key, guest, archinfo, count, blocks, code);
+}
 
-				if (tx_bytes != 0 && uc_mem_read(uc, tx_bytes, &tmp_tx, 4) != UC_ERR_OK)
-				{
-					//printf("... fault on tx\n");
-					free(dup_buf);
-					return;
-				}
+// the number of blocks still waiting to be lifted in the background
+extern "C"
+uint64_t simunicorn_prelift_pending() {
+	return Prelifter::pending();
+}
 
-				if (state->find_tainted(buf, count) != -1)
-				{
-					//printf("... symbolic data\n");
-					free(dup_buf);
-					return;
-				}
+/*
+ * stop the background lifting, dropping the blocks still waiting, and join its thread. the next simunicorn_prelift
+ * starts it again.
+ */
+extern "C"
+void simunicorn_prelift_shutdown() {
+	Prelifter::shutdown();
+}
 
-				state->step(state->transmit_bbl_addr, 0, false);
-				state->commit();
-				if (state->stopped)
-				{
-					//printf("... stopped after step()\n");
-					free(dup_buf);
-					return;
-				}
+/*
+ * take and drop vex_lift_lock from python, around the lifts it does itself, so that they never run in libvex at the
+ * same time as the background lifts. both calls must come from the same thread.
+ */
+extern "C"
+void simunicorn_vex_lock() {
+	vex_lift_lock.lock();
+}
 
-				uc_err err = uc_mem_write(uc, tx_bytes, &count, 4);
-				if (tx_bytes != 0) state->handle_write(tx_bytes, 4);
-				state->transmit_records.push_back({dup_buf, count});
-				int result = 0;
-				uc_reg_write(uc, UC_X86_REG_EAX, &result);
-				state->symbolic_registers.erase(8);
-				state->symbolic_registers.erase(9);
-				state->symbolic_registers.erase(10);
-				state->symbolic_registers.erase(11);
-				state->interrupt_handled = true;
-				state->syscall_count++;
-				return;
+extern "C"
+void simunicorn_vex_unlock() {
+	vex_lift_lock.unlock();
+}
+
+/*
+ * back the page cache of cache_key with the shared memory object called name (e.g. "/angr-<hash>"), see SharedPages.
+ * the object is created with room for max_pages pages if it doesn't exist yet. returns the number of pages already in
+ * it, or -1 if it can't be opened or was created for a different binary_hash.
+ */
+extern "C"
+int64_t simunicorn_context_share_page_cache(CacheRegistry *context, uint64_t cache_key, const char *name, uint64_t binary_hash, uint64_t max_pages) {
+	SharedPages *shared;
+	{
+		std::lock_guard<std::mutex> guard(shared_page_objects_lock);
+		auto it = shared_page_objects.find(name);
+		if (it != shared_page_objects.end()) {
+			shared = it->second;
+			if (shared->binary_hash() != binary_hash) {
+				return -1;
+			}
+		} else {
+			shared = SharedPages::open(name, binary_hash, max_pages);
+			if (shared == NULL) {
+				return -1;
 			}
+			shared_page_objects[name] = shared;
 		}
 	}
-}
 
-static bool hook_mem_unmapped(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, void *user_data) {
-	State *state = (State *)user_data;
-	uint64_t start = address & ~0xFFFULL;
-	uint64_t end = (address + size - 1) & ~0xFFFULL;
+	context->share_pages(cache_key, shared);
+	return shared->count();
+}
 
-	// only hook nonwritable pages
-	if (type != UC_MEM_WRITE_UNMAPPED && state->map_cache(start, 0x1000) && (start == end || state->map_cache(end, 0x1000))) {
-		//LOG_D("handle unmapped page natively");
-		return true;
-	}
+extern "C"
+int64_t simunicorn_share_page_cache(uint64_t cache_key, const char *name, uint64_t binary_hash, uint64_t max_pages) {
+	return simunicorn_context_share_page_cache(&global_cache, cache_key, name, binary_hash, max_pages);
+}
 
+/*
+ * remove the shared memory object called name. processes that have it open keep their mapping.
+ */
+extern "C"
+bool simunicorn_unlink_shared_page_cache(const char *name) {
+#ifdef _MSC_VER
 	return false;
+#else
+	return shm_unlink(name) == 0;
+#endif
 }
 
-static bool hook_mem_prot(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, void *user_data) {
-	State *state = (State *)user_data;
-	//printf("Segfault data: %d %#llx %d %#llx\n", type, address, size, value);
-	state->stop(STOP_SEGFAULT);
-	return true;
+extern "C"
+void simunicorn_cache_set_budget(uint64_t bytes) {
+	global_cache.set_budget(bytes);
+}
+
+extern "C"
+void simunicorn_cache_stats(cache_stats_t *out) {
+	global_cache.get_stats(out);
 }
 
 /*
- * C style bindings makes it simple and dirty
+ * set the level of the native log (enum llevel_t) and flush it every writer_interval_ms from a background thread, or
+ * only on simunicorn_flush_log if that's 0. levels above LOG_MIN_LEVEL were compiled out.
  */
-
 extern "C"
-State *simunicorn_alloc(uc_engine *uc, uint64_t cache_key) {
-	State *state = new State(uc, cache_key);
-	return state;
+void simunicorn_set_log(int level, uint64_t writer_interval_ms) {
+#if LOG_MIN_LEVEL > LOG_LEVEL_OFF
+	logSetLogLevel((enum llevel_t)level);
+	if (writer_interval_ms > 0) {
+		logStartWriter((unsigned)writer_interval_ms);
+	} else {
+		logStopWriter();
+	}
+#endif
 }
 
+/*
+ * write out the queued native log records, returning how many there were.
+ */
 extern "C"
-void simunicorn_dealloc(State *state) {
-	delete state;
+uint64_t simunicorn_flush_log() {
+#if LOG_MIN_LEVEL > LOG_LEVEL_OFF
+	return logFlush();
+#else
+	return 0;
+#endif
 }
 
 extern "C"
@@ -1271,23 +5089,56 @@ uc_err simunicorn_start(State *state, uint64_t pc, uint64_t step) {
 	return state->start(pc, step);
 }
 
+/*
+ * run count states one after the other, state i from pcs[i] for at most
+ * steps[i] blocks, and collect what python needs from each of them into
+ * results. each state has to be hooked already, as for simunicorn_start.
+ */
+extern "C"
+void simunicorn_start_batch(uint64_t count, State **states, uint64_t *pcs, uint64_t *steps, batch_result_t *results) {
+	uint64_t updates_used = 0, data_used = 0;
+
+	for (uint64_t i = 0; i < count; i++) {
+		State *state = states[i];
+		results->errors[i] = state->start(pcs[i], steps[i]);
+		results->stop_reasons[i] = state->stop_reason;
+		results->steps[i] = state->cur_steps;
+		results->stopping_registers[i] = state->stopping_register;
+		results->stopping_memory[i] = state->stopping_memory;
+
+		uint64_t total_updates, total_bytes;
+		state->sync_size(&total_updates, &total_bytes);
+
+		mem_update_t *updates = results->updates + updates_used;
+		uint8_t *data = results->data + data_used;
+		uint64_t n = state->sync(updates, results->max_updates - updates_used, data, results->data_size - data_used);
+		uint64_t bytes = 0;
+		for (uint64_t j = 0; j < n; j++) {
+			bytes += updates[j].length;
+			updates[j].offset += data_used;
+		}
+
+		results->update_first[i] = updates_used;
+		results->update_count[i] = n;
+		results->update_truncated[i] = n != total_updates;
+		updates_used += n;
+		data_used += bytes;
+	}
+}
+
 extern "C"
 void simunicorn_stop(State *state, stop_t reason) {
 	state->stop(reason);
 }
 
 extern "C"
-mem_update_t *simunicorn_sync(State *state) {
-	return state->sync();
+void simunicorn_sync_size(State *state, uint64_t *count, uint64_t *bytes) {
+	state->sync_size(count, bytes);
 }
 
 extern "C"
-void simunicorn_destroy(mem_update_t * head) {
-	mem_update_t *next;
-	for (mem_update_t *cur = head; cur; cur = next) {
-		next = cur->next;
-		delete cur;
-	}
+uint64_t simunicorn_sync(State *state, mem_update_t *updates, uint64_t max_updates, uint8_t *data, uint64_t data_size) {
+	return state->sync(updates, max_updates, data, data_size);
 }
 
 extern "C"
@@ -1301,27 +5152,36 @@ void simunicorn_set_stops(State *state, uint64_t count, uint64_t *stops)
 	state->set_stops(count, stops);
 }
 
+extern "C"
+void simunicorn_add_stops(State *state, uint64_t count, uint64_t *stops)
+{
+	state->add_stops(count, stops);
+}
+
+extern "C"
+void simunicorn_remove_stops(State *state, uint64_t count, uint64_t *stops)
+{
+	state->remove_stops(count, stops);
+}
+
 extern "C"
 void simunicorn_activate_page(State *state, uint64_t address, uint8_t *taint, uint8_t *data) {
     state->page_activate(address, taint, data);
 }
 
 extern "C"
-uint64_t simunicorn_executed_pages(State *state) { // this is HORRIBLE
-	if (state->executed_pages_iterator == NULL) {
-		state->executed_pages_iterator = new std::unordered_set<uint64_t>::iterator;
-		*state->executed_pages_iterator = state->executed_pages.begin();
-	}
+void simunicorn_activate_pages(State *state, uint64_t address, uint64_t count, uint8_t **taint, uint8_t **data) {
+	state->page_activate_range(address, count, taint, data);
+}
 
-	if (*state->executed_pages_iterator == state->executed_pages.end()) {
-		delete state->executed_pages_iterator;
-		state->executed_pages_iterator = NULL;
-		return -1;
+extern "C"
+uint64_t simunicorn_executed_pages(State *state, uint64_t *pages, uint64_t max) {
+	// fill up to max pages, and return how many there are in total
+	uint64_t i = 0;
+	for (auto it = state->executed_pages.begin(); it != state->executed_pages.end() && i < max; it++) {
+		pages[i++] = *it;
 	}
-
-	uint64_t out = **state->executed_pages_iterator;
-	(*state->executed_pages_iterator)++;
-	return out;
+	return state->executed_pages.size();
 }
 
 //
@@ -1355,17 +5215,43 @@ void simunicorn_symbolic_register_data(State *state, uint64_t count, uint64_t *o
 	{
 		state->symbolic_registers.insert(offsets[i]);
 	}
+	state->entry_symbolic_registers = state->symbolic_registers;
+}
+
+/*
+ * like symbolic_register_data, from sorted runs of offsets in place of every single one
+ */
+extern "C"
+void simunicorn_symbolic_register_ranges(State *state, uint64_t count, register_range_t *ranges)
+{
+	state->symbolic_registers.clear();
+	for (uint64_t i = 0; i < count; i++) {
+		state->symbolic_registers.insert(ranges[i].offset, ranges[i].length);
+	}
+	state->entry_symbolic_registers = state->symbolic_registers;
+}
+
+/*
+ * copy out up to max of the runs of register bytes whose taint changed since python set it, first the ones that
+ * became concrete. returns how many there are: usually none, when python can keep using the set it passed in.
+ */
+extern "C"
+uint64_t simunicorn_symbolic_register_changes(State *state, register_change_t *out, uint64_t max)
+{
+	std::vector<register_change_t> changes;
+	state->symbolic_registers.changes_since(state->entry_symbolic_registers, changes);
+	std::copy(changes.begin(), changes.begin() + std::min<uint64_t>(max, changes.size()), out);
+	return changes.size();
 }
 
 extern "C"
 uint64_t simunicorn_get_symbolic_registers(State *state, uint64_t *output)
 {
 	int i = 0;
-	for (auto r : state->symbolic_registers)
-	{
+	state->symbolic_registers.for_each([&](uint64_t r) {
 		output[i] = r;
 		i++;
-	}
+	});
 	return i;
 }
 
@@ -1391,34 +5277,76 @@ bool simunicorn_is_interrupt_handled(State *state) {
 
 extern "C"
 void simunicorn_set_transmit_sysno(State *state, uint32_t sysno, uint64_t bbl_addr) {
-	state->transmit_sysno = sysno;
-	state->transmit_bbl_addr = bbl_addr;
+	state->set_syscall(sysno, SYSCALL_HANDLER_TRANSMIT, bbl_addr);
 }
 
+/*
+ * the concrete transmits of the last run: returns the arena with all their bytes, of *size bytes, and points *records
+ * at the *count records indexing it. both belong to the state and stay valid until the next run.
+ */
 extern "C"
-transmit_record_t *simunicorn_process_transmit(State *state, uint32_t num) {
-	if (num >= state->transmit_records.size()) {
-		for (auto record_iter = state->transmit_records.begin();
-				record_iter != state->transmit_records.end();
-				record_iter++) {
-			free(record_iter->data);
-		}
-		state->transmit_records.clear();
+uint8_t *simunicorn_transmits(State *state, transmit_record_t **records, uint64_t *count, uint64_t *size) {
+	*records = state->transmit_records.data();
+	*count = state->transmit_records.size();
+	*size = state->transmit_arena.size();
+	return state->transmit_arena.data();
+}
+
+
+/*
+ * Native syscalls
+ */
+
+extern "C"
+void simunicorn_set_syscall(State *state, uint32_t sysno, uint32_t handler, uint64_t bbl_addr) {
+	state->set_syscall(sysno, (syscall_handler_t)handler, bbl_addr);
+}
+
+extern "C"
+void simunicorn_set_receive_data(State *state, uint32_t fd, uint8_t *data, uint64_t size) {
+	state->set_receive_data(fd, data, size);
+}
+
+extern "C"
+void simunicorn_set_allocation(State *state, uint64_t base, uint64_t max_length, bool nx) {
+	state->set_allocation(base, max_length, nx);
+}
+
+extern "C"
+void simunicorn_set_random_seed(State *state, uint64_t seed) {
+	state->set_random_seed(seed);
+}
+
+extern "C"
+void simunicorn_syscall_results(State *state, syscall_results_t *results) {
+	state->get_syscall_results(results);
+}
+
+/*
+ * copy out up to max of the memory map changes, in the order they were made. returns how many there are.
+ */
+extern "C"
+uint64_t simunicorn_map_changes(State *state, map_change_t *out, uint64_t max) {
+	uint64_t count = std::min<uint64_t>(max, state->map_changes.size());
+	std::copy(state->map_changes.begin(), state->map_changes.begin() + count, out);
+	return state->map_changes.size();
+}
+
+extern "C"
+receive_record_t *simunicorn_process_receive(State *state, uint32_t num) {
+	if (num >= state->receive_records.size()) {
 		return NULL;
-	} else {
-		transmit_record_t *out = &state->transmit_records[num];
-		return out;
 	}
+	return &state->receive_records[num];
 }
 
-
 /*
  * Page cache
  */
 
 extern "C"
 bool simunicorn_cache_page(State *state, uint64_t address, uint64_t length, char *bytes, uint64_t permissions) {
-	//LOG_I("caching [%#lx, %#lx]", address, address + length);
+	LOG_D("caching [%#" PRIx64 ", %#" PRIx64 "]", address, address + length);
 
 	auto actual = state->cache_page(address, length, bytes, permissions);
 	if (!state->map_cache(actual.first, actual.second)) {
@@ -1444,6 +5372,77 @@ void simunicorn_set_tracking(State *state, bool track_bbls, bool track_stack) {
 	state->track_stack = track_stack;
 }
 
+/*
+ * count edges AFL-style in map, which holds COVERAGE_MAP_SIZE bytes and must
+ * outlive the State, or stop with NULL. see State::set_coverage.
+ */
+extern "C"
+void simunicorn_set_coverage(State *state, uint8_t *map, bool block_hook_only) {
+	state->set_coverage(map, block_hook_only);
+}
+
+extern "C"
+void simunicorn_profile_enable(State *state, bool enable) {
+	state->profiler.enable(enable);
+}
+
+extern "C"
+void simunicorn_profile_stats(State *state, profile_stats_t *stats) {
+	state->profiler.get_stats(stats);
+}
+
+extern "C"
+uint64_t simunicorn_profile_histogram(State *state, profile_block_t *blocks, uint64_t max) {
+	return state->profiler.get_histogram(blocks, max);
+}
+
+/*
+ * in stretches with no taint live, commit only every interval blocks (0 or 1
+ * to commit every block, the default)
+ */
+extern "C"
+void simunicorn_set_checkpoint_interval(State *state, uint64_t interval) {
+	state->set_checkpoint_interval(interval);
+}
+
+extern "C"
+void simunicorn_set_scoped_hooks(State *state, bool scoped_hooks) {
+	state->set_scoped_hooks(scoped_hooks);
+}
+
+extern "C"
+void simunicorn_set_guard_pages(State *state, bool guard_pages) {
+	state->set_guard_pages(guard_pages);
+}
+
+extern "C"
+void simunicorn_set_undo_log(State *state, bool undo_log) {
+	state->set_undo_log(undo_log);
+}
+
+/*
+ * record the block and stack pointer traces into rings of capacity bytes,
+ * in delta mode if delta is set, instead of unbounded arrays. a capacity of 0
+ * goes back to the arrays. must be set before starting.
+ */
+extern "C"
+void simunicorn_set_trace(State *state, uint64_t capacity, bool delta) {
+	state->bbl_trace.configure(capacity, delta);
+	state->stack_trace.configure(capacity, delta);
+}
+
+extern "C"
+void simunicorn_trace_stats(State *state, trace_kind_t kind, uint64_t *entries, uint64_t *size, uint64_t *dropped) {
+	TraceRing *trace = kind == TRACE_BBL_ADDRS ? &state->bbl_trace : &state->stack_trace;
+	trace->stats(entries, size, dropped);
+}
+
+extern "C"
+uint64_t simunicorn_trace_drain(State *state, trace_kind_t kind, uint8_t *out, uint64_t size, uint64_t *start) {
+	TraceRing *trace = kind == TRACE_BBL_ADDRS ? &state->bbl_trace : &state->stack_trace;
+	return trace->drain(out, size, start);
+}
+
 extern "C"
 bool simunicorn_in_cache(State *state, uint64_t address) {
 	return state->in_cache(address);
@@ -1,11 +1,15 @@
 import nose
 import angr
+import archinfo
 import pickle
 import re
 from angr import options as so
 from nose.plugins.attrib import attr
 import gc
 import os
+import struct
+import threading
+import time
 
 test_location = os.path.join(os.path.dirname(os.path.realpath(__file__)), '..', '..')
 
@@ -86,9 +90,9 @@ def test_stops():
     nose.tools.assert_equal(p_segfault_angr.history.bbl_addrs.hardcopy, p_segfault.history.bbl_addrs.hardcopy)
     nose.tools.assert_equal(pg_segfault_angr.errored[0].error.addr, pg_segfault.errored[0].error.addr)
 
-def run_longinit(arch):
+def run_longinit(arch, add_options=frozenset()):
     p = angr.Project(os.path.join(test_location, 'binaries', 'tests', arch, 'longinit'))
-    s_unicorn = p.factory.entry_state(add_options=so.unicorn, remove_options={so.SHORT_READS})
+    s_unicorn = p.factory.entry_state(add_options=so.unicorn | set(add_options), remove_options={so.SHORT_READS})
     pg = p.factory.simulation_manager(s_unicorn, save_unconstrained=True, save_unsat=True)
     pg.explore()
     s = pg.deadended[0]
@@ -128,6 +132,30 @@ def test_fauxware():
         b'Username: \nPassword: \nWelcome to the admin console, trusted user!\n'
     )))
 
+def _trace_lineage(p, capacity=None, delta=False):
+    s = p.factory.entry_state(add_options=so.unicorn, stdin=b'username\npassword\n')
+    s.unicorn.trace_capacity = capacity
+    s.unicorn.trace_delta = delta
+    pg = p.factory.simulation_manager(s)
+    pg.run()
+    nose.tools.assert_equal(len(pg.deadended), 1)
+    return [ list(h.recent_bbl_addrs) for h in pg.one_deadended.history.lineage ]
+
+def test_drain_trace():
+    p = angr.Project(os.path.join(test_location, 'binaries', 'tests', 'i386', 'fauxware'))
+    reference = _trace_lineage(p)
+
+    for delta in (False, True):
+        # a ring big enough for every run gives the same blocks as the unbounded trace
+        nose.tools.assert_equal(_trace_lineage(p, 1 << 20, delta), reference)
+
+        # a small one keeps the most recent blocks of each run
+        small = _trace_lineage(p, 16, delta)
+        nose.tools.assert_equal(len(small), len(reference))
+        for full, kept in zip(reference, small):
+            nose.tools.assert_equal(kept, full[len(full) - len(kept):])
+        assert any(len(kept) < len(full) for full, kept in zip(reference, small))
+
 def test_fauxware_aggressive():
     p = angr.Project(os.path.join(test_location, 'binaries', 'tests', 'i386', 'fauxware'))
     s_unicorn = p.factory.entry_state(
@@ -238,6 +266,163 @@ def test_concrete_transmits():
 
     nose.tools.assert_equal(pg_unicorn.one_active.posix.dumps(1), b'1) Add number to the array\n2) Add random number to the array\n3) Sum numbers\n4) Exit\nRandomness added\n1) Add number to the array\n2) Add random number to the array\n3) Sum numbers\n4) Exit\n  Index: \n1) Add number to the array\n2) Add random number to the array\n3) Sum numbers\n4) Exit\n')
 
+# i386 cgc: receive, fdwait, allocate, deallocate, allocate again and random, each storing its results below esp
+_CGC_SYSCALLS = bytes.fromhex(
+    '8dac2400f8ffff'    # lea ebp, [esp-0x800]
+    'b803000000'        # mov eax, 3
+    '31db'              # xor ebx, ebx
+    '89e9'              # mov ecx, ebp
+    'ba10000000'        # mov edx, 16
+    '8d7540'            # lea esi, [ebp+0x40]
+    'cd80'              # int 0x80
+    '894544'            # mov [ebp+0x44], eax
+    'b804000000'        # mov eax, 4
+    'bb02000000'        # mov ebx, 2
+    '8d4d50'            # lea ecx, [ebp+0x50]
+    '8d5554'            # lea edx, [ebp+0x54]
+    '31f6'              # xor esi, esi
+    '8d7d58'            # lea edi, [ebp+0x58]
+    'cd80'              # int 0x80
+    '89455c'            # mov [ebp+0x5c], eax
+    'b805000000'        # mov eax, 5
+    'bb00200000'        # mov ebx, 0x2000
+    '31c9'              # xor ecx, ecx
+    '8d5560'            # lea edx, [ebp+0x60]
+    'cd80'              # int 0x80
+    '894564'            # mov [ebp+0x64], eax
+    '8b5560'            # mov edx, [ebp+0x60]
+    'c7820010000044434241' # mov dword [edx+0x1000], 0x41424344
+    'b806000000'        # mov eax, 6
+    '8b5d60'            # mov ebx, [ebp+0x60]
+    'b900100000'        # mov ecx, 0x1000
+    'cd80'              # int 0x80
+    '894568'            # mov [ebp+0x68], eax
+    'b805000000'        # mov eax, 5
+    'bb00100000'        # mov ebx, 0x1000
+    '31c9'              # xor ecx, ecx
+    '8d5570'            # lea edx, [ebp+0x70]
+    'cd80'              # int 0x80
+    '894574'            # mov [ebp+0x74], eax
+    'b807000000'        # mov eax, 7
+    '8d9d80000000'      # lea ebx, [ebp+0x80]
+    'b910000000'        # mov ecx, 16
+    '8d9590000000'      # lea edx, [ebp+0x90]
+    'cd80'              # int 0x80
+    '898594000000'      # mov [ebp+0x94], eax
+    'b801000000'        # mov eax, 1
+    '31db'              # xor ebx, ebx
+    'cd80'              # int 0x80
+)
+# i386 cgc: receive with the count left in edx, then terminate
+_CGC_RECEIVE_EDX = bytes.fromhex(
+    '8dac2400f8ffff'    # lea ebp, [esp-0x800]
+    'b803000000'        # mov eax, 3
+    '31db'              # xor ebx, ebx
+    '89e9'              # mov ecx, ebp
+    '8d7540'            # lea esi, [ebp+0x40]
+    'cd80'              # int 0x80
+    '894544'            # mov [ebp+0x44], eax
+    'b801000000'        # mov eax, 1
+    '31db'              # xor ebx, ebx
+    'cd80'              # int 0x80
+)
+_CGC_CODE = 0x20000000
+_CGC_INPUT = b'0123456789abcdef'
+_CGC_OPTIONS = {so.CGC_NO_SYMBOLIC_RECEIVE_LENGTH, so.CGC_NON_BLOCKING_FDS}
+
+def _cgc_syscall_state(p, code, native):
+    add_options = _CGC_OPTIONS | (so.unicorn | {so.UNICORN_HANDLE_CGC_SYSCALLS} if native else set())
+    s = p.factory.blank_state(addr=_CGC_CODE, add_options=add_options, stdin=_CGC_INPUT, flag_page=b'\0'*4096)
+    s.memory.map_region(_CGC_CODE, 0x1000, 7)
+    s.memory.store(_CGC_CODE, code)
+    if native:
+        s.unicorn.receive_data = {0: _CGC_INPUT}
+        s.unicorn.random_seed = 0x1234
+    return s
+
+def _cgc_run(s):
+    pg = s.project.factory.simulation_manager(s)
+    pg.run()
+    nose.tools.assert_equal(len(pg.deadended), 1)
+    return pg.one_deadended
+
+def _cgc_load(s, offset, size=4):
+    # the results the code stored at ebp + offset
+    ebp = s.solver.eval(s.regs.ebp)
+    return s.solver.eval(s.memory.load(ebp + offset, size, endness='Iend_LE'))
+
+def _splitmix64(seed, count):
+    out = b''
+    mask = 2**64 - 1
+    while len(out) < count:
+        seed = (seed + 0x9E3779B97F4A7C15) & mask
+        z = seed
+        z = ((z ^ (z >> 30)) * 0xBF58476D1CE4E5B9) & mask
+        z = ((z ^ (z >> 27)) * 0x94D049BB133111EB) & mask
+        z ^= z >> 31
+        out += struct.pack('<Q', z)
+    return out[:count], seed
+
+def test_cgc_syscalls():
+    from angr.state_plugins.unicorn_engine import STOP
+    p = angr.Project(os.path.join(test_location, 'binaries', 'tests', 'cgc', 'PIZZA_00001'))
+
+    # unicorn goes through everything up to the allocate after deallocate, which is left to python
+    probe = _cgc_syscall_state(p, _CGC_SYSCALLS, True)
+    probe.unicorn.setup()
+    _unicorn_step(probe, None)
+    nose.tools.assert_equal(probe.unicorn.stop_reason, STOP.STOP_SYSCALL)
+    nose.tools.assert_equal(probe.solver.eval(probe.regs.eax), 5)
+    nose.tools.assert_equal(probe.solver.eval(probe.regs.ebx), 0x1000)
+    nose.tools.assert_equal(probe.unicorn.receive_data[0], b'')
+
+    native = _cgc_run(_cgc_syscall_state(p, _CGC_SYSCALLS, True))
+    simproc = _cgc_run(_cgc_syscall_state(p, _CGC_SYSCALLS, False))
+
+    # receive, fdwait, allocate, deallocate and allocate again leave the same results as their simprocedures
+    for offset in (0x40, 0x44, 0x50, 0x54, 0x58, 0x5c, 0x60, 0x64, 0x68, 0x70, 0x74, 0x90, 0x94):
+        nose.tools.assert_equal(_cgc_load(native, offset), _cgc_load(simproc, offset))
+    nose.tools.assert_equal(_cgc_load(native, 0, 16), _cgc_load(simproc, 0, 16))
+    nose.tools.assert_equal(_cgc_load(native, 0, 16), int.from_bytes(_CGC_INPUT, 'little'))
+    nose.tools.assert_equal(native.solver.eval(native.cgc.allocation_base), simproc.solver.eval(simproc.cgc.allocation_base))
+    nose.tools.assert_equal(native.posix.stdin.pos, simproc.posix.stdin.pos)
+    allocated = _cgc_load(native, 0x60)
+    nose.tools.assert_equal(_cgc_load(native, 0x70), allocated)
+    nose.tools.assert_equal(native.solver.eval(native.memory.load(allocated + 0x1000, 4, endness='Iend_LE')), 0x41424344)
+
+    # random is concrete where the simprocedure's is unconstrained
+    data, seed = _splitmix64(0x1234, 16)
+    nose.tools.assert_equal(_cgc_load(native, 0x80, 16), int.from_bytes(data, 'little'))
+    nose.tools.assert_equal(native.unicorn.random_seed, seed)
+    ebp = simproc.solver.eval(simproc.regs.ebp)
+    nose.tools.assert_true(simproc.memory.load(ebp + 0x80, 16).symbolic)
+
+def test_cgc_syscalls_symbolic_argument():
+    from angr.state_plugins.unicorn_engine import STOP
+    p = angr.Project(os.path.join(test_location, 'binaries', 'tests', 'cgc', 'PIZZA_00001'))
+
+    # a symbolic count sends receive to its simprocedure, without consuming any of the native input
+    states = [ ]
+    for native in (True, False):
+        s = _cgc_syscall_state(p, _CGC_RECEIVE_EDX, native)
+        s.regs.edx = s.solver.BVS('count', 32)
+        s.add_constraints(s.regs.edx > 0, s.regs.edx <= 16)
+        states.append(s)
+
+    probe = states[0].copy()
+    probe.unicorn.setup()
+    _unicorn_step(probe, None)
+    nose.tools.assert_equal(probe.unicorn.stop_reason, STOP.STOP_SYSCALL)
+    nose.tools.assert_equal(probe.solver.eval(probe.regs.eax), 3)
+    nose.tools.assert_equal(probe.unicorn.receive_data[0], _CGC_INPUT)
+
+    native, simproc = (_cgc_run(s) for s in states)
+    nose.tools.assert_equal(native.unicorn.receive_data[0], _CGC_INPUT)
+    nose.tools.assert_equal(sorted(native.solver.eval_upto(native.posix.stdin.pos, 32)),
+                            sorted(simproc.solver.eval_upto(simproc.posix.stdin.pos, 32)))
+    nose.tools.assert_equal(sorted(native.solver.eval_upto(native.memory.load(native.regs.ebp + 0x40, 4, endness='Iend_LE'), 32)),
+                            sorted(simproc.solver.eval_upto(simproc.memory.load(simproc.regs.ebp + 0x40, 4, endness='Iend_LE'), 32)))
+
 def test_inspect():
     p = angr.Project(os.path.join(test_location, 'binaries', 'tests', 'i386', 'uc_stop'))
 
@@ -324,6 +509,405 @@ def test_single_step():
     nose.tools.assert_equal(len(successors2), 1)
     nose.tools.assert_equal(successors2[0].addr, step5)
 
+# x86-64: store rcx in slot rcx % 512 of the qwords at rdi, until rcx reaches rdx
+_PARALLEL_LOOP = bytes.fromhex(
+    '4889c8'        # mov rax, rcx
+    '4825ff010000'  # and rax, 0x1ff
+    '48890cc7'      # mov [rdi+rax*8], rcx
+    '48ffc1'        # inc rcx
+    '4839d1'        # cmp rcx, rdx
+    '72eb'          # jb loop
+    'f4'            # hlt
+)
+_PARALLEL_CODE = 0x400000
+_PARALLEL_DATA = 0x1000000
+
+def _parallel_states(native, context, count, iterations):
+    import unicorn
+    from unicorn import x86_const
+    states = [ ]
+    for _ in range(count):
+        uc = unicorn.Uc(unicorn.UC_ARCH_X86, unicorn.UC_MODE_64)
+        uc.mem_map(_PARALLEL_CODE, 0x1000, unicorn.UC_PROT_READ | unicorn.UC_PROT_EXEC)
+        uc.mem_write(_PARALLEL_CODE, _PARALLEL_LOOP)
+        uc.mem_map(_PARALLEL_DATA, 0x1000, unicorn.UC_PROT_READ | unicorn.UC_PROT_WRITE)
+        uc.reg_write(x86_const.UC_X86_REG_RCX, 0)
+        uc.reg_write(x86_const.UC_X86_REG_RDX, iterations)
+        uc.reg_write(x86_const.UC_X86_REG_RDI, _PARALLEL_DATA)
+        # all on the same key of the one context
+        state = native.context_alloc_state(context, uc._uch, 1, unicorn.UC_ARCH_X86, unicorn.UC_MODE_64)
+        native.activate_page(state, _PARALLEL_DATA, bytes(0x1000), None)
+        native.hook(state)
+        states.append((uc, state))
+    return states
+
+def _run_parallel_states(native, states, iterations, threaded):
+    def run(state):
+        native.start(state, _PARALLEL_CODE, iterations + 16)
+
+    start = time.perf_counter()
+    if threaded:
+        threads = [ threading.Thread(target=run, args=(state,)) for _, state in states ]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+    else:
+        for _, state in states:
+            run(state)
+    return time.perf_counter() - start
+
+def _check_parallel_states(iterations, count):
+    from angr.state_plugins.unicorn_engine import _UC_NATIVE as native, CACHE_STATS
+
+    expected = [ k + 512 * ((iterations - 1 - k) // 512) for k in range(512) ]
+
+    context = native.context_alloc()
+    sequential = _parallel_states(native, context, count, iterations)
+    parallel = _parallel_states(native, context, count, iterations)
+    stats = CACHE_STATS()
+    native.context_stats(context, stats)
+    nose.tools.assert_equal(stats.keys_resident, 1)
+
+    sequential_time = _run_parallel_states(native, sequential, iterations, False)
+    parallel_time = _run_parallel_states(native, parallel, iterations, True)
+
+    # every state ran the whole loop, the same way, and left its own memory alone
+    steps = native.step(sequential[0][1])
+    nose.tools.assert_greater_equal(steps, iterations)
+    for uc, state in sequential + parallel:
+        nose.tools.assert_equal(native.step(state), steps)
+        nose.tools.assert_equal(native.stop_reason(state), native.stop_reason(sequential[0][1]))
+        data = bytes(uc.mem_read(_PARALLEL_DATA, 512 * 8))
+        nose.tools.assert_equal(list(struct.unpack('<512Q', data)), expected)
+
+    for _, state in sequential + parallel:
+        native.dealloc(state)
+    del sequential, parallel
+    gc.collect()
+    native.context_free(context)
+    return sequential_time, parallel_time
+
+def test_parallel_states():
+    _check_parallel_states(50000, max(2, min(4, os.cpu_count() or 1)))
+
+@attr(speed='slow')
+def test_parallel_states_speedup():
+    count = min(4, os.cpu_count() or 1)
+    if count < 2:
+        raise nose.SkipTest("needs at least two cpus")
+    sequential_time, parallel_time = _check_parallel_states(500000, count)
+
+    # near-linear: at least half the ideal speedup
+    speedup = sequential_time / parallel_time
+    assert speedup >= max(1.2, count / 2), "%d states ran %.2fx faster on threads" % (count, speedup)
+
+def _sync_updates(native, state):
+    from angr.state_plugins.unicorn_engine import MEM_PATCH
+    import ctypes
+    update_count = ctypes.c_uint64()
+    update_bytes = ctypes.c_uint64()
+    native.sync_size(state, ctypes.byref(update_count), ctypes.byref(update_bytes))
+    if not update_count.value:
+        return [ ]
+    updates = (MEM_PATCH * update_count.value)()
+    data = ctypes.create_string_buffer(update_bytes.value)
+    n = native.sync(state, updates, update_count.value, ctypes.addressof(data), len(data))
+    return [ (u.address, data.raw[u.offset:u.offset + u.length]) for u in updates[:n] ]
+
+def _start_batch(native, states, steps, max_updates=0x1000, data_size=0x10000):
+    from angr.state_plugins.unicorn_engine import BATCH_RESULT, MEM_PATCH
+    import ctypes
+    count = len(states)
+    data = ctypes.create_string_buffer(data_size)
+    results = BATCH_RESULT(
+        (ctypes.c_int * count)(),
+        (ctypes.c_int * count)(),
+        (ctypes.c_uint64 * count)(),
+        (ctypes.c_uint64 * count)(),
+        (ctypes.c_uint64 * count)(),
+        (ctypes.c_uint64 * count)(),
+        (ctypes.c_uint64 * count)(),
+        (ctypes.c_uint8 * count)(),
+        (MEM_PATCH * max_updates)(),
+        max_updates,
+        ctypes.addressof(data),
+        data_size,
+    )
+    native.start_batch(count,
+        (ctypes.c_void_p * count)(*states),
+        (ctypes.c_uint64 * count)(*([ _PARALLEL_CODE ] * count)),
+        (ctypes.c_uint64 * count)(*steps),
+        ctypes.byref(results))
+
+    out = [ ]
+    for i in range(count):
+        if results.update_truncated[i]:
+            updates = None
+        else:
+            first = results.update_first[i]
+            updates = [ (u.address, data.raw[u.offset:u.offset + u.length])
+                        for u in results.updates[first:first + results.update_count[i]] ]
+        out.append((results.errors[i], results.stop_reasons[i], results.steps[i], updates))
+    return out
+
+def test_start_batch():
+    from angr.state_plugins.unicorn_engine import _UC_NATIVE as native
+
+    iterations = [ 300, 1000, 20, 5000 ]
+    steps = [ n + 16 for n in iterations ]
+    context = native.context_alloc()
+    sequential = [ _parallel_states(native, context, 1, n)[0] for n in iterations ]
+    batch = [ _parallel_states(native, context, 1, n)[0] for n in iterations ]
+    truncated = [ _parallel_states(native, context, 1, n)[0] for n in iterations ]
+
+    expected = [ ]
+    for (uc, state), step in zip(sequential, steps):
+        error = native.start(state, _PARALLEL_CODE, step)
+        expected.append((error, native.stop_reason(state), native.step(state), _sync_updates(native, state)))
+
+    # one native call gives every state the same results as its own start() and sync()
+    results = _start_batch(native, [ state for _, state in batch ], steps)
+    nose.tools.assert_equal(results, expected)
+    for (uc, _), (expected_uc, _) in zip(batch, sequential):
+        nose.tools.assert_equal(bytes(uc.mem_read(_PARALLEL_DATA, 0x1000)), bytes(expected_uc.mem_read(_PARALLEL_DATA, 0x1000)))
+
+    # a state whose updates do not fit is left to be synced on its own
+    results = _start_batch(native, [ state for _, state in truncated ], steps, data_size=20 * 8)
+    for (_, state), result, (error, stop_reason, step, updates) in zip(truncated, results, expected):
+        nose.tools.assert_equal(result[:3], (error, stop_reason, step))
+        if result[3] is None:
+            nose.tools.assert_equal(_sync_updates(native, state), updates)
+        else:
+            nose.tools.assert_equal(result[3], updates)
+    nose.tools.assert_equal([ result[3] is None for result in results ], [ True, True, False, True ])
+
+    for _, state in sequential + batch + truncated:
+        native.dealloc(state)
+    del sequential, batch, truncated
+    gc.collect()
+    native.context_free(context)
+
+def _unicorn_step(state, step):
+    # the rest of an engine step, once the unicorn plugin is set up
+    try:
+        state.unicorn.set_stops(set())
+        state.unicorn.set_tracking(track_bbls=so.UNICORN_TRACK_BBL_ADDRS in state.options,
+                                   track_stack=so.UNICORN_TRACK_STACK_POINTERS in state.options)
+        state.unicorn.hook()
+        state.unicorn.start(step=step)
+        state.unicorn.finish()
+    finally:
+        state.unicorn.destroy()
+
+def test_fork():
+    p = angr.load_shellcode(_PARALLEL_LOOP, 'amd64', load_address=_PARALLEL_CODE)
+    s = p.factory.blank_state(addr=_PARALLEL_CODE, add_options=so.unicorn)
+    s.memory.store(_PARALLEL_DATA, bytes(0x1000))
+    s.regs.rcx = 0
+    s.regs.rdx = 1000
+    s.regs.rdi = _PARALLEL_DATA
+
+    # run the parent for a while, then fork it onto copies once finish() synced memory back
+    s.unicorn.setup()
+    s.unicorn.set_stops(set())
+    s.unicorn.set_tracking(track_bbls=True, track_stack=True)
+    s.unicorn.hook()
+    s.unicorn.start(step=100)
+    s.unicorn.finish()
+    forked, changed, fresh = s.copy(), s.copy(), s.copy()
+    s.unicorn.fork(forked.unicorn)
+    s.unicorn.fork(changed.unicorn)
+    s.unicorn.destroy()
+    forked_uc, changed_uc = forked.unicorn._uc, changed.unicorn._uc
+
+    # a copy whose memory changed after the fork starts from an empty native state instead
+    changed.memory.store(_PARALLEL_DATA + 511 * 8, 0x4141414141414141, size=8, endness='Iend_LE')
+    changed.unicorn.setup()
+    nose.tools.assert_is_not(changed.unicorn._uc, changed_uc)
+    nose.tools.assert_is_none(changed.unicorn._fork_pages)
+    _unicorn_step(changed, 200)
+
+    # one that did not runs on the clone, and the same way as a copy that was not forked
+    forked.unicorn.setup()
+    nose.tools.assert_is(forked.unicorn._uc, forked_uc)
+    _unicorn_step(forked, 200)
+    fresh.unicorn.setup()
+    _unicorn_step(fresh, 200)
+
+    for state in (forked, changed):
+        nose.tools.assert_equal(state.unicorn.steps, fresh.unicorn.steps)
+        nose.tools.assert_equal(state.unicorn.stop_reason, fresh.unicorn.stop_reason)
+        nose.tools.assert_equal(state.solver.eval(state.regs.rcx), fresh.solver.eval(fresh.regs.rcx))
+    nose.tools.assert_equal(forked.solver.eval(forked.memory.load(_PARALLEL_DATA, 0x1000)),
+                            fresh.solver.eval(fresh.memory.load(_PARALLEL_DATA, 0x1000)))
+    nose.tools.assert_equal(changed.solver.eval(changed.memory.load(_PARALLEL_DATA + 511 * 8, 8, endness='Iend_LE')),
+                            0x4141414141414141)
+
+_COVERAGE_CODE = 0x401234
+
+def _coverage_run(p, coverage_map, block_hook_only):
+    s = p.factory.blank_state(addr=_COVERAGE_CODE, add_options=so.unicorn)
+    s.memory.store(_PARALLEL_DATA, bytes(0x1000))
+    s.regs.rcx = 0
+    s.regs.rdx = 1000
+    s.regs.rdi = _PARALLEL_DATA
+    s.unicorn.coverage_map = coverage_map
+    s.unicorn.coverage_block_hook_only = block_hook_only
+    s.unicorn.setup()
+    _unicorn_step(s, 100)
+    return s
+
+def _coverage_hash(addr):
+    return ((addr >> 4) ^ (addr << 8)) & 0xffff
+
+def test_coverage_map():
+    from angr.state_plugins.unicorn_engine import COVERAGE_MAP_SIZE
+    # the loop at an address whose blocks do not hash to 0
+    p = angr.load_shellcode(b'\xcc' * (_COVERAGE_CODE & 0xfff) + _PARALLEL_LOOP, 'amd64',
+                            load_address=_COVERAGE_CODE & ~0xfff)
+    entry = _coverage_hash(_COVERAGE_CODE)
+    loop = _coverage_hash(_COVERAGE_CODE) ^ (_coverage_hash(_COVERAGE_CODE) >> 1)
+
+    # the edge into the first block, then the loop edge for every block after it
+    coverage = bytearray(COVERAGE_MAP_SIZE)
+    s = _coverage_run(p, coverage, False)
+    edges = { i: count for i, count in enumerate(coverage) if count }
+    nose.tools.assert_equal(set(edges), { entry, loop })
+    nose.tools.assert_equal(edges[entry], 1)
+    nose.tools.assert_in(edges[loop], (s.unicorn.steps - 1, s.unicorn.steps))
+    nose.tools.assert_equal(s.solver.eval(s.memory.load(_PARALLEL_DATA + 8 * 50, 8, endness='Iend_LE')), 50)
+
+    # a shared map adds up the runs
+    _coverage_run(p, coverage, False)
+    nose.tools.assert_equal({ i: count for i, count in enumerate(coverage) if count },
+                            { i: 2 * count for i, count in edges.items() })
+
+    # with the block hook alone, the edges are the same
+    block_only = bytearray(COVERAGE_MAP_SIZE)
+    _coverage_run(p, block_only, True)
+    nose.tools.assert_equal({ i: count for i, count in enumerate(block_only) if count }, edges)
+
+    nose.tools.assert_raises(angr.errors.SimValueError, _coverage_run, p, bytearray(16), False)
+
+# x86-64: the store loop, then a store and a symbolic load in one block
+_SYMBOLIC_STOP = _PARALLEL_LOOP[:-1] + bytes.fromhex(
+    '48898ff80f0000'    # mov [rdi+0xff8], rcx
+    '488b06'            # mov rax, [rsi]
+    '4883c001'          # add rax, 1
+    'f4'                # hlt
+)
+_SYMBOLIC_DATA = 0x2000000
+_SYMBOLIC_STOP_ITERATIONS = 1000
+
+def _symbolic_stop_run(add_options=frozenset(), checkpoint_interval=None):
+    p = angr.load_shellcode(_SYMBOLIC_STOP, 'amd64', load_address=_PARALLEL_CODE)
+    s = p.factory.blank_state(addr=_PARALLEL_CODE, add_options=so.unicorn | set(add_options))
+    s.memory.store(_PARALLEL_DATA, bytes(0x1000))
+    s.memory.store(_SYMBOLIC_DATA, s.solver.BVS('symbolic', 64))
+    s.regs.rcx = 0
+    s.regs.rdx = _SYMBOLIC_STOP_ITERATIONS
+    s.regs.rdi = _PARALLEL_DATA
+    s.regs.rsi = _SYMBOLIC_DATA
+    if checkpoint_interval is not None:
+        s.unicorn.checkpoint_interval = checkpoint_interval
+    s.unicorn.setup()
+    _unicorn_step(s, None)
+
+    regs = tuple(s.solver.eval(getattr(s.regs, name)) for name in ('rax', 'rcx', 'rdx', 'rsi', 'rdi', 'rip'))
+    memory = s.solver.eval(s.memory.load(_PARALLEL_DATA, 0x1000), cast_to=bytes)
+    return s.unicorn.steps, s.unicorn.stop_reason, regs, memory, list(s.history.recent_bbl_addrs)
+
+def _fauxware_paths(add_options=frozenset(), checkpoint_interval=None):
+    p = angr.Project(os.path.join(test_location, 'binaries', 'tests', 'i386', 'fauxware'))
+    s = p.factory.entry_state(add_options=so.unicorn | set(add_options))
+    if checkpoint_interval is not None:
+        s.unicorn.checkpoint_interval = checkpoint_interval
+    pg = p.factory.simulation_manager(s)
+    pg.run()
+    return sorted((d.posix.dumps(1), tuple(d.history.bbl_addrs)) for d in pg.deadended)
+
+def test_concrete_checkpoints():
+    from angr.state_plugins.unicorn_engine import STOP
+
+    # the stop rolls back the store of its own block, which went to the last slot of the loop
+    reference = _symbolic_stop_run()
+    steps, stop_reason, regs, memory, bbl_addrs = reference
+    nose.tools.assert_equal(stop_reason, STOP.STOP_SYMBOLIC_MEM)
+    nose.tools.assert_greater_equal(steps, _SYMBOLIC_STOP_ITERATIONS)
+    nose.tools.assert_equal(regs[1], _SYMBOLIC_STOP_ITERATIONS)
+    nose.tools.assert_equal(list(struct.unpack('<512Q', memory)),
+                            [ k + 512 * ((_SYMBOLIC_STOP_ITERATIONS - 1 - k) // 512) for k in range(512) ])
+
+    # with checkpoints closer together than the stop, and further apart
+    for interval in (64, 4096):
+        nose.tools.assert_equal(_symbolic_stop_run({so.UNICORN_CONCRETE_CHECKPOINTS}, interval), reference)
+
+    paths = _fauxware_paths()
+    for interval in (4, 4096):
+        nose.tools.assert_equal(_fauxware_paths({so.UNICORN_CONCRETE_CHECKPOINTS}, interval), paths)
+
+# mips32 big endian: a store in one block, then a store and a symbolic load in the next
+_SYMBOLIC_STOP_BE = bytes.fromhex(
+    '3c080100'          # lui $t0, 0x0100
+    '3c090200'          # lui $t1, 0x0200
+    '3c0a1122'          # lui $t2, 0x1122
+    '354a3344'          # ori $t2, $t2, 0x3344
+    '3c0caabb'          # lui $t4, 0xaabb
+    '358cccdd'          # ori $t4, $t4, 0xccdd
+    'ad0c0004'          # sw $t4, 4($t0)
+    '10000001'          # b next
+    '00000000'          # nop
+    'ad0a0000'          # next: sw $t2, 0($t0)
+    '8d2b0000'          # lw $t3, 0($t1)
+    '256b0001'          # addiu $t3, $t3, 1
+    '1000ffff'          # end: b end
+    '00000000'          # nop
+)
+
+def _symbolic_stop_run_be(add_options=frozenset()):
+    p = angr.load_shellcode(_SYMBOLIC_STOP_BE, archinfo.ArchMIPS32('Iend_BE'), load_address=_PARALLEL_CODE)
+    s = p.factory.blank_state(addr=_PARALLEL_CODE, add_options=so.unicorn | set(add_options))
+    s.memory.store(_PARALLEL_DATA, bytes(0x1000))
+    s.memory.store(_SYMBOLIC_DATA, s.solver.BVS('symbolic', 32))
+    s.unicorn.setup()
+    _unicorn_step(s, None)
+
+    regs = tuple(s.solver.eval(getattr(s.regs, name)) for name in ('t0', 't1', 't2', 't4', 'pc'))
+    memory = s.solver.eval(s.memory.load(_PARALLEL_DATA, 0x10), cast_to=bytes)
+    return s.unicorn.steps, s.unicorn.stop_reason, regs, memory, list(s.history.recent_bbl_addrs)
+
+def test_guard_concrete_pages():
+    from angr.state_plugins.unicorn_engine import STOP
+    scoped = {so.UNICORN_SCOPED_MEM_HOOKS}
+    guarded = {so.UNICORN_SCOPED_MEM_HOOKS, so.UNICORN_GUARD_CONCRETE_PAGES}
+
+    # a store to the concrete data page, rolled back by the symbolic stop in its block
+    reference = _symbolic_stop_run()
+    nose.tools.assert_equal(_symbolic_stop_run(scoped), reference)
+    nose.tools.assert_equal(_symbolic_stop_run(guarded), reference)
+
+    # the same on a big endian engine, after a store that is kept
+    reference = _symbolic_stop_run_be()
+    nose.tools.assert_equal(reference[1], STOP.STOP_SYMBOLIC_MEM)
+    nose.tools.assert_equal(reference[3], bytes.fromhex('00000000aabbccdd') + bytes(8))
+    nose.tools.assert_equal(_symbolic_stop_run_be(scoped), reference)
+    nose.tools.assert_equal(_symbolic_stop_run_be(guarded), reference)
+
+    paths = _fauxware_paths()
+    nose.tools.assert_equal(_fauxware_paths(guarded), paths)
+
+def test_undo_log():
+    undo_log = {so.UNICORN_UNDO_LOG}
+
+    # the store rolled back by the symbolic stop is restored from the undo log instead
+    nose.tools.assert_equal(_symbolic_stop_run(undo_log), _symbolic_stop_run())
+    nose.tools.assert_equal(_symbolic_stop_run_be(undo_log), _symbolic_stop_run_be())
+    nose.tools.assert_equal(_fauxware_paths(undo_log), _fauxware_paths())
+
+    run_longinit('i386', undo_log)
+    run_longinit('x86_64', undo_log)
+
 if __name__ == '__main__':
     import logging
     logging.getLogger('angr.state_plugins.unicorn_engine').setLevel('DEBUG')